@@ -1,13 +1,553 @@
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <map>
+#include <cstring>
+#include <fcntl.h>
 #include <memory>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//===----------------------------------------------------------------------===//
+// Source Buffer
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// SourceBuffer - The program text as one contiguous range of characters,
+/// terminated by a NUL sentinel so the lexer can scan with a bare pointer.
+/// Regular files are mmap'ed, pipes are slurped with large block reads, and an
+/// interactive terminal is filled incrementally through refill(), so the REPL
+/// and batch mode share one lexer.
+class SourceBuffer {
+    std::string Name;
+    int FD = -1;
+    bool Interactive = false;
+    bool AtEOF = false;
+
+    char *MapBase = nullptr; // non-null if the text is an mmap'ed file
+    size_t MapSize = 0;
+    std::vector<char> Storage; // heap copy of the text plus the sentinel
+
+    const char *Start = nullptr;
+    size_t Size = 0;
+
+    // Offsets of the line starts in [0, LinesScanned), for getLineAndColumn.
+    mutable std::vector<uint32_t> LineStarts = {0};
+    mutable size_t LinesScanned = 0;
+
+    SourceBuffer(std::string Name): Name(std::move(Name)) {}
+
+    /// readAll - Drain FD into Storage with large block reads.
+    bool readAll() {
+        size_t Len = 0;
+        Storage.resize(1 << 16);
+        while(true) {
+            if(Len == Storage.size()) { Storage.resize(Storage.size() * 2); }
+            ssize_t N = ::read(FD, Storage.data() + Len, Storage.size() - Len);
+            if(N < 0 && errno == EINTR) { continue; }
+            if(N < 0) { return false; }
+            if(N == 0) { break; }
+            Len += N;
+        }
+        Storage.resize(Len);
+        setStorage();
+        return true;
+    }
+
+    /// setStorage - Append the sentinel and point the view at Storage.
+    void setStorage() {
+        Storage.push_back('\0');
+        Start = Storage.data();
+        Size = Storage.size() - 1;
+    }
+
+public:
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+    ~SourceBuffer() {
+        if(MapBase) { munmap(MapBase, MapSize); }
+        if(FD > STDERR_FILENO) { close(FD); }
+    }
+
+    /// getFile - Map the file at Path. Returns nullptr (after reporting) if it
+    /// cannot be read.
+    static std::unique_ptr<SourceBuffer> getFile(const std::string &Path) {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer(Path));
+        SB->FD = open(Path.c_str(), O_RDONLY);
+        struct stat St;
+        if(SB->FD < 0 || fstat(SB->FD, &St) != 0) {
+            fprintf(stderr, "Error: cannot open '%s': %s\n", Path.c_str(),
+                    strerror(errno));
+            return nullptr;
+        }
+
+        // mmap zero-fills the tail of the last page, which doubles as the
+        // sentinel. A file that ends exactly on a page boundary has no such
+        // tail, so it (like a FIFO or device) is read into memory instead.
+        size_t PageSize = sysconf(_SC_PAGESIZE);
+        size_t FileSize = St.st_size;
+        if(S_ISREG(St.st_mode) && FileSize % PageSize != 0) {
+            void *Base = mmap(nullptr, FileSize, PROT_READ, MAP_PRIVATE,
+                              SB->FD, 0);
+            if(Base != MAP_FAILED) {
+                SB->MapBase = static_cast<char *>(Base);
+                SB->MapSize = FileSize;
+                SB->Start = SB->MapBase;
+                SB->Size = FileSize;
+                return SB;
+            }
+        }
+        if(!SB->readAll()) {
+            fprintf(stderr, "Error: cannot read '%s': %s\n", Path.c_str(),
+                    strerror(errno));
+            return nullptr;
+        }
+        return SB;
+    }
+
+    /// getSTDIN - Wrap standard input. A terminal is read lazily a chunk
+    /// (typically a line) at a time; anything else is read up front.
+    static std::unique_ptr<SourceBuffer> getSTDIN() {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer("<stdin>"));
+        SB->FD = STDIN_FILENO;
+        if(isatty(STDIN_FILENO)) {
+            SB->Interactive = true;
+            SB->setStorage();
+            return SB;
+        }
+        if(!SB->readAll()) {
+            fprintf(stderr, "Error: cannot read <stdin>: %s\n", strerror(errno));
+            return nullptr;
+        }
+        return SB;
+    }
+
+    /// getMemBuffer - Copy Text into a new buffer.
+    static std::unique_ptr<SourceBuffer> getMemBuffer(const std::string &Text,
+                                                      std::string Name = "<memory>") {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer(std::move(Name)));
+        SB->Storage.assign(Text.begin(), Text.end());
+        SB->setStorage();
+        return SB;
+    }
+
+    const std::string &getName() const { return Name; }
+    const char *getBufferStart() const { return Start; }
+    const char *getBufferEnd() const { return Start + Size; } // at the sentinel
+    size_t getBufferSize() const { return Size; }
+    bool isInteractive() const { return Interactive; }
+
+    /// getLineAndColumn - The 1-based line and column of the byte at Offset.
+    /// Nothing about lines is tracked while lexing; the table of line starts
+    /// is built on the first call, and only as far as the offsets asked about.
+    /// Not safe to call from several threads at once.
+    std::pair<unsigned, unsigned> getLineAndColumn(size_t Offset) const;
+
+    /// refill - Append the next chunk of an interactive source. Returns false
+    /// once no more input is coming. The buffer may move, so callers must
+    /// re-derive their pointers from getBufferStart().
+    bool refill() {
+        if(!Interactive || AtEOF) { return false; }
+        static const size_t ChunkSize = 4096;
+        Storage.pop_back(); // drop the sentinel
+        size_t Len = Storage.size();
+        Storage.resize(Len + ChunkSize);
+        ssize_t N;
+        do {
+            N = ::read(FD, Storage.data() + Len, ChunkSize);
+        } while(N < 0 && errno == EINTR);
+        Storage.resize(Len + (N > 0 ? N : 0));
+        setStorage();
+        if(N <= 0) { AtEOF = true; }
+        return N > 0;
+    }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// Diagnostics
+//===----------------------------------------------------------------------===//
+
+namespace {
+enum DiagSeverity : uint8_t { DS_Note, DS_Warning, DS_Error };
+enum DiagFormat : uint8_t { DF_Text, DF_JSON };
+
+/// Diagnostic - One message about a point in a SourceBuffer. Only the byte
+/// offset is recorded; line and column are worked out when it is printed.
+struct Diagnostic {
+    DiagSeverity Severity;
+    uint32_t Offset;
+    std::string Message;
+};
+
+/// DiagnosticEngine - Records the diagnostics for one SourceBuffer and prints
+/// them in a single write when flushed, as text ("file:line:col: error: ...")
+/// or as JSON, one object per line. A run of identical diagnostics on one
+/// line, as error recovery tends to produce, is kept once and followed by a
+/// note with the repeat count. A run never reaches back past a flush, so in
+/// the REPL each top-level item's note is printed along with that item's
+/// errors. Errors beyond the error limit are only counted. Both are
+/// off by default, which makes an engine a plain recorder whose diagnostics
+/// can later be replayed into another engine.
+class DiagnosticEngine {
+    const SourceBuffer &Source;
+    std::vector<Diagnostic> Diags;
+    size_t NumFlushed = 0;         // Diags already printed
+    unsigned NumErrors = 0;        // errors reported, including suppressed ones
+    unsigned NumKeptErrors = 0;    // errors recorded, not counting repeats
+    unsigned NumSuppressed = 0;    // errors dropped past the limit
+    unsigned ErrorLimit = 0;       // errors kept before suppressing; 0 = all
+    bool CollapseRepeats = false;
+    unsigned Repeats = 0;          // unrecorded repeats of the last diagnostic
+    DiagFormat Format = DF_Text;
+
+    void noteRepeats() {
+        if(!Repeats) { return; }
+        Diags.push_back({DS_Note, Diags.back().Offset,
+                         "previous diagnostic repeated " +
+                             std::to_string(Repeats) +
+                             (Repeats == 1 ? " more time" : " more times")});
+        Repeats = 0;
+    }
+
+    /// onSameLine - Whether no newline separates the offsets A and B.
+    bool onSameLine(size_t A, size_t B) const {
+        if(A > B) { std::swap(A, B); }
+        return !memchr(Source.getBufferStart() + A, '\n', B - A);
+    }
+
+public:
+    explicit DiagnosticEngine(const SourceBuffer &Source) : Source(Source) {}
+
+    void setErrorLimit(unsigned Limit) { ErrorLimit = Limit; }
+    void setCollapseRepeats(bool Enable) { CollapseRepeats = Enable; }
+    void setFormat(DiagFormat F) { Format = F; }
+
+    void report(DiagSeverity Severity, size_t Offset, std::string Message) {
+        NumErrors += Severity == DS_Error;
+        if(CollapseRepeats && NumFlushed != Diags.size() &&
+           Diags.back().Severity == Severity && Diags.back().Message == Message &&
+           onSameLine(Diags.back().Offset, Offset)) {
+            ++Repeats;
+            return;
+        }
+        if(Severity == DS_Error) {
+            if(ErrorLimit && NumKeptErrors == ErrorLimit) {
+                ++NumSuppressed;
+                return;
+            }
+            ++NumKeptErrors;
+        }
+        noteRepeats();
+        Diags.push_back({Severity, uint32_t(Offset), std::move(Message)});
+    }
+    void report(const Diagnostic &D) { report(D.Severity, D.Offset, D.Message); }
+    void error(size_t Offset, std::string Message) {
+        report(DS_Error, Offset, std::move(Message));
+    }
+
+    llvm::ArrayRef<Diagnostic> getDiagnostics() const { return Diags; }
+    unsigned getNumErrors() const { return NumErrors; }
+
+    /// finish - Add the notes for repeats and suppressed errors still pending.
+    /// Call once, after the last report.
+    void finish() {
+        noteRepeats();
+        if(NumSuppressed) {
+            Diags.push_back({DS_Note, uint32_t(Source.getBufferSize()),
+                             std::to_string(NumSuppressed) +
+                                 (NumSuppressed == 1 ? " more error" : " more errors") +
+                                 " suppressed (-error-limit=" +
+                                 std::to_string(ErrorLimit) + ")"});
+        }
+    }
+
+    /// render - Append the diagnostics not yet flushed to Out, closing any
+    /// pending run of repeats first; later reports start a new run.
+    void render(std::string &Out);
+
+    /// flush - Print the diagnostics not yet flushed to OS in one write.
+    void flush(FILE *OS) {
+        std::string Out;
+        render(Out);
+        fwrite(Out.data(), 1, Out.size(), OS);
+    }
+};
+} // end of the namespace
+
+void DiagnosticEngine::render(std::string &Out) {
+    static const char *const SeverityNames[] = {"note", "warning", "error"};
+    noteRepeats();
+    llvm::raw_string_ostream OS(Out);
+    for(; NumFlushed != Diags.size(); ++NumFlushed) {
+        const Diagnostic &D = Diags[NumFlushed];
+        auto LineCol = Source.getLineAndColumn(D.Offset);
+        if(Format == DF_Text) {
+            OS << Source.getName() << ':' << LineCol.first << ':'
+               << LineCol.second << ": " << SeverityNames[D.Severity] << ": "
+               << D.Message << '\n';
+            continue;
+        }
+        llvm::json::OStream J(OS);
+        J.object([&] {
+            J.attribute("file", Source.getName());
+            J.attribute("line", LineCol.first);
+            J.attribute("column", LineCol.second);
+            J.attribute("offset", D.Offset);
+            J.attribute("severity", SeverityNames[D.Severity]);
+            J.attribute("message", D.Message);
+        });
+        OS << '\n';
+    }
+    OS.flush();
+}
+
+//===----------------------------------------------------------------------===//
+// Scanning Kernels
+//===----------------------------------------------------------------------===//
+
+// The lexer's inner loops (whitespace, comments, identifier and digit runs)
+// are run by one set of kernels, picked at startup from what the CPU supports.
+// Each kernel scans [P, End) and returns the first character outside the run,
+// or End. The vector kernels only load whole blocks inside [P, End) and finish
+// the tail with scalar code, so they never read past the sentinel. Character
+// classes are plain ASCII; unlike <cctype> they ignore the C locale.
+
+namespace {
+using ScanFn = const char *(*)(const char *P, const char *End);
+
+struct ScanKernels {
+    const char *Name;
+    ScanFn SkipSpace;  // past ' ', '\t', '\n', '\v', '\f', '\r'
+    ScanFn FindEOL;    // up to the next '\n' or '\r'
+    ScanFn FindNewline; // up to the next '\n'
+    ScanFn SkipAlnum;  // past [0-9A-Za-z]
+    ScanFn SkipDigits; // past [0-9]
+};
+} // end of the namespace
+
+static bool IsSpaceChar(char C) { return llvm::isSpace(C); }
+static bool IsNotEOLChar(char C) { return C != '\n' && C != '\r'; }
+static bool IsNotNewlineChar(char C) { return C != '\n'; }
+static bool IsAlnumChar(char C) { return llvm::isAlnum(C); }
+static bool IsDigitChar(char C) { return llvm::isDigit(C); }
+
+template <bool (*InRun)(char)>
+static const char *ScalarScan(const char *P, const char *End) {
+    while(P != End && InRun(*P)) { ++P; }
+    return P;
+}
+
+static const ScanKernels ScalarKernels = {
+    "scalar", ScalarScan<IsSpaceChar>, ScalarScan<IsNotEOLChar>,
+    ScalarScan<IsNotNewlineChar>, ScalarScan<IsAlnumChar>,
+    ScalarScan<IsDigitChar>};
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 kernels, 16 bytes per step. Each classifier returns 0xFF in the lanes
+// that belong to the run.
+
+/// SSE2InRange - Lanes with Lo <= V <= Hi, as one unsigned compare.
+static inline __m128i SSE2InRange(__m128i V, char Lo, char Hi) {
+    __m128i D = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(Hi - Lo)), D);
+}
+static inline __m128i SSE2IsSpace(__m128i V) {
+    return _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                        SSE2InRange(V, '\t', '\r'));
+}
+static inline __m128i SSE2IsNotEOL(__m128i V) {
+    __m128i EOL = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                               _mm_cmpeq_epi8(V, _mm_set1_epi8('\r')));
+    return _mm_xor_si128(EOL, _mm_set1_epi8(-1));
+}
+static inline __m128i SSE2IsNotNewline(__m128i V) {
+    return _mm_xor_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                         _mm_set1_epi8(-1));
+}
+static inline __m128i SSE2IsDigit(__m128i V) { return SSE2InRange(V, '0', '9'); }
+static inline __m128i SSE2IsAlnum(__m128i V) {
+    // Folding to lower case maps the letters onto 'a'..'z' and leaves the
+    // digits untouched.
+    __m128i Lower = _mm_or_si128(V, _mm_set1_epi8(0x20));
+    return _mm_or_si128(SSE2IsDigit(V), SSE2InRange(Lower, 'a', 'z'));
+}
+
+template <__m128i (*InRun)(__m128i), bool (*ScalarInRun)(char)>
+static const char *SSE2Scan(const char *P, const char *End) {
+    for(; End - P >= 16; P += 16) {
+        __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+        unsigned Stop = ~_mm_movemask_epi8(InRun(V)) & 0xFFFF;
+        if(Stop) { return P + __builtin_ctz(Stop); }
+    }
+    return ScalarScan<ScalarInRun>(P, End);
+}
+
+static const ScanKernels SSE2Kernels = {
+    "sse2", SSE2Scan<SSE2IsSpace, IsSpaceChar>,
+    SSE2Scan<SSE2IsNotEOL, IsNotEOLChar>,
+    SSE2Scan<SSE2IsNotNewline, IsNotNewlineChar>,
+    SSE2Scan<SSE2IsAlnum, IsAlnumChar>, SSE2Scan<SSE2IsDigit, IsDigitChar>};
+
+// AVX2 kernels, 32 bytes per step; same scheme as the SSE2 ones. Compiled for
+// AVX2 regardless of -march and only used when the CPU reports support.
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i AVX2InRange(__m256i V, char Lo, char Hi) {
+    __m256i D = _mm256_sub_epi8(V, _mm256_set1_epi8(Lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(D, _mm256_set1_epi8(Hi - Lo)), D);
+}
+AVX2_TARGET static inline __m256i AVX2IsSpace(__m256i V) {
+    return _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')),
+                           AVX2InRange(V, '\t', '\r'));
+}
+AVX2_TARGET static inline __m256i AVX2IsNotEOL(__m256i V) {
+    __m256i EOL = _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                  _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r')));
+    return _mm256_xor_si256(EOL, _mm256_set1_epi8(-1));
+}
+AVX2_TARGET static inline __m256i AVX2IsNotNewline(__m256i V) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                            _mm256_set1_epi8(-1));
+}
+AVX2_TARGET static inline __m256i AVX2IsDigit(__m256i V) {
+    return AVX2InRange(V, '0', '9');
+}
+AVX2_TARGET static inline __m256i AVX2IsAlnum(__m256i V) {
+    __m256i Lower = _mm256_or_si256(V, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(AVX2IsDigit(V), AVX2InRange(Lower, 'a', 'z'));
+}
+
+template <__m256i (*InRun)(__m256i), bool (*ScalarInRun)(char)>
+AVX2_TARGET static const char *AVX2Scan(const char *P, const char *End) {
+    for(; End - P >= 32; P += 32) {
+        __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+        unsigned Stop = ~(unsigned)_mm256_movemask_epi8(InRun(V));
+        if(Stop) { return P + __builtin_ctz(Stop); }
+    }
+    return ScalarScan<ScalarInRun>(P, End);
+}
+
+static const ScanKernels AVX2Kernels = {
+    "avx2", AVX2Scan<AVX2IsSpace, IsSpaceChar>,
+    AVX2Scan<AVX2IsNotEOL, IsNotEOLChar>,
+    AVX2Scan<AVX2IsNotNewline, IsNotNewlineChar>,
+    AVX2Scan<AVX2IsAlnum, IsAlnumChar>, AVX2Scan<AVX2IsDigit, IsDigitChar>};
+#undef AVX2_TARGET
+#endif
+
+/// SelectScanKernels - Return the kernel set called Name, or the widest one
+/// the CPU supports for "auto". Returns nullptr if Name is unknown or not
+/// supported here.
+static const ScanKernels *SelectScanKernels(llvm::StringRef Name) {
+#if defined(__x86_64__) || defined(__i386__)
+    bool HasAVX2 = __builtin_cpu_supports("avx2");
+    bool HasSSE2 = __builtin_cpu_supports("sse2");
+    if(Name == "auto") {
+        return HasAVX2 ? &AVX2Kernels : HasSSE2 ? &SSE2Kernels : &ScalarKernels;
+    }
+    if(Name == "avx2") { return HasAVX2 ? &AVX2Kernels : nullptr; }
+    if(Name == "sse2") { return HasSSE2 ? &SSE2Kernels : nullptr; }
+#else
+    if(Name == "auto") { return &ScalarKernels; }
+#endif
+    if(Name == "scalar") { return &ScalarKernels; }
+    return nullptr;
+}
+
+/// DefaultScanKernels - The kernels new Lexers use; set once by the driver
+/// before any lexing starts.
+static const ScanKernels *DefaultScanKernels = SelectScanKernels("auto");
+
+std::pair<unsigned, unsigned> SourceBuffer::getLineAndColumn(size_t Offset) const {
+    // Extend the table with the newline kernel up to Offset. The table only
+    // ever grows, which also suits an interactive buffer that keeps growing.
+    size_t Limit = std::min(Offset, Size);
+    ScanFn FindNewline = DefaultScanKernels->FindNewline;
+    while(LinesScanned < Limit) {
+        const char *NL = FindNewline(Start + LinesScanned, Start + Limit);
+        LinesScanned = NL - Start;
+        if(NL == Start + Limit) { break; }
+        LineStarts.push_back(++LinesScanned);
+    }
+    auto Line = std::upper_bound(LineStarts.begin(), LineStarts.end(), Offset) - 1;
+    return {unsigned(Line - LineStarts.begin()) + 1, unsigned(Offset - *Line) + 1};
+}
+
+//===----------------------------------------------------------------------===//
+// Symbol Table
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// Symbol - A 4-byte handle for an interned identifier. Two Symbols from the
+/// same SymbolTable are equal iff their spellings are equal.
+class Symbol {
+    uint32_t ID = ~0u;
+
+public:
+    Symbol() = default;
+    explicit Symbol(uint32_t ID): ID(ID) {}
+
+    uint32_t getID() const { return ID; }
+    bool isValid() const { return ID != ~0u; }
+
+    bool operator==(Symbol RHS) const { return ID == RHS.ID; }
+    bool operator!=(Symbol RHS) const { return ID != RHS.ID; }
+};
+
+/// SymbolTable - Interns identifier spellings. Each distinct spelling is stored
+/// once, at a stable address, and is named by a dense Symbol ID thereafter.
+class SymbolTable {
+    llvm::StringMap<Symbol, llvm::BumpPtrAllocator> Map;
+    std::vector<llvm::StringRef> Names; // Symbol ID -> spelling
+    Symbol AnonExpr;
+
+public:
+    SymbolTable() { AnonExpr = intern("__anon_expr"); }
+
+    /// intern - Return the Symbol for Name, adding it on first sight.
+    Symbol intern(llvm::StringRef Name) {
+        auto Ins = Map.try_emplace(Name, Symbol(Names.size()));
+        if(Ins.second) { Names.push_back(Ins.first->getKey()); }
+        return Ins.first->getValue();
+    }
+
+    llvm::StringRef getName(Symbol S) const { return Names[S.getID()]; }
+    size_t size() const { return Names.size(); }
+
+    /// getAnonExpr - The name given to top-level expressions, interned up
+    /// front so that parsing never has to modify a shared table.
+    Symbol getAnonExpr() const { return AnonExpr; }
+};
+} // end of the namespace
+
 //===----------------------------------------------------------------------===//
 // Lexer
 //===----------------------------------------------------------------------===//
@@ -25,50 +565,163 @@ enum Token {
     tok_number = -5,
 };
 
-static std::string IdentifierStr;
-static double NumVal;
+/// KeywordInfo - A reserved word and the token it lexes to.
+struct KeywordInfo {
+    const char *Spelling;
+    int Tok;
+};
 
-// gettok - Return the next token from standard input.
-static int GetTok() {
-    static int LastChar = ' ';
+static constexpr KeywordInfo Keywords[] = {
+    {"def", tok_def},
+    {"extern", tok_extern},
+};
 
-    // Skip any whitespace.
-    while(isspace(LastChar)) {
-        LastChar = getchar();
+static constexpr size_t KeywordLength(const char *S) {
+    size_t Len = 0;
+    while(S[Len]) { ++Len; }
+    return Len;
+}
+
+/// KeywordHash - Perfect hash over the spellings in Keywords, keyed on the
+/// length and the first and last characters. The constants also keep the
+/// planned if/then/else/for/in/var/binary/unary keywords collision free;
+/// KeywordTableIsPerfect() rejects any keyword set they don't.
+static constexpr unsigned KeywordHashSize = 32;
+static constexpr unsigned KeywordHash(const char *S, size_t Len) {
+    return (Len * 2 + (unsigned char)S[0] + (unsigned char)S[Len - 1]) &
+           (KeywordHashSize - 1);
+}
+
+/// KeywordTable - Hash slot -> index into Keywords, or -1 for no keyword.
+struct KeywordTable {
+    signed char Slot[KeywordHashSize];
+};
+
+static constexpr KeywordTable BuildKeywordTable() {
+    KeywordTable T = {};
+    for(unsigned I = 0; I != KeywordHashSize; ++I) { T.Slot[I] = -1; }
+    for(unsigned I = 0; I != sizeof(Keywords) / sizeof(Keywords[0]); ++I) {
+        const char *S = Keywords[I].Spelling;
+        T.Slot[KeywordHash(S, KeywordLength(S))] = I;
+    }
+    return T;
+}
+
+static constexpr bool KeywordTableIsPerfect() {
+    KeywordTable T = BuildKeywordTable();
+    unsigned Used = 0;
+    for(unsigned I = 0; I != KeywordHashSize; ++I) { Used += T.Slot[I] >= 0; }
+    return Used == sizeof(Keywords) / sizeof(Keywords[0]);
+}
+static_assert(KeywordTableIsPerfect(), "keyword hash has collisions");
+
+static constexpr KeywordTable KeywordSlots = BuildKeywordTable();
+
+/// ClassifyIdentifier - Return the keyword token spelled by [S, S+Len), or
+/// tok_identifier. One hash, one table load and at most one memcmp.
+static inline int ClassifyIdentifier(const char *S, size_t Len) {
+    int Slot = KeywordSlots.Slot[KeywordHash(S, Len)];
+    if(Slot < 0) { return tok_identifier; }
+    const char *KW = Keywords[Slot].Spelling;
+    if(strncmp(KW, S, Len) != 0 || KW[Len] != 0) { return tok_identifier; }
+    return Keywords[Slot].Tok;
+}
+
+namespace {
+/// Lexer - Turns a SourceBuffer into tokens. All lexing state lives here, so
+/// independent Lexers over different buffers may run concurrently. Identifiers
+/// are interned into the given SymbolTable as they are lexed.
+class Lexer {
+    SourceBuffer &Source;
+    SymbolTable &Symbols;
+    DiagnosticEngine &Diags;
+    const ScanKernels &Kernels = *DefaultScanKernels;
+    const char *CurPtr;    // cursor into Source
+    int CurTok = tok_eof;  // the token most recently returned
+    size_t TokOffset = 0;  // buffer offset of CurTok's first character
+    Symbol Identifier;     // filled in for tok_identifier
+    double NumVal = 0;     // filled in for tok_number
+
+    /// peekChar - Return the character Ahead places past the cursor without
+    /// consuming it; the characters before it must already have been peeked.
+    /// When that position hits the sentinel, more input is pulled from an
+    /// interactive source; EOF is returned once the source is exhausted.
+    int peekChar(size_t Ahead = 0) {
+        if(CurPtr[Ahead] == 0 && CurPtr + Ahead == Source.getBufferEnd()) {
+            size_t Offset = CurPtr - Source.getBufferStart();
+            if(!Source.refill()) { return EOF; }
+            CurPtr = Source.getBufferStart() + Offset; // refill may move the buffer
+        }
+        return (unsigned char)CurPtr[Ahead];
     }
 
-    if(isalpha(LastChar)) { 
-        IdentifierStr = LastChar;
-        while(isalnum((LastChar = getchar()))) { 
-            IdentifierStr += LastChar;
+    /// scan - Advance the cursor with Kernel, refilling an interactive source
+    /// whenever the kernel runs into the end of the buffer.
+    void scan(ScanFn Kernel) {
+        while((CurPtr = Kernel(CurPtr, Source.getBufferEnd())) ==
+                  Source.getBufferEnd() &&
+              peekChar() != EOF) {
         }
+    }
+
+    /// gettok - Lex the next token from the source buffer.
+    int getTok();
+    int lexNumber();
+
+public:
+    Lexer(SourceBuffer &Source, SymbolTable &Symbols, DiagnosticEngine &Diags)
+        : Source(Source), Symbols(Symbols), Diags(Diags),
+          CurPtr(Source.getBufferStart()) {}
+
+    /// getNextToken - Advance to the next token and return it.
+    int getNextToken() { return CurTok = getTok(); }
+
+    int getCurToken() const { return CurTok; }
+    /// getTokenSpelling - The source text of the current token.
+    llvm::StringRef getTokenSpelling() const {
+        return llvm::StringRef(Source.getBufferStart() + TokOffset,
+                               CurPtr - Source.getBufferStart() - TokOffset);
+    }
+    size_t getTokenOffset() const { return TokOffset; }
+    Symbol getIdentifier() const { return Identifier; }
+    SymbolTable &getSymbols() const { return Symbols; }
+    SourceBuffer &getSource() const { return Source; }
+    double getNumVal() const { return NumVal; }
+};
+} // end of the namespace
+
+int Lexer::getTok() {
+    // Skip any whitespace.
+    scan(Kernels.SkipSpace);
 
-        if(IdentifierStr == "def") {
-            return tok_eof;
-        } else if(IdentifierStr == "extern") {
-            return tok_extern;
+    int LastChar = peekChar();
+    // Offsets rather than pointers: an interactive refill may move the buffer.
+    size_t TokStart = TokOffset = CurPtr - Source.getBufferStart();
+
+    if(llvm::isAlpha(LastChar)) { 
+        ++CurPtr;
+        scan(Kernels.SkipAlnum);
+        const char *Spelling = Source.getBufferStart() + TokStart;
+        size_t Len = CurPtr - Spelling;
+
+        int KeywordTok = ClassifyIdentifier(Spelling, Len);
+        if(KeywordTok != tok_identifier) {
+            return KeywordTok;
         }
+        Identifier = Symbols.intern(llvm::StringRef(Spelling, Len));
         return tok_identifier; // variable name or so
     }
 
-    if(isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+    if(llvm::isDigit(LastChar) || LastChar == '.') {
+        return lexNumber();
     }
 
     if(LastChar == '#') { // comment
-        do {
-            LastChar = getchar();
-        } while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+        scan(Kernels.FindEOL);
+        LastChar = peekChar();
 
         if(LastChar != EOF) {
-            return GetTok();
+            return getTok();
         }
     }
 
@@ -76,20 +729,202 @@ static int GetTok() {
         return tok_eof;
     }
 
-    int ThisChar = LastChar;
-    LastChar = getchar(); // prepare for the next token
-    return ThisChar;
+    ++CurPtr; // prepare for the next token
+    return LastChar;
+}
+
+/// lexNumber - Lex a numeric literal starting at the cursor
+///     number   ::= digit+ ('.' digit*)? exponent? | '.' digit+ exponent?
+///     exponent ::= ('e' | 'E') ('+' | '-')? digit+
+/// and convert it in place in the source buffer, correctly rounded and
+/// independent of the C locale. A malformed literal such as "1.2.3" or "."
+/// is reported and lexes as 0.
+int Lexer::lexNumber() {
+    bool SawDigit = llvm::isDigit(peekChar());
+    scan(Kernels.SkipDigits);
+    if(peekChar() == '.') {
+        ++CurPtr;
+        SawDigit |= llvm::isDigit(peekChar());
+        scan(Kernels.SkipDigits);
+    }
+
+    // An 'e' is only an exponent when digits follow, so "2e" still lexes as
+    // the number 2 followed by the identifier e.
+    int E = peekChar();
+    if(SawDigit && (E == 'e' || E == 'E')) {
+        int Sign = peekChar(1);
+        size_t DigitPos = (Sign == '+' || Sign == '-') ? 2 : 1;
+        if(llvm::isDigit(peekChar(DigitPos))) {
+            CurPtr += DigitPos;
+            scan(Kernels.SkipDigits);
+        }
+    }
+
+    bool Malformed = !SawDigit || peekChar() == '.';
+    if(Malformed) {
+        // Swallow the rest of the run so it doesn't cascade into more errors.
+        while(llvm::isAlnum(peekChar()) || peekChar() == '.') { ++CurPtr; }
+    }
+
+    const char *Begin = Source.getBufferStart() + TokOffset;
+    int Len = CurPtr - Begin;
+    NumVal = 0;
+    if(Malformed) {
+        Diags.error(TokOffset,
+                    "malformed number '" + std::string(Begin, Len) + "'");
+        return tok_number;
+    }
+    std::from_chars_result R = std::from_chars(Begin, CurPtr, NumVal);
+    if(R.ec == std::errc::result_out_of_range) {
+        Diags.error(TokOffset,
+                    "number '" + std::string(Begin, Len) + "' is out of range");
+        NumVal = 0;
+    }
+    return tok_number;
 }
 
+//===----------------------------------------------------------------------===//
+// Token Stream
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// TokenRecord - One lexed token in 12 bytes. The payload is resolved through
+/// the TokenStream that holds the record.
+struct TokenRecord {
+    int32_t Kind;    // a Token, or the character itself for [0-255]
+    uint32_t Value;  // Symbol ID for tok_identifier, number index for tok_number
+    uint32_t Offset; // byte offset of the token in the source buffer
+};
+static_assert(sizeof(TokenRecord) == 12, "TokenRecord should stay compact");
+
+/// TokenStream - The tokens of one source buffer as a flat array, ending with
+/// tok_eof, giving the parser arbitrary lookahead. The stream is either lexed
+/// completely up front by lexAll(), or extended on demand as the parser reads
+/// past its end, which keeps the REPL from blocking on input it doesn't need
+/// yet. A complete stream is never written to again, so any number of threads
+/// may read it concurrently.
+class TokenStream {
+    Lexer Lex;
+    std::vector<TokenRecord> Tokens;
+    std::vector<double> Numbers; // tok_number values
+    bool Complete = false;       // tok_eof has been lexed
+
+    void lexOne() {
+        int Kind = Lex.getNextToken();
+        uint32_t Value = 0;
+        if(Kind == tok_identifier) {
+            Value = Lex.getIdentifier().getID();
+        } else if(Kind == tok_number) {
+            Value = Numbers.size();
+            Numbers.push_back(Lex.getNumVal());
+        }
+        Tokens.push_back({Kind, Value, uint32_t(Lex.getTokenOffset())});
+        Complete = Kind == tok_eof;
+    }
+
+public:
+    TokenStream(SourceBuffer &Source, SymbolTable &Symbols,
+                DiagnosticEngine &Diags)
+        : Lex(Source, Symbols, Diags) {}
+
+    /// lexAll - Lex the rest of the input in one tight loop.
+    void lexAll() {
+        if(Tokens.empty()) {
+            // A rough guess at the token density avoids most regrowth.
+            Tokens.reserve(Lex.getSource().getBufferSize() / 6 + 1);
+        }
+        while(!Complete) { lexOne(); }
+    }
+
+    /// get - The token at Index; past the end, the final tok_eof.
+    const TokenRecord &get(size_t Index) {
+        while(Index >= Tokens.size() && !Complete) { lexOne(); }
+        return Tokens[std::min(Index, Tokens.size() - 1)];
+    }
+
+    bool isComplete() const { return Complete; }
+    size_t size() const { return Tokens.size(); }
+    llvm::ArrayRef<TokenRecord> getTokens() const { return Tokens; }
+    double getNumber(uint32_t Index) const { return Numbers[Index]; }
+    SymbolTable &getSymbols() const { return Lex.getSymbols(); }
+    SourceBuffer &getSource() const { return Lex.getSource(); }
+};
+} // end of the namespace
+
 //===----------------------------------------------------------------------===//
 // AST (Parse Tree)
 //===----------------------------------------------------------------------===//
 
 namespace {
+/// ASTContext - Bump-pointer arena that owns every AST node of a top-level item
+/// (or a whole module). Nodes are carved out of large slabs, never destroyed
+/// individually, and released all at once by reset().
+class ASTContext {
+    llvm::BumpPtrAllocator Alloc;
+
+    // Statistics, cumulative across resets.
+    size_t NumNodes = 0;
+    size_t BytesAllocated = 0;
+    size_t RetiredSlabs = 0; // slabs freed by reset()
+
+public:
+    /// create - Allocate and construct an AST node in the arena.
+    template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "arena-allocated AST nodes are never destroyed");
+        ++NumNodes;
+        BytesAllocated += sizeof(T);
+        return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+    }
+
+    /// copyArray - Copy Elts into the arena.
+    template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> Elts) {
+        if(Elts.empty()) { return llvm::ArrayRef<T>(); }
+        BytesAllocated += Elts.size() * sizeof(T);
+        T *Mem = Alloc.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    /// reset - Release every node at once. The first slab is kept for reuse,
+    /// so a steady stream of small items does not touch malloc at all.
+    void reset() {
+        // Custom-sized slabs (single large allocations) are all freed too.
+        size_t Slabs = Alloc.GetNumSlabs();
+        Alloc.Reset();
+        RetiredSlabs += Slabs - Alloc.GetNumSlabs();
+    }
+
+    size_t getNumNodes() const { return NumNodes; }
+    size_t getBytesAllocated() const { return BytesAllocated; }
+    /// getNumMallocs - The number of slabs, standard and custom-sized, ever
+    /// requested from malloc.
+    size_t getNumMallocs() const { return RetiredSlabs + Alloc.GetNumSlabs(); }
+
+    void printStats(FILE *OS) const {
+        fprintf(OS, "AST arena: %zu nodes, %zu bytes, %zu mallocs (%.4f per node)\n",
+                NumNodes, BytesAllocated, getNumMallocs(),
+                NumNodes ? double(getNumMallocs()) / NumNodes : 0.0);
+    }
+};
+
 /// ExprAST - Base class for all expression nodes.
+/// Nodes live in an ASTContext and are never destroyed, so the hierarchy must
+/// stay trivially destructible: no virtual destructor and no owning members.
+/// The concrete class is identified by a kind tag, which llvm::isa, cast and
+/// dyn_cast understand through each subclass's classof.
 class ExprAST {
 public:
-    virtual ~ExprAST() = default;
+    enum ExprKind : uint8_t { EK_Number, EK_Variable, EK_Binary, EK_Call };
+
+private:
+    const ExprKind Kind;
+
+protected:
+    ExprAST(ExprKind Kind): Kind(Kind) {}
+
+public:
+    ExprKind getKind() const { return Kind; }
 };
 
 /// NumberExprAST - Expression class for numeric literals
@@ -97,107 +932,444 @@ class NumberExprAST: public ExprAST {
     double Val;
 
 public:
-    NumberExprAST(double Val): Val(Val) {}
+    NumberExprAST(double Val): ExprAST(EK_Number), Val(Val) {}
+
+    double getVal() const { return Val; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable
 class VariableExprAST: public ExprAST {
-    std::string Name;
+    Symbol Name;
 
 public:
-    VariableExprAST(const std::string &Name): Name(Name) {}
+    VariableExprAST(Symbol Name): ExprAST(EK_Variable), Name(Name) {}
+
+    Symbol getName() const { return Name; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 /// BinaryExprAST - Expression class for a binary operator
 class BinaryExprAST: public ExprAST {
     char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    ExprAST *LHS, *RHS;
 
 public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-                  : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+                  : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
 /// CallExprAST - Expression class for function calls
 class CallExprAST: public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    Symbol Callee;
+    llvm::ArrayRef<ExprAST *> Args;
 
 public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-                : Callee(Callee), Args(std::move(Args)) {}
+    CallExprAST(Symbol Callee, llvm::ArrayRef<ExprAST *> Args)
+                : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+
+    Symbol getCallee() const { return Callee; }
+    llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
 /// of arguments the function takes)
 class PrototypeAST { // the name and parameters of the function
-    std::string Name;
-    std::vector<std::string> Args;
+    Symbol Name;
+    llvm::ArrayRef<Symbol> Args;
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-                 : Name(Name), Args(std::move(Args)) {}
+    PrototypeAST(Symbol Name, llvm::ArrayRef<Symbol> Args)
+                 : Name(Name), Args(Args) {}
 
-    const std::string &getName() const { return Name; }
+    Symbol getName() const { return Name; }
+    llvm::ArrayRef<Symbol> getArgs() const { return Args; }
 };
 
 /// FunctionAST - This class represents a function definition itself
 class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    PrototypeAST *Proto;
+    ExprAST *Body;
 
 public:
-    FunctionAST(const std::unique_ptr<PrototypeAST>& Proto, const std::unique_ptr<ExprAST>& Body)
-                : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FunctionAST(PrototypeAST *Proto, ExprAST *Body)
+                : Proto(Proto), Body(Body) {}
+
+    PrototypeAST *getProto() const { return Proto; }
+    ExprAST *getBody() const { return Body; }
 };
 
 } // end of the namespace
 
+//===----------------------------------------------------------------------===//
+// AST Visitors
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// ExprVisitor - CRTP base class for traversals of the ExprAST classes.
+/// visit() switches on the node's kind tag and calls the matching
+/// visit*Expr of Derived directly, so no virtual call is made per node and
+/// the handlers can be inlined. Derived overrides the visit*Expr methods it
+/// cares about; the others fall back to visitExpr, which does nothing unless
+/// Derived overrides that as well.
+template <typename Derived, typename RetT = void> class ExprVisitor {
+    Derived &derived() { return *static_cast<Derived *>(this); }
+
+public:
+    RetT visit(ExprAST *E) {
+        switch(E->getKind()) {
+        case ExprAST::EK_Number:
+            return derived().visitNumberExpr(llvm::cast<NumberExprAST>(E));
+        case ExprAST::EK_Variable:
+            return derived().visitVariableExpr(llvm::cast<VariableExprAST>(E));
+        case ExprAST::EK_Binary:
+            return derived().visitBinaryExpr(llvm::cast<BinaryExprAST>(E));
+        case ExprAST::EK_Call:
+            return derived().visitCallExpr(llvm::cast<CallExprAST>(E));
+        }
+        llvm_unreachable("unknown expression kind");
+    }
+
+    RetT visitNumberExpr(NumberExprAST *E) { return derived().visitExpr(E); }
+    RetT visitVariableExpr(VariableExprAST *E) { return derived().visitExpr(E); }
+    RetT visitBinaryExpr(BinaryExprAST *E) { return derived().visitExpr(E); }
+    RetT visitCallExpr(CallExprAST *E) { return derived().visitExpr(E); }
+    RetT visitExpr(ExprAST *) { return RetT(); }
+};
+
+/// ASTPrinter - Prints expressions as S-expressions, e.g. (+ x (* y 2)).
+class ASTPrinter: public ExprVisitor<ASTPrinter> {
+    const SymbolTable &Symbols;
+    FILE *OS;
+
+    void printName(Symbol S) {
+        llvm::StringRef Name = Symbols.getName(S);
+        fprintf(OS, "%.*s", int(Name.size()), Name.data());
+    }
+
+public:
+    ASTPrinter(const SymbolTable &Symbols, FILE *OS): Symbols(Symbols), OS(OS) {}
+
+    void visitNumberExpr(NumberExprAST *E) { fprintf(OS, "%g", E->getVal()); }
+    void visitVariableExpr(VariableExprAST *E) { printName(E->getName()); }
+    void visitBinaryExpr(BinaryExprAST *E) {
+        fprintf(OS, "(%c ", E->getOp());
+        visit(E->getLHS());
+        fputc(' ', OS);
+        visit(E->getRHS());
+        fputc(')', OS);
+    }
+    void visitCallExpr(CallExprAST *E) {
+        fputc('(', OS);
+        printName(E->getCallee());
+        for(ExprAST *Arg : E->getArgs()) {
+            fputc(' ', OS);
+            visit(Arg);
+        }
+        fputc(')', OS);
+    }
+
+    void printPrototype(PrototypeAST *P) {
+        printName(P->getName());
+        fputc('(', OS);
+        for(size_t I = 0, E = P->getArgs().size(); I != E; ++I) {
+            if(I) { fputc(' ', OS); }
+            printName(P->getArgs()[I]);
+        }
+        fputc(')', OS);
+    }
+
+    void printFunction(FunctionAST *F) {
+        printPrototype(F->getProto());
+        fputc(' ', OS);
+        visit(F->getBody());
+        fputc('\n', OS);
+    }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// Flat AST
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// NodeId - A node of a FlatExprPool.
+using NodeId = uint32_t;
+
+/// FlatExprPool - Struct-of-arrays storage for the expressions of a module,
+/// an alternative to the ExprAST classes. A node is a 32-bit index into
+/// parallel arrays; there are no vtables or child pointers. Operands are
+/// always added before their users, so passes that need operand results
+/// first (evaluation, code generation) are one forward loop over a node range.
+class FlatExprPool {
+public:
+    enum NodeKind : uint8_t { Number, Variable, Binary, Call };
+
+private:
+    std::vector<NodeKind> Kinds;
+    // Operand fields; what they hold depends on the node kind:
+    //   Number:   A = index into Literals
+    //   Variable: A = Symbol ID
+    //   Binary:   A = LHS, B = RHS, C = operator character
+    //   Call:     A = callee Symbol ID, B = first index into CallArgs, C = #args
+    std::vector<uint32_t> A, B, C;
+    std::vector<double> Literals;
+    std::vector<NodeId> CallArgs;
+
+    NodeId addNode(NodeKind K, uint32_t OpA, uint32_t OpB = 0, uint32_t OpC = 0) {
+        Kinds.push_back(K);
+        A.push_back(OpA);
+        B.push_back(OpB);
+        C.push_back(OpC);
+        return Kinds.size() - 1;
+    }
+
+public:
+    NodeId addNumber(double Val) {
+        Literals.push_back(Val);
+        return addNode(Number, Literals.size() - 1);
+    }
+    NodeId addVariable(Symbol Name) { return addNode(Variable, Name.getID()); }
+    NodeId addBinary(char Op, NodeId LHS, NodeId RHS) {
+        return addNode(Binary, LHS, RHS, (unsigned char)Op);
+    }
+    NodeId addCall(Symbol Callee, llvm::ArrayRef<NodeId> Args) {
+        uint32_t First = CallArgs.size();
+        CallArgs.insert(CallArgs.end(), Args.begin(), Args.end());
+        return addNode(Call, Callee.getID(), First, Args.size());
+    }
+
+    /// flatten - Append a copy of the expression tree E; returns its root.
+    NodeId flatten(ExprAST *E);
+
+    size_t size() const { return Kinds.size(); }
+    NodeKind getKind(NodeId N) const { return Kinds[N]; }
+    double getNumber(NodeId N) const { return Literals[A[N]]; }
+    Symbol getSymbol(NodeId N) const { return Symbol(A[N]); } // Variable, Call
+    char getOp(NodeId N) const { return C[N]; }
+    NodeId getLHS(NodeId N) const { return A[N]; }
+    NodeId getRHS(NodeId N) const { return B[N]; }
+    llvm::ArrayRef<NodeId> getArgs(NodeId N) const {
+        return llvm::makeArrayRef(CallArgs).slice(B[N], C[N]);
+    }
+
+    /// getMemoryBytes - Bytes used by the nodes, literals and argument lists.
+    size_t getMemoryBytes() const {
+        return Kinds.size() * (sizeof(NodeKind) + 3 * sizeof(uint32_t)) +
+               Literals.size() * sizeof(double) + CallArgs.size() * sizeof(NodeId);
+    }
+};
+} // end of the namespace
+
+namespace {
+/// FlatExprBuilder - Copies an ExprAST tree into a FlatExprPool, operands
+/// first.
+class FlatExprBuilder: public ExprVisitor<FlatExprBuilder, NodeId> {
+    FlatExprPool &Pool;
+
+public:
+    explicit FlatExprBuilder(FlatExprPool &Pool): Pool(Pool) {}
+
+    NodeId visitNumberExpr(NumberExprAST *E) { return Pool.addNumber(E->getVal()); }
+    NodeId visitVariableExpr(VariableExprAST *E) {
+        return Pool.addVariable(E->getName());
+    }
+    NodeId visitBinaryExpr(BinaryExprAST *E) {
+        NodeId LHS = visit(E->getLHS());
+        NodeId RHS = visit(E->getRHS());
+        return Pool.addBinary(E->getOp(), LHS, RHS);
+    }
+    NodeId visitCallExpr(CallExprAST *E) {
+        llvm::SmallVector<NodeId, 8> Args;
+        for(ExprAST *Arg : E->getArgs()) { Args.push_back(visit(Arg)); }
+        return Pool.addCall(E->getCallee(), Args);
+    }
+};
+} // end of the namespace
+
+NodeId FlatExprPool::flatten(ExprAST *E) { return FlatExprBuilder(*this).visit(E); }
+
 //===----------------------------------------------------------------------===//
 // Parser
 //===----------------------------------------------------------------------===//
 
-static int CurTok; // current token that the parser is looking at
-static int GetNextToken() { return CurTok = GetTok(); } 
+namespace {
+/// BinopTable - The precedence and associativity of every binary operator,
+/// indexed directly by the operator character. Looking an operator up is a
+/// single load and never modifies the table.
+class BinopTable {
+    // Low 7 bits: precedence, 0 if the character is not a binary operator.
+    // High bit: set for right-associative operators.
+    uint8_t Entries[256];
+    static constexpr uint8_t RightAssocBit = 0x80;
 
-/// the precedence of each binary operator
-/// - the compiler uses BinopPrecedence to record the precendence of operators 
-/// - in parsing the the binop, the precedence, instead of the pre-set grammar, 
-/// - is used to determine the parse order
-static std::map<char, int> BinopPrecedence;
-static int GetTokPrecedence() {
-    if(!isascii(CurTok)) { return -1; }
+public:
+    static constexpr unsigned MaxPrecedence = 0x7F;
+
+    constexpr BinopTable(): Entries() {}
+
+    /// getStandard - The built-in operators. 1 is the lowest precedence.
+    static constexpr BinopTable getStandard() {
+        BinopTable T;
+        T.Entries['<'] = 10;
+        T.Entries['+'] = 20;
+        T.Entries['-'] = 20;
+        T.Entries['*'] = 40; // highest.
+        return T;
+    }
 
-    // make sure binop is declared
-    int TokPrec = BinopPrecedence[CurTok];
-    if(TokPrec <= 0) { return -1; }
-    return TokPrec;
-}
+    /// addBinop - Register (or redefine) Op as a binary operator. Returns false
+    /// if Prec is outside [1, MaxPrecedence].
+    bool addBinop(unsigned char Op, unsigned Prec, bool RightAssoc = false) {
+        if(Prec == 0 || Prec > MaxPrecedence) { return false; }
+        Entries[Op] = Prec | (RightAssoc ? RightAssocBit : 0);
+        return true;
+    }
 
-/// LogError* - These are little helper functions for error handling
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-}
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
+    void removeBinop(unsigned char Op) { Entries[Op] = 0; }
+
+    /// getPrecedence - The precedence of token Tok, or -1 if it is not a
+    /// binary operator.
+    int getPrecedence(int Tok) const {
+        if(unsigned(Tok) > 255) { return -1; }
+        int Prec = Entries[Tok] & MaxPrecedence;
+        return Prec ? Prec : -1;
+    }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+    bool isRightAssoc(int Tok) const {
+        return unsigned(Tok) <= 255 && (Entries[Tok] & RightAssocBit);
+    }
+};
+
+static constexpr BinopTable StandardBinops = BinopTable::getStandard();
+
+/// DefaultBinops - The operators new Parsers start with: the standard ones
+/// plus any the driver registers before parsing begins.
+static BinopTable DefaultBinops = StandardBinops;
+
+/// Parser - A recursive descent parser over a TokenStream. The parser owns all
+/// of its state (stream position, current token, operator precedences) and
+/// allocates nodes in the ASTContext it is given, so independent Parsers can
+/// run concurrently without locking, even over one complete TokenStream.
+class Parser {
+    std::unique_ptr<TokenStream> OwnedToks; // set if the parser lexes itself
+    TokenStream &Toks;
+    ASTContext &Ctx;   // arena for the nodes this parser creates
+    DiagnosticEngine &Diags;
+    size_t Pos;        // index of the token after CurTok
+    int CurTok;        // current token that the parser is looking at
+    uint32_t CurValue; // payload of CurTok, see TokenRecord::Value
+
+    /// the precedence of each binary operator
+    /// - the compiler uses Binops to record the precendence of operators 
+    /// - in parsing the the binop, the precedence, instead of the pre-set grammar, 
+    /// - is used to determine the parse order
+    BinopTable Binops = DefaultBinops;
+
+    /// An entry on the operator stack of the iterative expression parser.
+    struct OpFrame {
+        enum FrameKind : uint8_t { Binop, Paren, Call } Kind;
+        char Op;         // Binop: the operator
+        uint8_t Prec;    // Binop: its precedence
+        bool RightAssoc; // Binop: whether it is right-associative
+        Symbol Callee;       // Call: the function being called
+        union {
+            ExprAST *LHS;     // Binop: its left operand
+            uint32_t ArgBase; // Call: operand stack depth before the args
+        };
+    };
+    bool Iterative = false; // parse expressions with ParseExpressionIterative
+    // Stacks for ParseExpressionIterative, kept to reuse their storage.
+    std::vector<ExprAST *> Operands; // finished call arguments
+    std::vector<OpFrame> Operators;
+
+    Parser(std::unique_ptr<TokenStream> Owned, TokenStream &Toks,
+           ASTContext &Ctx, DiagnosticEngine &Diags, size_t Begin)
+        : OwnedToks(std::move(Owned)), Toks(Toks), Ctx(Ctx), Diags(Diags),
+          Pos(Begin), CurTok(tok_eof), CurValue(0) {}
+
+    /// LogError* - Report Str at the current token; return null for the caller.
+    ExprAST *LogError(const char *Str) {
+        Diags.error(Toks.get(Pos - 1).Offset, Str);
+        return nullptr;
+    }
+    PrototypeAST *LogErrorP(const char *Str) {
+        LogError(Str);
+        return nullptr;
+    }
+
+    Symbol getIdentifier() const { return Symbol(CurValue); }
+    double getNumVal() const { return Toks.getNumber(CurValue); }
+
+    int GetTokPrecedence() const { return Binops.getPrecedence(CurTok); }
+
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseParenExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParsePrimary();
+    ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
+    ExprAST *ParseExpression();
+    ExprAST *ParseExpressionIterative();
+    ExprAST *ReduceBinops(ExprAST *Cur, size_t OperatorBase, int Prec);
+    ExprAST *ReduceCall();
+    PrototypeAST *ParsePrototype();
+
+public:
+    /// Parser - Parse Source, lexing it on demand as parsing proceeds.
+    Parser(SourceBuffer &Source, SymbolTable &Symbols, ASTContext &Ctx,
+           DiagnosticEngine &Diags)
+        : Parser(new TokenStream(Source, Symbols, Diags), Ctx, Diags) {}
+
+    /// Parser - Parse the tokens of Toks from index Begin on, reporting syntax
+    /// errors to Diags. Toks must outlive the parser.
+    Parser(TokenStream &Toks, ASTContext &Ctx, DiagnosticEngine &Diags,
+           size_t Begin = 0)
+        : Parser(nullptr, Toks, Ctx, Diags, Begin) {}
+
+    int GetNextToken() {
+        const TokenRecord &T = Toks.get(Pos++);
+        CurValue = T.Value;
+        return CurTok = T.Kind;
+    }
+    int getCurToken() const { return CurTok; }
+    /// getTokenIndex - The index of the current token in the stream.
+    size_t getTokenIndex() const { return Pos - 1; }
+    /// peekToken - The kind of the token N places after the current one.
+    int peekToken(size_t N = 1) { return Toks.get(Pos + N - 1).Kind; }
+    TokenStream &getTokens() const { return Toks; }
+    DiagnosticEngine &getDiagnostics() const { return Diags; }
+    /// getBinops - The operator table, for registering user-defined operators.
+    BinopTable &getBinops() { return Binops; }
+    /// setIterative - Parse expressions without recursion, so that nesting
+    /// depth is not limited by the native stack.
+    void setIterative(bool Enable) { Iterative = Enable; }
+
+    FunctionAST *ParseDefinition();
+    PrototypeAST *ParseExtern();
+    FunctionAST *ParseTopLevelExpr();
+
+private:
+    Parser(TokenStream *Owned, ASTContext &Ctx, DiagnosticEngine &Diags)
+        : Parser(std::unique_ptr<TokenStream>(Owned), *Owned, Ctx, Diags, 0) {}
+};
+} // end of the namespace
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+ExprAST *Parser::ParseNumberExpr() {
+    auto Result = Ctx.create<NumberExprAST>(getNumVal());
     GetNextToken(); // advance the lexer to the next token
-    return std::move(Result);
+    return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprAST *Parser::ParseParenExpr() {
     GetNextToken(); // eat (
     auto V = ParseExpression();
     if(!V) { return nullptr; }
@@ -210,19 +1382,19 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 /// identifierexpr
 ///     ::= identifier
 ///     ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+ExprAST *Parser::ParseIdentifierExpr() {
+    Symbol IdName = getIdentifier();
     GetNextToken(); // eat identifier
 
     // Variable
-    if(CurTok != '(') { return std::make_unique<VariableExprAST>(IdName); }
+    if(CurTok != '(') { return Ctx.create<VariableExprAST>(IdName); }
 
     // Function Call
     GetNextToken(); // eat ( and read the next token
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    llvm::SmallVector<ExprAST *, 8> Args;
     if(CurTok != ')') {
         while(true) {
-            if(auto Arg = ParseExpression()) { Args.push_back(std::move(Arg)); }
+            if(auto Arg = ParseExpression()) { Args.push_back(Arg); }
             else { return nullptr; }
 
             if(CurTok == ')') { break; }
@@ -235,14 +1407,14 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     }
 
     GetNextToken(); // eat ')'
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return Ctx.create<CallExprAST>(IdName, Ctx.copyArray<ExprAST *>(Args));
 }
 
 /// primary
 ///     ::= identifierexpr
 ///     ::= numberexpr
 ///     ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST *Parser::ParsePrimary() {
     switch(CurTok) {
         default: return LogError("Unknown token when expecting an expression");
         case tok_identifier: return ParseIdentifierExpr();
@@ -253,9 +1425,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 
 /// binoprhs
 ///     ::= ('+' primary)*
-static std::unique_ptr<ExprAST> 
-ParseBinOpRHS(int ExprPrec,
-              std::unique_ptr<ExprAST> LHS) {
+ExprAST *Parser::ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
     // If this is a binop, get its precedence
     // The binop should be bound to what side is determined by the precedence
     while(true) {
@@ -267,43 +1437,222 @@ ParseBinOpRHS(int ExprPrec,
 
         // This is a binop
         int BinOp = CurTok;
-        GetTokPrecedence(); // eat binop
+        GetNextToken(); // eat binop
 
         // Parse the primary expression after the binop
         auto RHS = ParsePrimary();
         if(!RHS) { return nullptr; }
 
         // If BinOp binds less tightly with RHS than the operator after RHS,
-        // let the pending operator take RHS as its LHS
+        // let the pending operator take RHS as its LHS. A right-associative
+        // BinOp also yields RHS to a following operator of equal precedence.
         int NextPrec = GetTokPrecedence();
-        if(TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec+1, std::move(RHS));
+        bool RightAssoc = Binops.isRightAssoc(BinOp);
+        if(TokPrec < NextPrec || (RightAssoc && TokPrec == NextPrec)) {
+            RHS = ParseBinOpRHS(RightAssoc ? TokPrec : TokPrec+1, RHS);
             if(!RHS) { return nullptr; }
         }
 
         // Merge LHS?RHS
-        LHS = std::make_unique<BinaryExprAST>(BinOp, 
-                                              std::move(LHS), std::move(RHS));
+        LHS = Ctx.create<BinaryExprAST>(BinOp, LHS, RHS);
     }
 }
 
 /// expression
 ///     ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
+ExprAST *Parser::ParseExpression() {
+    if(Iterative) { return ParseExpressionIterative(); }
+
     auto LHS = ParsePrimary();
     if(!LHS) { return nullptr; }
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
+}
+
+/// ReduceBinops - Fold Cur into the pending binary operators above
+/// OperatorBase that bind at least as tightly as an incoming operator of
+/// precedence Prec. As in ParseBinOpRHS, the pending operator decides
+/// associativity: a right-associative one of equal precedence keeps waiting
+/// for its RHS. Prec 0 folds every pending operator down to the innermost
+/// paren or call.
+ExprAST *Parser::ReduceBinops(ExprAST *Cur, size_t OperatorBase, int Prec) {
+    while(Operators.size() > OperatorBase) {
+        const OpFrame &Top = Operators.back();
+        if(Top.Kind != OpFrame::Binop || Top.Prec < Prec ||
+           (Top.RightAssoc && Top.Prec == Prec)) {
+            break;
+        }
+        Cur = Ctx.create<BinaryExprAST>(Top.Op, Top.LHS, Cur);
+        Operators.pop_back();
+    }
+    return Cur;
+}
+
+/// ReduceCall - Pop the call frame on top of the operator stack and build the
+/// call from the arguments collected on the operand stack.
+ExprAST *Parser::ReduceCall() {
+    OpFrame Frame = Operators.back();
+    Operators.pop_back();
+    llvm::ArrayRef<ExprAST *> Args(Operands.data() + Frame.ArgBase,
+                                   Operands.size() - Frame.ArgBase);
+    auto *Call = Ctx.create<CallExprAST>(Frame.Callee, Ctx.copyArray(Args));
+    Operands.resize(Frame.ArgBase);
+    return Call;
+}
+
+/// expression
+///     ::= primary binoprhs
+/// parsed without recursion. The operand being built is kept in Cur; pending
+/// operators (each with its LHS), parens and calls wait on an explicit stack,
+/// and finished call arguments on the operand stack. Nesting depth and chain
+/// length are therefore bounded only by memory, an operator only waits on the
+/// stack when the one after it binds tighter, and the trees match the
+/// recursive parser's.
+ExprAST *Parser::ParseExpressionIterative() {
+    size_t OperandBase = Operands.size(), OperatorBase = Operators.size();
+    auto Fail = [&](const char *Str) {
+        Operands.resize(OperandBase);
+        Operators.resize(OperatorBase);
+        return LogError(Str);
+    };
+
+    ExprAST *Cur;
+    while(true) {
+        // Expecting an operand.
+        switch(CurTok) {
+        case tok_number:
+            Cur = Ctx.create<NumberExprAST>(getNumVal());
+            GetNextToken(); // eat number
+            break;
+        case tok_identifier: {
+            Symbol IdName = getIdentifier();
+            GetNextToken(); // eat identifier
+            if(CurTok != '(') {
+                Cur = Ctx.create<VariableExprAST>(IdName);
+                break;
+            }
+            GetNextToken(); // eat (
+            OpFrame Frame{};
+            Frame.Kind = OpFrame::Call;
+            Frame.Callee = IdName;
+            Frame.ArgBase = Operands.size();
+            Operators.push_back(Frame);
+            if(CurTok != ')') { continue; } // parse the first argument
+            GetNextToken(); // eat )
+            Cur = ReduceCall();
+            break;
+        }
+        case '(': {
+            GetNextToken(); // eat (
+            OpFrame Frame{};
+            Frame.Kind = OpFrame::Paren;
+            Operators.push_back(Frame);
+            continue;
+        }
+        default:
+            return Fail("Unknown token when expecting an expression");
+        }
+
+        // Expecting a binary operator, or the end of a paren, call argument
+        // or the whole expression.
+        int TokPrec = GetTokPrecedence();
+        while(true) {
+            if(TokPrec > 0) {
+                // Fast path for the bulk of most expressions: operators whose
+                // operand is a number or a variable, read straight from the
+                // lexed tokens with the stream position kept in locals. Each
+                // operand joins Cur at once unless the operator after it
+                // binds tighter (by ParseBinOpRHS's rules).
+                llvm::ArrayRef<TokenRecord> Lexed = Toks.getTokens();
+                size_t P = Pos; // index of the operand
+                int Tok = CurTok;
+                while(P + 1 < Lexed.size()) {
+                    const TokenRecord &Operand = Lexed[P];
+                    ExprAST *RHS;
+                    if(Operand.Kind == tok_number) {
+                        RHS = Ctx.create<NumberExprAST>(Toks.getNumber(Operand.Value));
+                    } else if(Operand.Kind == tok_identifier &&
+                              Lexed[P + 1].Kind != '(') {
+                        RHS = Ctx.create<VariableExprAST>(Symbol(Operand.Value));
+                    } else {
+                        break;
+                    }
+                    int Op = Tok;
+                    bool RightAssoc = Binops.isRightAssoc(Op);
+                    ExprAST *LHS = Operators.size() > OperatorBase
+                                       ? ReduceBinops(Cur, OperatorBase, TokPrec)
+                                       : Cur;
+                    Tok = Lexed[P + 1].Kind;
+                    P += 2;
+                    int NextPrec = Binops.getPrecedence(Tok);
+                    if(NextPrec < TokPrec || (NextPrec == TokPrec && !RightAssoc)) {
+                        Cur = Ctx.create<BinaryExprAST>(Op, LHS, RHS);
+                    } else {
+                        OpFrame Frame{};
+                        Frame.Kind = OpFrame::Binop;
+                        Frame.Op = Op;
+                        Frame.Prec = TokPrec;
+                        Frame.RightAssoc = RightAssoc;
+                        Frame.LHS = LHS;
+                        Operators.push_back(Frame);
+                        Cur = RHS;
+                    }
+                    TokPrec = NextPrec;
+                    if(TokPrec <= 0) { break; }
+                }
+                Pos = P;
+                CurTok = Tok;
+                CurValue = Lexed[P - 1].Value;
+                if(TokPrec <= 0) { continue; }
+
+                // Otherwise the operator waits on the stack for an operand
+                // parsed by the outer loop.
+                OpFrame Frame{};
+                Frame.Kind = OpFrame::Binop;
+                Frame.Op = CurTok;
+                Frame.Prec = TokPrec;
+                Frame.RightAssoc = Binops.isRightAssoc(CurTok);
+                Frame.LHS = ReduceBinops(Cur, OperatorBase, TokPrec);
+                Operators.push_back(Frame);
+                GetNextToken(); // eat binop
+                break;
+            }
+
+            Cur = ReduceBinops(Cur, OperatorBase, 0);
+            if(Operators.size() == OperatorBase) { return Cur; }
+
+            OpFrame::FrameKind Kind = Operators.back().Kind;
+            if(CurTok == ')') {
+                GetNextToken(); // eat )
+                if(Kind == OpFrame::Paren) {
+                    Operators.pop_back();
+                } else {
+                    Operands.push_back(Cur);
+                    Cur = ReduceCall();
+                }
+                TokPrec = GetTokPrecedence();
+                continue;
+            }
+            if(Kind == OpFrame::Call && CurTok == ',') {
+                GetNextToken(); // eat ,
+                Operands.push_back(Cur);
+                break;
+            }
+            return Fail(Kind == OpFrame::Paren
+                            ? "expected ')'"
+                            : "Expected ')' or ',' in argument list");
+        }
+    }
 }
 
 /// prototype
 ///     ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+PrototypeAST *Parser::ParsePrototype() {
     if(CurTok != tok_identifier) { 
         return LogErrorP("Expected function name in prototype"); 
     }
 
-    std::string FnName = IdentifierStr;
+    Symbol FnName = getIdentifier();
     GetNextToken();
 
     if(CurTok != '(') {
@@ -311,9 +1660,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     }
 
     // Read the list of argument names
-    std::vector<std::string> ArgNames;
+    llvm::SmallVector<Symbol, 8> ArgNames;
     while(GetNextToken() == tok_identifier) {
-        ArgNames.push_back(IdentifierStr);
+        ArgNames.push_back(getIdentifier());
     }
     if(CurTok != ')') {
         return LogErrorP("Expected ')' in prototype");
@@ -321,34 +1670,34 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 
     // success
     GetNextToken(); // eat ')'
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    return Ctx.create<PrototypeAST>(FnName, Ctx.copyArray<Symbol>(ArgNames));
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+FunctionAST *Parser::ParseDefinition() {
     GetNextToken(); // eat "def"
     auto Proto = ParsePrototype();
     if(!Proto) { return nullptr; }
 
-    if(auto E = ParseDefinition()) {
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    if(auto E = ParseExpression()) {
+        return Ctx.create<FunctionAST>(Proto, E);
     }
     return nullptr;
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+PrototypeAST *Parser::ParseExtern() {
     GetNextToken(); // eat "extern"
     return ParsePrototype();
 }
 
 /// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+FunctionAST *Parser::ParseTopLevelExpr() {
     if(auto E = ParseExpression()) {
         // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        // auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std:;vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = Ctx.create<PrototypeAST>(
+            Toks.getSymbols().getAnonExpr(), llvm::ArrayRef<Symbol>());
+        return Ctx.create<FunctionAST>(Proto, E);
     }
     return nullptr;
 }
@@ -357,61 +1706,790 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 // Top-Level parsing
 //===----------------------------------------------------------------------===//
 
-static void HandleDefinition() {
-  if (ParseDefinition()) {
+static llvm::cl::opt<bool>
+    PrintAST("print-ast", llvm::cl::desc("Print each parsed item's AST"));
+
+static void HandleDefinition(Parser &P) {
+  if (auto *F = P.ParseDefinition()) {
     fprintf(stderr, "Parsed a function definition.\n");
+    if (PrintAST)
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printFunction(F);
   } else {
     // Skip token for error recovery.
-    GetNextToken();
+    P.GetNextToken();
   }
 }
 
-static void HandleExtern() {
-  if (ParseExtern()) {
+static void HandleExtern(Parser &P) {
+  if (auto *Proto = P.ParseExtern()) {
     fprintf(stderr, "Parsed an extern\n");
+    if (PrintAST) {
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printPrototype(Proto);
+      fputc('\n', stderr);
+    }
   } else {
     // Skip token for error recovery.
-    GetNextToken();
+    P.GetNextToken();
   }
 }
 
-static void HandleTopLevelExpression() {
+static void HandleTopLevelExpression(Parser &P) {
   // Evaluate a top-level expression into an anonymous function.
-  if (ParseTopLevelExpr()) {
+  if (auto *F = P.ParseTopLevelExpr()) {
     fprintf(stderr, "Parsed a top-level expr\n");
+    if (PrintAST)
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printFunction(F);
   } else {
     // Skip token for error recovery.
-    GetNextToken();
+    P.GetNextToken();
   }
 }
 
 /// top ::= definition | external | expression | ';'
-static void MainLoop() {
+static void MainLoop(Parser &P, ASTContext &Ctx) {
   while (true) {
+    // Nothing outlives its top-level item yet, so recycle the arena.
+    Ctx.reset();
+    P.getDiagnostics().flush(stderr);
     fprintf(stderr, "ready> ");
-    switch (CurTok) {
+    switch (P.getCurToken()) {
     case tok_eof:
       return;
     case ';': // ignore top-level semicolons.
-      GetNextToken();
+      P.GetNextToken();
+      break;
+    case tok_def:
+      HandleDefinition(P);
+      break;
+    case tok_extern:
+      HandleExtern(P);
+      break;
+    default:
+      HandleTopLevelExpression(P);
       break;
+    }
+  }
+}
+
+/// ParseAllFunctions - Quietly parse every remaining top-level item, appending
+/// definitions and top-level expressions to Fns. Returns the number of items
+/// that failed to parse.
+static unsigned ParseAllFunctions(Parser &P, std::vector<FunctionAST *> &Fns) {
+  unsigned Errors = 0;
+  while (true) {
+    FunctionAST *F = nullptr;
+    bool OK;
+    switch (P.getCurToken()) {
+    case tok_eof:
+      return Errors;
+    case ';':
+      P.GetNextToken();
+      continue;
     case tok_def:
-      HandleDefinition();
+      OK = (F = P.ParseDefinition());
       break;
     case tok_extern:
-      HandleExtern();
+      OK = P.ParseExtern();
       break;
     default:
-      HandleTopLevelExpression();
+      OK = (F = P.ParseTopLevelExpr());
       break;
     }
+    if (F)
+      Fns.push_back(F);
+    if (!OK) {
+      ++Errors;
+      P.GetNextToken(); // Skip token for error recovery.
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel parsing
+//===----------------------------------------------------------------------===//
+
+/// TopLevelItem - The result of parsing one top-level item.
+struct TopLevelItem {
+    int Kind;             // tok_def, tok_extern, or 0 for an expression
+    FunctionAST *Fn;      // the definition or expression, null on error
+    PrototypeAST *Proto;  // the extern, null on error
+    uint32_t DiagEnd;     // end of this item's diagnostics in ParsedChunk::Diags
+};
+
+/// ParsedChunk - The items of one run of the token stream, with the arena
+/// their nodes live in and the diagnostics reported while parsing them.
+struct ParsedChunk {
+    size_t Begin, End; // token indices; items start in [Begin, End)
+    ASTContext Ctx;
+    DiagnosticEngine Diags;
+    std::vector<TopLevelItem> Items;
+
+    explicit ParsedChunk(const SourceBuffer &Source) : Diags(Source) {}
+};
+
+/// SplitTopLevel - Cut the complete stream Toks into at most NumChunks runs of
+/// roughly equal token count. Every cut falls on a 'def' or 'extern', where a
+/// well-formed top-level item must start.
+static std::vector<std::unique_ptr<ParsedChunk>>
+SplitTopLevel(TokenStream &Toks, unsigned NumChunks) {
+    llvm::ArrayRef<TokenRecord> Tokens = Toks.getTokens();
+    std::vector<std::unique_ptr<ParsedChunk>> Chunks;
+    size_t Begin = 0;
+    for(unsigned I = 1; I <= NumChunks && Begin < Tokens.size(); ++I) {
+        size_t End = Tokens.size() * I / NumChunks;
+        while(End < Tokens.size() && Tokens[End].Kind != tok_def &&
+              Tokens[End].Kind != tok_extern) {
+            ++End;
+        }
+        if(End <= Begin) { continue; }
+        Chunks.push_back(std::make_unique<ParsedChunk>(Toks.getSource()));
+        Chunks.back()->Begin = Begin;
+        Chunks.back()->End = End;
+        Begin = End;
+    }
+    return Chunks;
+}
+
+/// ParseChunk - Parse the items of Chunk into its own arena, recovering from
+/// errors the way MainLoop does.
+static void ParseChunk(TokenStream &Toks, ParsedChunk &Chunk, bool Iterative) {
+    Parser P(Toks, Chunk.Ctx, Chunk.Diags, Chunk.Begin);
+    P.setIterative(Iterative);
+    P.GetNextToken();
+    while(P.getTokenIndex() < Chunk.End) {
+        TopLevelItem Item = {P.getCurToken(), nullptr, nullptr, 0};
+        bool OK;
+        switch(Item.Kind) {
+        case tok_eof:
+            return;
+        case ';':
+            P.GetNextToken();
+            continue;
+        case tok_def:
+            OK = (Item.Fn = P.ParseDefinition());
+            break;
+        case tok_extern:
+            OK = (Item.Proto = P.ParseExtern());
+            break;
+        default:
+            Item.Kind = 0;
+            OK = (Item.Fn = P.ParseTopLevelExpr());
+            break;
+        }
+        if(!OK) { P.GetNextToken(); } // Skip token for error recovery.
+        Item.DiagEnd = Chunk.Diags.getDiagnostics().size();
+        Chunk.Items.push_back(Item);
+    }
+}
+
+/// ParseInParallel - Parse the complete stream Toks on up to NumThreads
+/// threads. The stream is split at top-level 'def'/'extern' boundaries into
+/// several chunks per thread, for load balance, and each chunk is parsed by
+/// its own Parser into its own arena; concatenating the chunks gives the items
+/// in source order. Error recovery restarts at every chunk boundary, so
+/// malformed input may cascade differently than in MainLoop.
+static std::vector<std::unique_ptr<ParsedChunk>>
+ParseInParallel(TokenStream &Toks, unsigned NumThreads, bool Iterative) {
+    auto Chunks = SplitTopLevel(Toks, NumThreads == 1 ? 1 : NumThreads * 8);
+    if(NumThreads == 1) {
+        for(auto &Chunk : Chunks) { ParseChunk(Toks, *Chunk, Iterative); }
+        return Chunks;
+    }
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumThreads));
+    for(auto &Chunk : Chunks) {
+        ParsedChunk *C = Chunk.get();
+        Pool.async([&Toks, C, Iterative] { ParseChunk(Toks, *C, Iterative); });
+    }
+    Pool.wait();
+    return Chunks;
+}
+
+/// ReplayDiagnostics - Pass the diagnostics of Item, the next item of Chunk
+/// after those ending at DiagBegin, on to Diags.
+static void ReplayDiagnostics(const ParsedChunk &Chunk, const TopLevelItem &Item,
+                              uint32_t &DiagBegin, DiagnosticEngine &Diags) {
+  for (const Diagnostic &D :
+       Chunk.Diags.getDiagnostics().slice(DiagBegin, Item.DiagEnd - DiagBegin))
+    Diags.report(D);
+  DiagBegin = Item.DiagEnd;
+}
+
+/// ReportParsedChunks - Report the items of Chunks in source order, as
+/// MainLoop would have while parsing them.
+static void ReportParsedChunks(
+    llvm::ArrayRef<std::unique_ptr<ParsedChunk>> Chunks, SymbolTable &Symbols,
+    DiagnosticEngine &Diags) {
+  for (auto &Chunk : Chunks) {
+    uint32_t DiagBegin = 0;
+    for (const TopLevelItem &Item : Chunk->Items) {
+      ReplayDiagnostics(*Chunk, Item, DiagBegin, Diags);
+      Diags.flush(stderr);
+      if (!Item.Fn && !Item.Proto)
+        continue;
+      if (Item.Kind == tok_extern) {
+        fprintf(stderr, "Parsed an extern\n");
+        if (PrintAST) {
+          ASTPrinter(Symbols, stderr).printPrototype(Item.Proto);
+          fputc('\n', stderr);
+        }
+        continue;
+      }
+      fprintf(stderr, Item.Kind == tok_def ? "Parsed a function definition.\n"
+                                           : "Parsed a top-level expr\n");
+      if (PrintAST)
+        ASTPrinter(Symbols, stderr).printFunction(Item.Fn);
+    }
   }
 }
 
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+using BenchClock = std::chrono::steady_clock;
+
+static double SecondsSince(BenchClock::time_point Start) {
+    return std::chrono::duration<double>(BenchClock::now() - Start).count();
+}
+
+/// ClassifyIdentifierLinear - Keyword detection as GetTok originally did it:
+/// materialize the spelling, then compare it against each keyword in turn.
+/// Kept only as the baseline for RunLexerBenchmark.
+static int ClassifyIdentifierLinear(llvm::StringRef Spelling) {
+    std::string IdentifierStr = Spelling.str();
+    for(const KeywordInfo &K : Keywords) {
+        if(IdentifierStr == K.Spelling) { return K.Tok; }
+    }
+    return tok_identifier;
+}
+
+/// EvalBinop - The value of L Op R; unknown operators yield 0.
+static double EvalBinop(char Op, double L, double R) {
+    switch(Op) {
+    case '+': return L + R;
+    case '-': return L - R;
+    case '*': return L * R;
+    case '<': return L < R ? 1.0 : 0.0;
+    default: return 0.0;
+    }
+}
+
+namespace {
+/// TreeEvaluator - The traversal timed for the ExprAST classes: evaluate with
+/// every variable bound to 1 and every call returning the sum of its
+/// arguments. Also counts the nodes visited and the bytes they occupy.
+class TreeEvaluator: public ExprVisitor<TreeEvaluator, double> {
+public:
+    size_t Nodes = 0, Bytes = 0;
+
+    double visitNumberExpr(NumberExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(NumberExprAST);
+        return E->getVal();
+    }
+    double visitVariableExpr(VariableExprAST *) {
+        ++Nodes;
+        Bytes += sizeof(VariableExprAST);
+        return 1.0;
+    }
+    double visitBinaryExpr(BinaryExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(BinaryExprAST);
+        double L = visit(E->getLHS());
+        return EvalBinop(E->getOp(), L, visit(E->getRHS()));
+    }
+    double visitCallExpr(CallExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(CallExprAST) + E->getArgs().size() * sizeof(ExprAST *);
+        double Sum = 0;
+        for(ExprAST *Arg : E->getArgs()) { Sum += visit(Arg); }
+        return Sum;
+    }
+};
+} // end of the namespace
+
+/// EvalFlat - The same evaluation over a FlatExprPool, as one forward loop
+/// that stores each node's value in Values.
+static void EvalFlat(const FlatExprPool &Pool, std::vector<double> &Values) {
+    Values.resize(Pool.size());
+    for(NodeId N = 0, E = Pool.size(); N != E; ++N) {
+        switch(Pool.getKind(N)) {
+        case FlatExprPool::Number:
+            Values[N] = Pool.getNumber(N);
+            break;
+        case FlatExprPool::Variable:
+            Values[N] = 1.0;
+            break;
+        case FlatExprPool::Binary:
+            Values[N] = EvalBinop(Pool.getOp(N), Values[Pool.getLHS(N)],
+                                  Values[Pool.getRHS(N)]);
+            break;
+        case FlatExprPool::Call: {
+            double Sum = 0;
+            for(NodeId Arg : Pool.getArgs(N)) { Sum += Values[Arg]; }
+            Values[N] = Sum;
+            break;
+        }
+        }
+    }
+}
+
+/// RunASTBenchmark - Parse Source into ExprAST classes and into a
+/// FlatExprPool, then compare their size and how fast each is traversed.
+static int RunASTBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-ast needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    ASTContext Ctx;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+    Parser P(Toks, Ctx, Diags);
+    P.GetNextToken();
+    std::vector<FunctionAST *> Fns;
+    ParseAllFunctions(P, Fns);
+
+    auto Start = BenchClock::now();
+    FlatExprPool Pool;
+    std::vector<NodeId> Roots;
+    for(FunctionAST *F : Fns) { Roots.push_back(Pool.flatten(F->getBody())); }
+    double FlattenTime = SecondsSince(Start);
+
+    TreeEvaluator Eval;
+    double TreeSum = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        Eval = TreeEvaluator();
+        TreeSum = 0;
+        for(FunctionAST *F : Fns) { TreeSum += Eval.visit(F->getBody()); }
+    }
+    double TreeTime = SecondsSince(Start);
+    size_t Nodes = Eval.Nodes, Bytes = Eval.Bytes;
+
+    std::vector<double> Values;
+    double FlatSum = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        EvalFlat(Pool, Values);
+        FlatSum = 0;
+        for(NodeId Root : Roots) { FlatSum += Values[Root]; }
+    }
+    double FlatTime = SecondsSince(Start);
+
+    double Visited = double(Nodes) * Iterations;
+    fprintf(stderr, "class AST: %zu nodes, %.1f bytes/node, %.1f Mnodes/s\n",
+            Nodes, Nodes ? double(Bytes) / Nodes : 0.0, Visited / TreeTime / 1e6);
+    fprintf(stderr, "flat AST:  %zu nodes, %.1f bytes/node, %.1f Mnodes/s (%.2fx), "
+            "built in %.3fs\n", Pool.size(),
+            Pool.size() ? double(Pool.getMemoryBytes()) / Pool.size() : 0.0,
+            Visited / FlatTime / 1e6, TreeTime / FlatTime, FlattenTime);
+    if(TreeSum != FlatSum) {
+        fprintf(stderr, "Error: traversal results differ (%g vs %g)\n", TreeSum, FlatSum);
+        return 1;
+    }
+    return 0;
+}
+
+/// SameExpr - Whether A and B are structurally identical expressions.
+static bool SameExpr(const ExprAST *A, const ExprAST *B) {
+    if(A->getKind() != B->getKind()) { return false; }
+    switch(A->getKind()) {
+    case ExprAST::EK_Number:
+        return llvm::cast<NumberExprAST>(A)->getVal() ==
+               llvm::cast<NumberExprAST>(B)->getVal();
+    case ExprAST::EK_Variable:
+        return llvm::cast<VariableExprAST>(A)->getName() ==
+               llvm::cast<VariableExprAST>(B)->getName();
+    case ExprAST::EK_Binary: {
+        auto *BA = llvm::cast<BinaryExprAST>(A), *BB = llvm::cast<BinaryExprAST>(B);
+        return BA->getOp() == BB->getOp() && SameExpr(BA->getLHS(), BB->getLHS()) &&
+               SameExpr(BA->getRHS(), BB->getRHS());
+    }
+    case ExprAST::EK_Call: {
+        auto *CA = llvm::cast<CallExprAST>(A), *CB = llvm::cast<CallExprAST>(B);
+        if(CA->getCallee() != CB->getCallee() ||
+           CA->getArgs().size() != CB->getArgs().size()) { return false; }
+        for(size_t I = 0, E = CA->getArgs().size(); I != E; ++I) {
+            if(!SameExpr(CA->getArgs()[I], CB->getArgs()[I])) { return false; }
+        }
+        return true;
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+/// RunParserBenchmark - Parse the pre-lexed Source Iterations times with the
+/// recursive and with the iterative expression parser, then check that both
+/// built the same trees.
+static int RunParserBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-parse needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+
+    for(bool Iterative : {false, true}) {
+        size_t Items = 0, Nodes = 0;
+        unsigned Errors = 0;
+        auto Start = BenchClock::now();
+        for(unsigned I = 0; I != Iterations; ++I) {
+            ASTContext Ctx;
+            Parser P(Toks, Ctx, Diags);
+            P.setIterative(Iterative);
+            P.GetNextToken();
+            std::vector<FunctionAST *> Fns;
+            Errors = ParseAllFunctions(P, Fns);
+            Items = Fns.size();
+            Nodes = Ctx.getNumNodes();
+        }
+        double Time = SecondsSince(Start);
+        fprintf(stderr, "%-9s parser: %zu items, %zu nodes, %u errors, %.3fs, %.1f Mnodes/s\n",
+                Iterative ? "iterative" : "recursive", Items, Nodes, Errors,
+                Time, double(Nodes) * Iterations / Time / 1e6);
+    }
+
+    // One more, untimed, parse with each to compare what they built.
+    ASTContext Ctxs[2];
+    std::vector<FunctionAST *> Fns[2];
+    for(bool Iterative : {false, true}) {
+        Parser P(Toks, Ctxs[Iterative], Diags);
+        P.setIterative(Iterative);
+        P.GetNextToken();
+        ParseAllFunctions(P, Fns[Iterative]);
+    }
+    if(Fns[0].size() != Fns[1].size()) {
+        fprintf(stderr, "Error: the parsers found %zu and %zu items\n",
+                Fns[0].size(), Fns[1].size());
+        return 1;
+    }
+    for(size_t I = 0, E = Fns[0].size(); I != E; ++I) {
+        if(!SameExpr(Fns[0][I]->getBody(), Fns[1][I]->getBody())) {
+            fprintf(stderr, "Error: the parsers disagree on item %zu\n", I);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// RunParallelBenchmark - Parse the pre-lexed Source with ParseInParallel on
+/// 1, 2, 4, ... up to MaxThreads threads and report the speedup over one.
+static int RunParallelBenchmark(SourceBuffer &Source, unsigned MaxThreads) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-parallel needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+
+    fprintf(stderr, "%u hardware threads, %zu tokens\n",
+            llvm::hardware_concurrency().compute_thread_count(), Toks.size());
+    double BaseTime = 0;
+    for(unsigned Threads = 1;; Threads = std::min(Threads * 2, MaxThreads)) {
+        // Best of three, to keep scheduling noise out of the curve.
+        double Time = 1e30;
+        size_t Items = 0, Nodes = 0;
+        for(int Run = 0; Run != 3; ++Run) {
+            auto Start = BenchClock::now();
+            auto Chunks = ParseInParallel(Toks, Threads, false);
+            Time = std::min(Time, SecondsSince(Start));
+            Items = Nodes = 0;
+            for(auto &Chunk : Chunks) {
+                Items += Chunk->Items.size();
+                Nodes += Chunk->Ctx.getNumNodes();
+            }
+        }
+        if(Threads == 1) { BaseTime = Time; }
+        fprintf(stderr, "%3u threads: %zu items, %zu nodes, %.3fs, %.1f Mnodes/s, %.2fx\n",
+                Threads, Items, Nodes, Time, double(Nodes) / Time / 1e6,
+                BaseTime / Time);
+        if(Threads == MaxThreads) { break; }
+    }
+    return 0;
+}
+
+/// RunLexerBenchmark - Lex Source Iterations times and report token and
+/// identifier throughput, then time keyword classification of every word in
+/// the input with the original linear chain and with the perfect hash.
+static int RunLexerBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-lex needs a file or piped input\n");
+        return 1;
+    }
+
+    size_t Tokens = 0, Idents = 0;
+    std::vector<llvm::StringRef> Words; // identifier and keyword spellings
+    auto Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        SymbolTable Symbols;
+        DiagnosticEngine Diags(Source);
+        Lexer Lex(Source, Symbols, Diags);
+        for(int Tok = Lex.getNextToken(); Tok != tok_eof; Tok = Lex.getNextToken()) {
+            ++Tokens;
+            if(Tok == tok_identifier || Tok == tok_def || Tok == tok_extern) {
+                ++Idents;
+                if(I == 0) { Words.push_back(Lex.getTokenSpelling()); }
+            }
+        }
+    }
+    double LexTime = SecondsSince(Start);
+    double GB = double(Source.getBufferSize()) * Iterations / 1e9;
+    fprintf(stderr, "lexer:   [%s] %zu tokens in %.3fs: %.1f Mtok/s, %.1f Mident/s, %.3f GB/s\n",
+            DefaultScanKernels->Name, Tokens, LexTime, Tokens / LexTime / 1e6,
+            Idents / LexTime / 1e6, GB / LexTime);
+
+    // Keyword classification alone, before and after.
+    unsigned Sink = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        for(llvm::StringRef W : Words) { Sink += ClassifyIdentifierLinear(W); }
+    }
+    double LinearTime = SecondsSince(Start);
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        for(llvm::StringRef W : Words) { Sink += ClassifyIdentifier(W.data(), W.size()); }
+    }
+    double HashTime = SecondsSince(Start);
+    double NumWords = double(Words.size()) * Iterations;
+    fprintf(stderr, "keyword: linear %.1f Mident/s, perfect hash %.1f Mident/s (%.2fx) [%u]\n",
+            NumWords / LinearTime / 1e6, NumWords / HashTime / 1e6,
+            LinearTime / HashTime, Sink);
+    return 0;
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
-  return 0;
+static llvm::cl::list<std::string> InputFilenames(llvm::cl::Positional,
+                                                  llvm::cl::desc("<input files>"),
+                                                  llvm::cl::ZeroOrMore);
+
+static llvm::cl::opt<bool> Batch(
+    "batch",
+    llvm::cl::desc("Compile the input files without prompts or per-item "
+                   "messages, then print their diagnostics and one summary"));
+
+static llvm::cl::opt<bool>
+    ASTStats("ast-stats",
+             llvm::cl::desc("Print AST arena allocation statistics on exit"));
+
+static llvm::cl::opt<unsigned> BenchLex(
+    "bench-lex", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Lex the input N times, report throughput and exit"));
+
+static llvm::cl::opt<bool> Pretokenize(
+    "pretokenize",
+    llvm::cl::desc("Lex the whole input into a token array before parsing"));
+
+static llvm::cl::opt<unsigned> BenchAST(
+    "bench-ast", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Compare N traversals of the class and flat ASTs and exit"));
+
+static llvm::cl::opt<bool> IterativeParser(
+    "iterative-parser",
+    llvm::cl::desc("Parse expressions with explicit stacks, not recursion"));
+
+static llvm::cl::list<std::string> UserBinops(
+    "binop", llvm::cl::value_desc("op:prec[:right]"),
+    llvm::cl::desc("Register a binary operator with the given precedence "
+                   "(1-127; 0 removes it), optionally right-associative"));
+
+static llvm::cl::opt<unsigned> BenchParse(
+    "bench-parse", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Parse the input N times with each expression parser and exit"));
+
+static llvm::cl::opt<unsigned> ParseThreads(
+    "parallel-parse", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Lex the whole input, then parse its top-level items on N "
+                   "threads (0 = all hardware threads)"));
+
+static llvm::cl::opt<unsigned> BenchParallel(
+    "bench-parallel", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Report parallel parsing speedup on up to N threads and exit"));
+
+static llvm::cl::opt<std::string> LexKernel(
+    "lex-kernel", llvm::cl::init("auto"),
+    llvm::cl::desc("Lexer scanning kernels: auto, scalar, sse2 or avx2"));
+
+static llvm::cl::opt<unsigned> ErrorLimit(
+    "error-limit", llvm::cl::init(20), llvm::cl::value_desc("N"),
+    llvm::cl::desc("With -batch or -parallel-parse, stop reporting errors "
+                   "after N per file (0 = no limit)"));
+
+static llvm::cl::opt<DiagFormat> DiagnosticsFormat(
+    "diagnostics-format", llvm::cl::init(DF_Text),
+    llvm::cl::desc("How diagnostics are printed"),
+    llvm::cl::values(clEnumValN(DF_Text, "text", "file:line:col: message"),
+                     clEnumValN(DF_JSON, "json", "one JSON object per line")));
+
+/// RegisterBinops - Add the operators given with -binop to DefaultBinops.
+/// Returns false after reporting a malformed one, or one the lexer never
+/// returns as a token of its own ('#' starts a comment, '.' a number).
+static bool RegisterBinops() {
+  for (llvm::StringRef Spec : UserBinops) {
+    llvm::StringRef Op, Prec, Assoc;
+    std::tie(Op, Prec) = Spec.split(':');
+    std::tie(Prec, Assoc) = Prec.split(':');
+    unsigned P;
+    bool Valid = Op.size() == 1 && isascii(Op[0]) && ispunct(Op[0]) &&
+                 !llvm::StringRef("(),;#.").contains(Op[0]) &&
+                 !Prec.getAsInteger(10, P) &&
+                 (Assoc.empty() || Assoc == "left" || Assoc == "right");
+    if (Valid && P == 0)
+      DefaultBinops.removeBinop(Op[0]);
+    else if (!Valid || !DefaultBinops.addBinop(Op[0], P, Assoc == "right")) {
+      fprintf(stderr, "Error: bad -binop '%s', expected op:prec[:right]\n",
+              Spec.str().c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/// ConfigureDiagnostics - Apply the diagnostic options to Diags.
+static void ConfigureDiagnostics(DiagnosticEngine &Diags) {
+  Diags.setErrorLimit(ErrorLimit);
+  Diags.setCollapseRepeats(true);
+  Diags.setFormat(DiagnosticsFormat);
+}
+
+/// RunBatch - Compile each of Files in turn without any interactive output.
+/// Diagnostics are collected and written out in one go at the end, followed
+/// by a summary line, so that the time spent reflects compilation rather than
+/// terminal I/O. As the files are lexed whole before parsing, lexical errors
+/// are listed before syntax errors. The summary counts every error reported,
+/// lexical ones included. Returns the exit status.
+static int RunBatch(llvm::ArrayRef<std::string> Files) {
+  auto Start = BenchClock::now();
+  unsigned Threads =
+      ParseThreads.getNumOccurrences()
+          ? (ParseThreads ? ParseThreads
+                          : llvm::hardware_concurrency().compute_thread_count())
+          : 1;
+  std::string DiagText;
+  size_t Bytes = 0, Counts[3] = {0, 0, 0}; // definitions, externs, exprs
+  unsigned Errors = 0, BadFiles = 0;
+  for (const std::string &File : Files) {
+    auto Source = File == "-" ? SourceBuffer::getSTDIN()
+                              : SourceBuffer::getFile(File);
+    if (!Source) {
+      ++BadFiles;
+      continue;
+    }
+    Bytes += Source->getBufferSize();
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(*Source);
+    ConfigureDiagnostics(Diags);
+    TokenStream Toks(*Source, Symbols, Diags);
+    Toks.lexAll();
+    for (auto &Chunk : ParseInParallel(Toks, Threads, IterativeParser)) {
+      uint32_t DiagBegin = 0;
+      for (const TopLevelItem &Item : Chunk->Items) {
+        ReplayDiagnostics(*Chunk, Item, DiagBegin, Diags);
+        if (Item.Fn || Item.Proto)
+          ++Counts[Item.Kind == tok_def ? 0 : Item.Kind == tok_extern ? 1 : 2];
+      }
+    }
+    Diags.finish();
+    Errors += Diags.getNumErrors();
+    Diags.render(DiagText);
+  }
+
+  fwrite(DiagText.data(), 1, DiagText.size(), stderr);
+  fprintf(stderr,
+          "%zu files, %zu bytes: %zu definitions, %zu externs, %zu top-level "
+          "exprs, %u errors in %.3fs\n",
+          Files.size(), Bytes, Counts[0], Counts[1], Counts[2], Errors,
+          SecondsSince(Start));
+  return Errors || BadFiles ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+
+  DefaultScanKernels = SelectScanKernels(LexKernel);
+  if (!DefaultScanKernels) {
+    fprintf(stderr, "Error: lexer kernels '%s' are not available\n",
+            LexKernel.c_str());
+    return 1;
+  }
+  if (!RegisterBinops())
+    return 1;
+
+  if (InputFilenames.empty())
+    InputFilenames.push_back("-");
+  if (Batch)
+    return RunBatch(InputFilenames);
+  if (InputFilenames.size() > 1) {
+    fprintf(stderr, "Error: more than one input file needs -batch\n");
+    return 1;
+  }
+
+  // Lex a file if one is given, otherwise standard input (a terminal is read
+  // lazily, which keeps the REPL interactive).
+  const std::string &InputFilename = InputFilenames.front();
+  auto Source = InputFilename == "-" ? SourceBuffer::getSTDIN()
+                                     : SourceBuffer::getFile(InputFilename);
+  if (!Source)
+    return 1;
+
+  if (BenchLex)
+    return RunLexerBenchmark(*Source, BenchLex);
+  if (BenchAST)
+    return RunASTBenchmark(*Source, BenchAST);
+  if (BenchParse)
+    return RunParserBenchmark(*Source, BenchParse);
+  if (BenchParallel)
+    return RunParallelBenchmark(*Source, BenchParallel);
+
+  SymbolTable Symbols;
+  ASTContext Ctx;
+  DiagnosticEngine Diags(*Source);
+  ConfigureDiagnostics(Diags);
+  TokenStream Toks(*Source, Symbols, Diags);
+  if (ParseThreads.getNumOccurrences()) {
+    Toks.lexAll();
+    unsigned Threads = ParseThreads ? ParseThreads
+                                    : llvm::hardware_concurrency()
+                                          .compute_thread_count();
+    auto Chunks = ParseInParallel(Toks, Threads, IterativeParser);
+    ReportParsedChunks(Chunks, Symbols, Diags);
+    Diags.finish();
+    Diags.flush(stderr);
+    if (ASTStats)
+      for (auto &Chunk : Chunks)
+        Chunk->Ctx.printStats(stderr);
+    return Diags.getNumErrors() ? 1 : 0;
+  }
+  // The error limit is for whole files; a REPL session shows every error.
+  Diags.setErrorLimit(0);
+  if (Pretokenize)
+    Toks.lexAll();
+  Parser P(Toks, Ctx, Diags);
+  P.setIterative(IterativeParser);
+
+  // Prime the first token.
+  fprintf(stderr, "ready> ");
+  P.GetNextToken();
+
+  // Run the main "interpreter loop" now.
+  MainLoop(P, Ctx);
+  Diags.finish();
+  Diags.flush(stderr);
+
+  if (ASTStats)
+    Ctx.printStats(stderr);
+
+  return Diags.getNumErrors() ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,5207 @@
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//===----------------------------------------------------------------------===//
+// Source Buffer
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// SourceBuffer - The program text as one contiguous range of characters,
+/// terminated by a NUL sentinel so the lexer can scan with a bare pointer.
+/// Regular files are mmap'ed, pipes are slurped with large block reads, and an
+/// interactive terminal is filled incrementally through refill(), so the REPL
+/// and batch mode share one lexer.
+class SourceBuffer {
+    std::string Name;
+    int FD = -1;
+    bool Interactive = false;
+    bool AtEOF = false;
+
+    char *MapBase = nullptr; // non-null if the text is an mmap'ed file
+    size_t MapSize = 0;
+    std::vector<char> Storage; // heap copy of the text plus the sentinel
+
+    const char *Start = nullptr;
+    size_t Size = 0;
+
+    // Offsets of the line starts in [0, LinesScanned), for getLineAndColumn.
+    mutable std::vector<uint32_t> LineStarts = {0};
+    mutable size_t LinesScanned = 0;
+
+    SourceBuffer(std::string Name): Name(std::move(Name)) {}
+
+    /// readAll - Drain FD into Storage with large block reads.
+    bool readAll() {
+        size_t Len = 0;
+        Storage.resize(1 << 16);
+        while(true) {
+            if(Len == Storage.size()) { Storage.resize(Storage.size() * 2); }
+            ssize_t N = ::read(FD, Storage.data() + Len, Storage.size() - Len);
+            if(N < 0 && errno == EINTR) { continue; }
+            if(N < 0) { return false; }
+            if(N == 0) { break; }
+            Len += N;
+        }
+        Storage.resize(Len);
+        setStorage();
+        return true;
+    }
+
+    /// setStorage - Append the sentinel and point the view at Storage.
+    void setStorage() {
+        Storage.push_back('\0');
+        Start = Storage.data();
+        Size = Storage.size() - 1;
+    }
+
+public:
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+    ~SourceBuffer() {
+        if(MapBase) { munmap(MapBase, MapSize); }
+        if(FD > STDERR_FILENO) { close(FD); }
+    }
+
+    /// getFile - Map the file at Path. Returns nullptr (after reporting) if it
+    /// cannot be read.
+    static std::unique_ptr<SourceBuffer> getFile(const std::string &Path) {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer(Path));
+        SB->FD = open(Path.c_str(), O_RDONLY);
+        struct stat St;
+        if(SB->FD < 0 || fstat(SB->FD, &St) != 0) {
+            fprintf(stderr, "Error: cannot open '%s': %s\n", Path.c_str(),
+                    strerror(errno));
+            return nullptr;
+        }
+
+        // mmap zero-fills the tail of the last page, which doubles as the
+        // sentinel. A file that ends exactly on a page boundary has no such
+        // tail, so it (like a FIFO or device) is read into memory instead.
+        size_t PageSize = sysconf(_SC_PAGESIZE);
+        size_t FileSize = St.st_size;
+        if(S_ISREG(St.st_mode) && FileSize % PageSize != 0) {
+            void *Base = mmap(nullptr, FileSize, PROT_READ, MAP_PRIVATE,
+                              SB->FD, 0);
+            if(Base != MAP_FAILED) {
+                SB->MapBase = static_cast<char *>(Base);
+                SB->MapSize = FileSize;
+                SB->Start = SB->MapBase;
+                SB->Size = FileSize;
+                return SB;
+            }
+        }
+        if(!SB->readAll()) {
+            fprintf(stderr, "Error: cannot read '%s': %s\n", Path.c_str(),
+                    strerror(errno));
+            return nullptr;
+        }
+        return SB;
+    }
+
+    /// getSTDIN - Wrap standard input. A terminal is read lazily a chunk
+    /// (typically a line) at a time; anything else is read up front.
+    static std::unique_ptr<SourceBuffer> getSTDIN() {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer("<stdin>"));
+        SB->FD = STDIN_FILENO;
+        if(isatty(STDIN_FILENO)) {
+            SB->Interactive = true;
+            SB->setStorage();
+            return SB;
+        }
+        if(!SB->readAll()) {
+            fprintf(stderr, "Error: cannot read <stdin>: %s\n", strerror(errno));
+            return nullptr;
+        }
+        return SB;
+    }
+
+    /// getMemBuffer - Copy Text into a new buffer.
+    static std::unique_ptr<SourceBuffer> getMemBuffer(const std::string &Text,
+                                                      std::string Name = "<memory>") {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer(std::move(Name)));
+        SB->Storage.assign(Text.begin(), Text.end());
+        SB->setStorage();
+        return SB;
+    }
+
+    const std::string &getName() const { return Name; }
+    const char *getBufferStart() const { return Start; }
+    const char *getBufferEnd() const { return Start + Size; } // at the sentinel
+    size_t getBufferSize() const { return Size; }
+    bool isInteractive() const { return Interactive; }
+
+    /// getLineAndColumn - The 1-based line and column of the byte at Offset.
+    /// Nothing about lines is tracked while lexing; the table of line starts
+    /// is built on the first call, and only as far as the offsets asked about.
+    /// Not safe to call from several threads at once.
+    std::pair<unsigned, unsigned> getLineAndColumn(size_t Offset) const;
+
+    /// refill - Append the next chunk of an interactive source. Returns false
+    /// once no more input is coming. The buffer may move, so callers must
+    /// re-derive their pointers from getBufferStart().
+    bool refill() {
+        if(!Interactive || AtEOF) { return false; }
+        static const size_t ChunkSize = 4096;
+        Storage.pop_back(); // drop the sentinel
+        size_t Len = Storage.size();
+        Storage.resize(Len + ChunkSize);
+        ssize_t N;
+        do {
+            N = ::read(FD, Storage.data() + Len, ChunkSize);
+        } while(N < 0 && errno == EINTR);
+        Storage.resize(Len + (N > 0 ? N : 0));
+        setStorage();
+        if(N <= 0) { AtEOF = true; }
+        return N > 0;
+    }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// Diagnostics
+//===----------------------------------------------------------------------===//
+
+namespace {
+enum DiagSeverity : uint8_t { DS_Note, DS_Warning, DS_Error };
+enum DiagFormat : uint8_t { DF_Text, DF_JSON };
+
+/// Diagnostic - One message about a point in a SourceBuffer. Only the byte
+/// offset is recorded; line and column are worked out when it is printed.
+struct Diagnostic {
+    DiagSeverity Severity;
+    uint32_t Offset;
+    std::string Message;
+};
+
+/// DiagnosticEngine - Records the diagnostics for one SourceBuffer and prints
+/// them in a single write when flushed, as text ("file:line:col: error: ...")
+/// or as JSON, one object per line. A run of identical diagnostics on one
+/// line, as error recovery tends to produce, is kept once and followed by a
+/// note with the repeat count. A run never reaches back past a flush, so in
+/// the REPL each top-level item's note is printed along with that item's
+/// errors. Errors beyond the error limit are only counted. Both are
+/// off by default, which makes an engine a plain recorder whose diagnostics
+/// can later be replayed into another engine.
+class DiagnosticEngine {
+    const SourceBuffer &Source;
+    std::vector<Diagnostic> Diags;
+    size_t NumFlushed = 0;         // Diags already printed
+    unsigned NumErrors = 0;        // errors reported, including suppressed ones
+    unsigned NumKeptErrors = 0;    // errors recorded, not counting repeats
+    unsigned NumSuppressed = 0;    // errors dropped past the limit
+    unsigned ErrorLimit = 0;       // errors kept before suppressing; 0 = all
+    bool CollapseRepeats = false;
+    unsigned Repeats = 0;          // unrecorded repeats of the last diagnostic
+    DiagFormat Format = DF_Text;
+
+    void noteRepeats() {
+        if(!Repeats) { return; }
+        Diags.push_back({DS_Note, Diags.back().Offset,
+                         "previous diagnostic repeated " +
+                             std::to_string(Repeats) +
+                             (Repeats == 1 ? " more time" : " more times")});
+        Repeats = 0;
+    }
+
+    /// onSameLine - Whether no newline separates the offsets A and B.
+    bool onSameLine(size_t A, size_t B) const {
+        if(A > B) { std::swap(A, B); }
+        return !memchr(Source.getBufferStart() + A, '\n', B - A);
+    }
+
+public:
+    explicit DiagnosticEngine(const SourceBuffer &Source) : Source(Source) {}
+
+    void setErrorLimit(unsigned Limit) { ErrorLimit = Limit; }
+    void setCollapseRepeats(bool Enable) { CollapseRepeats = Enable; }
+    void setFormat(DiagFormat F) { Format = F; }
+
+    void report(DiagSeverity Severity, size_t Offset, std::string Message) {
+        NumErrors += Severity == DS_Error;
+        if(CollapseRepeats && NumFlushed != Diags.size() &&
+           Diags.back().Severity == Severity && Diags.back().Message == Message &&
+           onSameLine(Diags.back().Offset, Offset)) {
+            ++Repeats;
+            return;
+        }
+        if(Severity == DS_Error) {
+            if(ErrorLimit && NumKeptErrors == ErrorLimit) {
+                ++NumSuppressed;
+                return;
+            }
+            ++NumKeptErrors;
+        }
+        noteRepeats();
+        Diags.push_back({Severity, uint32_t(Offset), std::move(Message)});
+    }
+    void report(const Diagnostic &D) { report(D.Severity, D.Offset, D.Message); }
+    void error(size_t Offset, std::string Message) {
+        report(DS_Error, Offset, std::move(Message));
+    }
+
+    llvm::ArrayRef<Diagnostic> getDiagnostics() const { return Diags; }
+    unsigned getNumErrors() const { return NumErrors; }
+
+    /// finish - Add the notes for repeats and suppressed errors still pending.
+    /// Call once, after the last report.
+    void finish() {
+        noteRepeats();
+        if(NumSuppressed) {
+            Diags.push_back({DS_Note, uint32_t(Source.getBufferSize()),
+                             std::to_string(NumSuppressed) +
+                                 (NumSuppressed == 1 ? " more error" : " more errors") +
+                                 " suppressed (-error-limit=" +
+                                 std::to_string(ErrorLimit) + ")"});
+        }
+    }
+
+    /// render - Append the diagnostics not yet flushed to Out, closing any
+    /// pending run of repeats first; later reports start a new run.
+    void render(std::string &Out);
+
+    /// flush - Print the diagnostics not yet flushed to OS in one write.
+    void flush(FILE *OS) {
+        std::string Out;
+        render(Out);
+        fwrite(Out.data(), 1, Out.size(), OS);
+    }
+};
+} // end of the namespace
+
+void DiagnosticEngine::render(std::string &Out) {
+    static const char *const SeverityNames[] = {"note", "warning", "error"};
+    noteRepeats();
+    llvm::raw_string_ostream OS(Out);
+    for(; NumFlushed != Diags.size(); ++NumFlushed) {
+        const Diagnostic &D = Diags[NumFlushed];
+        auto LineCol = Source.getLineAndColumn(D.Offset);
+        if(Format == DF_Text) {
+            OS << Source.getName() << ':' << LineCol.first << ':'
+               << LineCol.second << ": " << SeverityNames[D.Severity] << ": "
+               << D.Message << '\n';
+            continue;
+        }
+        llvm::json::OStream J(OS);
+        J.object([&] {
+            J.attribute("file", Source.getName());
+            J.attribute("line", LineCol.first);
+            J.attribute("column", LineCol.second);
+            J.attribute("offset", D.Offset);
+            J.attribute("severity", SeverityNames[D.Severity]);
+            J.attribute("message", D.Message);
+        });
+        OS << '\n';
+    }
+    OS.flush();
+}
+
+//===----------------------------------------------------------------------===//
+// Scanning Kernels
+//===----------------------------------------------------------------------===//
+
+// The lexer's inner loops (whitespace, comments, identifier and digit runs)
+// are run by one set of kernels, picked at startup from what the CPU supports.
+// Each kernel scans [P, End) and returns the first character outside the run,
+// or End. The vector kernels only load whole blocks inside [P, End) and finish
+// the tail with scalar code, so they never read past the sentinel. Character
+// classes are plain ASCII; unlike <cctype> they ignore the C locale.
+
+namespace {
+using ScanFn = const char *(*)(const char *P, const char *End);
+
+struct ScanKernels {
+    const char *Name;
+    ScanFn SkipSpace;  // past ' ', '\t', '\n', '\v', '\f', '\r'
+    ScanFn FindEOL;    // up to the next '\n' or '\r'
+    ScanFn FindNewline; // up to the next '\n'
+    ScanFn SkipAlnum;  // past [0-9A-Za-z]
+    ScanFn SkipDigits; // past [0-9]
+};
+} // end of the namespace
+
+static bool IsSpaceChar(char C) { return llvm::isSpace(C); }
+static bool IsNotEOLChar(char C) { return C != '\n' && C != '\r'; }
+static bool IsNotNewlineChar(char C) { return C != '\n'; }
+static bool IsAlnumChar(char C) { return llvm::isAlnum(C); }
+static bool IsDigitChar(char C) { return llvm::isDigit(C); }
+
+template <bool (*InRun)(char)>
+static const char *ScalarScan(const char *P, const char *End) {
+    while(P != End && InRun(*P)) { ++P; }
+    return P;
+}
+
+static const ScanKernels ScalarKernels = {
+    "scalar", ScalarScan<IsSpaceChar>, ScalarScan<IsNotEOLChar>,
+    ScalarScan<IsNotNewlineChar>, ScalarScan<IsAlnumChar>,
+    ScalarScan<IsDigitChar>};
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 kernels, 16 bytes per step. Each classifier returns 0xFF in the lanes
+// that belong to the run.
+
+/// SSE2InRange - Lanes with Lo <= V <= Hi, as one unsigned compare.
+static inline __m128i SSE2InRange(__m128i V, char Lo, char Hi) {
+    __m128i D = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(Hi - Lo)), D);
+}
+static inline __m128i SSE2IsSpace(__m128i V) {
+    return _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                        SSE2InRange(V, '\t', '\r'));
+}
+static inline __m128i SSE2IsNotEOL(__m128i V) {
+    __m128i EOL = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                               _mm_cmpeq_epi8(V, _mm_set1_epi8('\r')));
+    return _mm_xor_si128(EOL, _mm_set1_epi8(-1));
+}
+static inline __m128i SSE2IsNotNewline(__m128i V) {
+    return _mm_xor_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                         _mm_set1_epi8(-1));
+}
+static inline __m128i SSE2IsDigit(__m128i V) { return SSE2InRange(V, '0', '9'); }
+static inline __m128i SSE2IsAlnum(__m128i V) {
+    // Folding to lower case maps the letters onto 'a'..'z' and leaves the
+    // digits untouched.
+    __m128i Lower = _mm_or_si128(V, _mm_set1_epi8(0x20));
+    return _mm_or_si128(SSE2IsDigit(V), SSE2InRange(Lower, 'a', 'z'));
+}
+
+template <__m128i (*InRun)(__m128i), bool (*ScalarInRun)(char)>
+static const char *SSE2Scan(const char *P, const char *End) {
+    for(; End - P >= 16; P += 16) {
+        __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+        unsigned Stop = ~_mm_movemask_epi8(InRun(V)) & 0xFFFF;
+        if(Stop) { return P + __builtin_ctz(Stop); }
+    }
+    return ScalarScan<ScalarInRun>(P, End);
+}
+
+static const ScanKernels SSE2Kernels = {
+    "sse2", SSE2Scan<SSE2IsSpace, IsSpaceChar>,
+    SSE2Scan<SSE2IsNotEOL, IsNotEOLChar>,
+    SSE2Scan<SSE2IsNotNewline, IsNotNewlineChar>,
+    SSE2Scan<SSE2IsAlnum, IsAlnumChar>, SSE2Scan<SSE2IsDigit, IsDigitChar>};
+
+// AVX2 kernels, 32 bytes per step; same scheme as the SSE2 ones. Compiled for
+// AVX2 regardless of -march and only used when the CPU reports support.
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i AVX2InRange(__m256i V, char Lo, char Hi) {
+    __m256i D = _mm256_sub_epi8(V, _mm256_set1_epi8(Lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(D, _mm256_set1_epi8(Hi - Lo)), D);
+}
+AVX2_TARGET static inline __m256i AVX2IsSpace(__m256i V) {
+    return _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')),
+                           AVX2InRange(V, '\t', '\r'));
+}
+AVX2_TARGET static inline __m256i AVX2IsNotEOL(__m256i V) {
+    __m256i EOL = _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                  _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r')));
+    return _mm256_xor_si256(EOL, _mm256_set1_epi8(-1));
+}
+AVX2_TARGET static inline __m256i AVX2IsNotNewline(__m256i V) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                            _mm256_set1_epi8(-1));
+}
+AVX2_TARGET static inline __m256i AVX2IsDigit(__m256i V) {
+    return AVX2InRange(V, '0', '9');
+}
+AVX2_TARGET static inline __m256i AVX2IsAlnum(__m256i V) {
+    __m256i Lower = _mm256_or_si256(V, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(AVX2IsDigit(V), AVX2InRange(Lower, 'a', 'z'));
+}
+
+template <__m256i (*InRun)(__m256i), bool (*ScalarInRun)(char)>
+AVX2_TARGET static const char *AVX2Scan(const char *P, const char *End) {
+    for(; End - P >= 32; P += 32) {
+        __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+        unsigned Stop = ~(unsigned)_mm256_movemask_epi8(InRun(V));
+        if(Stop) { return P + __builtin_ctz(Stop); }
+    }
+    return ScalarScan<ScalarInRun>(P, End);
+}
+
+static const ScanKernels AVX2Kernels = {
+    "avx2", AVX2Scan<AVX2IsSpace, IsSpaceChar>,
+    AVX2Scan<AVX2IsNotEOL, IsNotEOLChar>,
+    AVX2Scan<AVX2IsNotNewline, IsNotNewlineChar>,
+    AVX2Scan<AVX2IsAlnum, IsAlnumChar>, AVX2Scan<AVX2IsDigit, IsDigitChar>};
+#undef AVX2_TARGET
+#endif
+
+/// SelectScanKernels - Return the kernel set called Name, or the widest one
+/// the CPU supports for "auto". Returns nullptr if Name is unknown or not
+/// supported here.
+static const ScanKernels *SelectScanKernels(llvm::StringRef Name) {
+#if defined(__x86_64__) || defined(__i386__)
+    bool HasAVX2 = __builtin_cpu_supports("avx2");
+    bool HasSSE2 = __builtin_cpu_supports("sse2");
+    if(Name == "auto") {
+        return HasAVX2 ? &AVX2Kernels : HasSSE2 ? &SSE2Kernels : &ScalarKernels;
+    }
+    if(Name == "avx2") { return HasAVX2 ? &AVX2Kernels : nullptr; }
+    if(Name == "sse2") { return HasSSE2 ? &SSE2Kernels : nullptr; }
+#else
+    if(Name == "auto") { return &ScalarKernels; }
+#endif
+    if(Name == "scalar") { return &ScalarKernels; }
+    return nullptr;
+}
+
+/// DefaultScanKernels - The kernels new Lexers use; set once by the driver
+/// before any lexing starts.
+static const ScanKernels *DefaultScanKernels = SelectScanKernels("auto");
+
+std::pair<unsigned, unsigned> SourceBuffer::getLineAndColumn(size_t Offset) const {
+    // Extend the table with the newline kernel up to Offset. The table only
+    // ever grows, which also suits an interactive buffer that keeps growing.
+    size_t Limit = std::min(Offset, Size);
+    ScanFn FindNewline = DefaultScanKernels->FindNewline;
+    while(LinesScanned < Limit) {
+        const char *NL = FindNewline(Start + LinesScanned, Start + Limit);
+        LinesScanned = NL - Start;
+        if(NL == Start + Limit) { break; }
+        LineStarts.push_back(++LinesScanned);
+    }
+    auto Line = std::upper_bound(LineStarts.begin(), LineStarts.end(), Offset) - 1;
+    return {unsigned(Line - LineStarts.begin()) + 1, unsigned(Offset - *Line) + 1};
+}
+
+//===----------------------------------------------------------------------===//
+// Symbol Table
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// Symbol - A 4-byte handle for an interned identifier. Two Symbols from the
+/// same SymbolTable are equal iff their spellings are equal.
+class Symbol {
+    uint32_t ID = ~0u;
+
+public:
+    Symbol() = default;
+    explicit Symbol(uint32_t ID): ID(ID) {}
+
+    uint32_t getID() const { return ID; }
+    bool isValid() const { return ID != ~0u; }
+
+    bool operator==(Symbol RHS) const { return ID == RHS.ID; }
+    bool operator!=(Symbol RHS) const { return ID != RHS.ID; }
+};
+
+/// SymbolTable - Interns identifier spellings. Each distinct spelling is stored
+/// once, at a stable address, and is named by a dense Symbol ID thereafter.
+class SymbolTable {
+    llvm::StringMap<Symbol, llvm::BumpPtrAllocator> Map;
+    std::vector<llvm::StringRef> Names; // Symbol ID -> spelling
+    Symbol AnonExpr;
+
+public:
+    SymbolTable() { AnonExpr = intern("__anon_expr"); }
+
+    /// intern - Return the Symbol for Name, adding it on first sight.
+    Symbol intern(llvm::StringRef Name) {
+        auto Ins = Map.try_emplace(Name, Symbol(Names.size()));
+        if(Ins.second) { Names.push_back(Ins.first->getKey()); }
+        return Ins.first->getValue();
+    }
+
+    llvm::StringRef getName(Symbol S) const { return Names[S.getID()]; }
+    size_t size() const { return Names.size(); }
+
+    /// getAnonExpr - The name given to top-level expressions, interned up
+    /// front so that parsing never has to modify a shared table.
+    Symbol getAnonExpr() const { return AnonExpr; }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+// The lexer returns
+// [0-255]: unknown 
+// <0: token number
+enum Token {
+    tok_eof = -1,
+
+    tok_def = -2,
+    tok_extern = -3,
+
+    tok_identifier = -4,
+    tok_number = -5,
+};
+
+/// KeywordInfo - A reserved word and the token it lexes to.
+struct KeywordInfo {
+    const char *Spelling;
+    int Tok;
+};
+
+static constexpr KeywordInfo Keywords[] = {
+    {"def", tok_def},
+    {"extern", tok_extern},
+};
+
+static constexpr size_t KeywordLength(const char *S) {
+    size_t Len = 0;
+    while(S[Len]) { ++Len; }
+    return Len;
+}
+
+/// KeywordHash - Perfect hash over the spellings in Keywords, keyed on the
+/// length and the first and last characters. The constants also keep the
+/// planned if/then/else/for/in/var/binary/unary keywords collision free;
+/// KeywordTableIsPerfect() rejects any keyword set they don't.
+static constexpr unsigned KeywordHashSize = 32;
+static constexpr unsigned KeywordHash(const char *S, size_t Len) {
+    return (Len * 2 + (unsigned char)S[0] + (unsigned char)S[Len - 1]) &
+           (KeywordHashSize - 1);
+}
+
+/// KeywordTable - Hash slot -> index into Keywords, or -1 for no keyword.
+struct KeywordTable {
+    signed char Slot[KeywordHashSize];
+};
+
+static constexpr KeywordTable BuildKeywordTable() {
+    KeywordTable T = {};
+    for(unsigned I = 0; I != KeywordHashSize; ++I) { T.Slot[I] = -1; }
+    for(unsigned I = 0; I != sizeof(Keywords) / sizeof(Keywords[0]); ++I) {
+        const char *S = Keywords[I].Spelling;
+        T.Slot[KeywordHash(S, KeywordLength(S))] = I;
+    }
+    return T;
+}
+
+static constexpr bool KeywordTableIsPerfect() {
+    KeywordTable T = BuildKeywordTable();
+    unsigned Used = 0;
+    for(unsigned I = 0; I != KeywordHashSize; ++I) { Used += T.Slot[I] >= 0; }
+    return Used == sizeof(Keywords) / sizeof(Keywords[0]);
+}
+static_assert(KeywordTableIsPerfect(), "keyword hash has collisions");
+
+static constexpr KeywordTable KeywordSlots = BuildKeywordTable();
+
+/// ClassifyIdentifier - Return the keyword token spelled by [S, S+Len), or
+/// tok_identifier. One hash, one table load and at most one memcmp.
+static inline int ClassifyIdentifier(const char *S, size_t Len) {
+    int Slot = KeywordSlots.Slot[KeywordHash(S, Len)];
+    if(Slot < 0) { return tok_identifier; }
+    const char *KW = Keywords[Slot].Spelling;
+    if(strncmp(KW, S, Len) != 0 || KW[Len] != 0) { return tok_identifier; }
+    return Keywords[Slot].Tok;
+}
+
+namespace {
+/// Lexer - Turns a SourceBuffer into tokens. All lexing state lives here, so
+/// independent Lexers over different buffers may run concurrently. Identifiers
+/// are interned into the given SymbolTable as they are lexed.
+class Lexer {
+    SourceBuffer &Source;
+    SymbolTable &Symbols;
+    DiagnosticEngine &Diags;
+    const ScanKernels &Kernels = *DefaultScanKernels;
+    const char *CurPtr;    // cursor into Source
+    int CurTok = tok_eof;  // the token most recently returned
+    size_t TokOffset = 0;  // buffer offset of CurTok's first character
+    Symbol Identifier;     // filled in for tok_identifier
+    double NumVal = 0;     // filled in for tok_number
+
+    /// peekChar - Return the character Ahead places past the cursor without
+    /// consuming it; the characters before it must already have been peeked.
+    /// When that position hits the sentinel, more input is pulled from an
+    /// interactive source; EOF is returned once the source is exhausted.
+    int peekChar(size_t Ahead = 0) {
+        if(CurPtr[Ahead] == 0 && CurPtr + Ahead == Source.getBufferEnd()) {
+            size_t Offset = CurPtr - Source.getBufferStart();
+            if(!Source.refill()) { return EOF; }
+            CurPtr = Source.getBufferStart() + Offset; // refill may move the buffer
+        }
+        return (unsigned char)CurPtr[Ahead];
+    }
+
+    /// scan - Advance the cursor with Kernel, refilling an interactive source
+    /// whenever the kernel runs into the end of the buffer.
+    void scan(ScanFn Kernel) {
+        while((CurPtr = Kernel(CurPtr, Source.getBufferEnd())) ==
+                  Source.getBufferEnd() &&
+              peekChar() != EOF) {
+        }
+    }
+
+    /// gettok - Lex the next token from the source buffer.
+    int getTok();
+    int lexNumber();
+
+public:
+    Lexer(SourceBuffer &Source, SymbolTable &Symbols, DiagnosticEngine &Diags)
+        : Source(Source), Symbols(Symbols), Diags(Diags),
+          CurPtr(Source.getBufferStart()) {}
+
+    /// getNextToken - Advance to the next token and return it.
+    int getNextToken() { return CurTok = getTok(); }
+
+    int getCurToken() const { return CurTok; }
+    /// getTokenSpelling - The source text of the current token.
+    llvm::StringRef getTokenSpelling() const {
+        return llvm::StringRef(Source.getBufferStart() + TokOffset,
+                               CurPtr - Source.getBufferStart() - TokOffset);
+    }
+    size_t getTokenOffset() const { return TokOffset; }
+    Symbol getIdentifier() const { return Identifier; }
+    SymbolTable &getSymbols() const { return Symbols; }
+    SourceBuffer &getSource() const { return Source; }
+    double getNumVal() const { return NumVal; }
+};
+} // end of the namespace
+
+int Lexer::getTok() {
+    // Skip any whitespace.
+    scan(Kernels.SkipSpace);
+
+    int LastChar = peekChar();
+    // Offsets rather than pointers: an interactive refill may move the buffer.
+    size_t TokStart = TokOffset = CurPtr - Source.getBufferStart();
+
+    if(llvm::isAlpha(LastChar)) { 
+        ++CurPtr;
+        scan(Kernels.SkipAlnum);
+        const char *Spelling = Source.getBufferStart() + TokStart;
+        size_t Len = CurPtr - Spelling;
+
+        int KeywordTok = ClassifyIdentifier(Spelling, Len);
+        if(KeywordTok != tok_identifier) {
+            return KeywordTok;
+        }
+        Identifier = Symbols.intern(llvm::StringRef(Spelling, Len));
+        return tok_identifier; // variable name or so
+    }
+
+    if(llvm::isDigit(LastChar) || LastChar == '.') {
+        return lexNumber();
+    }
+
+    if(LastChar == '#') { // comment
+        scan(Kernels.FindEOL);
+        LastChar = peekChar();
+
+        if(LastChar != EOF) {
+            return getTok();
+        }
+    }
+
+    if(LastChar == EOF) {
+        return tok_eof;
+    }
+
+    ++CurPtr; // prepare for the next token
+    return LastChar;
+}
+
+/// lexNumber - Lex a numeric literal starting at the cursor
+///     number   ::= digit+ ('.' digit*)? exponent? | '.' digit+ exponent?
+///     exponent ::= ('e' | 'E') ('+' | '-')? digit+
+/// and convert it in place in the source buffer, correctly rounded and
+/// independent of the C locale. A malformed literal such as "1.2.3" or "."
+/// is reported and lexes as 0.
+int Lexer::lexNumber() {
+    bool SawDigit = llvm::isDigit(peekChar());
+    scan(Kernels.SkipDigits);
+    if(peekChar() == '.') {
+        ++CurPtr;
+        SawDigit |= llvm::isDigit(peekChar());
+        scan(Kernels.SkipDigits);
+    }
+
+    // An 'e' is only an exponent when digits follow, so "2e" still lexes as
+    // the number 2 followed by the identifier e.
+    int E = peekChar();
+    if(SawDigit && (E == 'e' || E == 'E')) {
+        int Sign = peekChar(1);
+        size_t DigitPos = (Sign == '+' || Sign == '-') ? 2 : 1;
+        if(llvm::isDigit(peekChar(DigitPos))) {
+            CurPtr += DigitPos;
+            scan(Kernels.SkipDigits);
+        }
+    }
+
+    bool Malformed = !SawDigit || peekChar() == '.';
+    if(Malformed) {
+        // Swallow the rest of the run so it doesn't cascade into more errors.
+        while(llvm::isAlnum(peekChar()) || peekChar() == '.') { ++CurPtr; }
+    }
+
+    const char *Begin = Source.getBufferStart() + TokOffset;
+    int Len = CurPtr - Begin;
+    NumVal = 0;
+    if(Malformed) {
+        Diags.error(TokOffset,
+                    "malformed number '" + std::string(Begin, Len) + "'");
+        return tok_number;
+    }
+    std::from_chars_result R = std::from_chars(Begin, CurPtr, NumVal);
+    if(R.ec == std::errc::result_out_of_range) {
+        Diags.error(TokOffset,
+                    "number '" + std::string(Begin, Len) + "' is out of range");
+        NumVal = 0;
+    }
+    return tok_number;
+}
+
+//===----------------------------------------------------------------------===//
+// Token Stream
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// TokenRecord - One lexed token in 12 bytes. The payload is resolved through
+/// the TokenStream that holds the record.
+struct TokenRecord {
+    int32_t Kind;    // a Token, or the character itself for [0-255]
+    uint32_t Value;  // Symbol ID for tok_identifier, number index for tok_number
+    uint32_t Offset; // byte offset of the token in the source buffer
+};
+static_assert(sizeof(TokenRecord) == 12, "TokenRecord should stay compact");
+
+/// TokenStream - The tokens of one source buffer as a flat array, ending with
+/// tok_eof, giving the parser arbitrary lookahead. The stream is either lexed
+/// completely up front by lexAll(), or extended on demand as the parser reads
+/// past its end, which keeps the REPL from blocking on input it doesn't need
+/// yet. A complete stream is never written to again, so any number of threads
+/// may read it concurrently.
+class TokenStream {
+    Lexer Lex;
+    std::vector<TokenRecord> Tokens;
+    std::vector<double> Numbers; // tok_number values
+    bool Complete = false;       // tok_eof has been lexed
+
+    void lexOne() {
+        int Kind = Lex.getNextToken();
+        uint32_t Value = 0;
+        if(Kind == tok_identifier) {
+            Value = Lex.getIdentifier().getID();
+        } else if(Kind == tok_number) {
+            Value = Numbers.size();
+            Numbers.push_back(Lex.getNumVal());
+        }
+        Tokens.push_back({Kind, Value, uint32_t(Lex.getTokenOffset())});
+        Complete = Kind == tok_eof;
+    }
+
+public:
+    TokenStream(SourceBuffer &Source, SymbolTable &Symbols,
+                DiagnosticEngine &Diags)
+        : Lex(Source, Symbols, Diags) {}
+
+    /// lexAll - Lex the rest of the input in one tight loop.
+    void lexAll() {
+        if(Tokens.empty()) {
+            // A rough guess at the token density avoids most regrowth.
+            Tokens.reserve(Lex.getSource().getBufferSize() / 6 + 1);
+        }
+        while(!Complete) { lexOne(); }
+    }
+
+    /// get - The token at Index; past the end, the final tok_eof.
+    const TokenRecord &get(size_t Index) {
+        while(Index >= Tokens.size() && !Complete) { lexOne(); }
+        return Tokens[std::min(Index, Tokens.size() - 1)];
+    }
+
+    bool isComplete() const { return Complete; }
+    size_t size() const { return Tokens.size(); }
+    llvm::ArrayRef<TokenRecord> getTokens() const { return Tokens; }
+    double getNumber(uint32_t Index) const { return Numbers[Index]; }
+    SymbolTable &getSymbols() const { return Lex.getSymbols(); }
+    SourceBuffer &getSource() const { return Lex.getSource(); }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// AST (Parse Tree)
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// ASTContext - Bump-pointer arena that owns every AST node of a top-level item
+/// (or a whole module). Nodes are carved out of large slabs, never destroyed
+/// individually, and released all at once by reset().
+class ASTContext {
+    llvm::BumpPtrAllocator Alloc;
+
+    // Statistics, cumulative across resets.
+    size_t NumNodes = 0;
+    size_t BytesAllocated = 0;
+    size_t RetiredSlabs = 0; // slabs freed by reset()
+
+public:
+    /// create - Allocate and construct an AST node in the arena.
+    template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "arena-allocated AST nodes are never destroyed");
+        ++NumNodes;
+        BytesAllocated += sizeof(T);
+        return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+    }
+
+    /// copyArray - Copy Elts into the arena.
+    template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> Elts) {
+        if(Elts.empty()) { return llvm::ArrayRef<T>(); }
+        BytesAllocated += Elts.size() * sizeof(T);
+        T *Mem = Alloc.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    /// reset - Release every node at once. The first slab is kept for reuse,
+    /// so a steady stream of small items does not touch malloc at all.
+    void reset() {
+        // Custom-sized slabs (single large allocations) are all freed too.
+        size_t Slabs = Alloc.GetNumSlabs();
+        Alloc.Reset();
+        RetiredSlabs += Slabs - Alloc.GetNumSlabs();
+    }
+
+    size_t getNumNodes() const { return NumNodes; }
+    size_t getBytesAllocated() const { return BytesAllocated; }
+    /// getNumMallocs - The number of slabs, standard and custom-sized, ever
+    /// requested from malloc.
+    size_t getNumMallocs() const { return RetiredSlabs + Alloc.GetNumSlabs(); }
+
+    void printStats(FILE *OS) const {
+        fprintf(OS, "AST arena: %zu nodes, %zu bytes, %zu mallocs (%.4f per node)\n",
+                NumNodes, BytesAllocated, getNumMallocs(),
+                NumNodes ? double(getNumMallocs()) / NumNodes : 0.0);
+    }
+};
+
+/// ExprAST - Base class for all expression nodes.
+/// Nodes live in an ASTContext and are never destroyed, so the hierarchy must
+/// stay trivially destructible: no virtual destructor and no owning members.
+/// The concrete class is identified by a kind tag, which llvm::isa, cast and
+/// dyn_cast understand through each subclass's classof.
+class ExprAST {
+public:
+    enum ExprKind : uint8_t { EK_Number, EK_Variable, EK_Binary, EK_Call };
+
+private:
+    const ExprKind Kind;
+
+protected:
+    ExprAST(ExprKind Kind): Kind(Kind) {}
+
+public:
+    ExprKind getKind() const { return Kind; }
+};
+
+/// NumberExprAST - Expression class for numeric literals
+class NumberExprAST: public ExprAST {
+    double Val;
+
+public:
+    NumberExprAST(double Val): ExprAST(EK_Number), Val(Val) {}
+
+    double getVal() const { return Val; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+};
+
+/// VariableExprAST - Expression class for referencing a variable
+class VariableExprAST: public ExprAST {
+    Symbol Name;
+
+public:
+    VariableExprAST(Symbol Name): ExprAST(EK_Variable), Name(Name) {}
+
+    Symbol getName() const { return Name; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+};
+
+/// BinaryExprAST - Expression class for a binary operator
+class BinaryExprAST: public ExprAST {
+    char Op;
+    ExprAST *LHS, *RHS;
+
+public:
+    BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+                  : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+};
+
+/// CallExprAST - Expression class for function calls
+class CallExprAST: public ExprAST {
+    Symbol Callee;
+    llvm::ArrayRef<ExprAST *> Args;
+
+public:
+    CallExprAST(Symbol Callee, llvm::ArrayRef<ExprAST *> Args)
+                : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+
+    Symbol getCallee() const { return Callee; }
+    llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+/// PrototypeAST - This class represents the "prototype" for a function,
+/// which captures its name, and its argument names (thus implicitly the number
+/// of arguments the function takes)
+class PrototypeAST { // the name and parameters of the function
+    Symbol Name;
+    llvm::ArrayRef<Symbol> Args;
+
+public:
+    PrototypeAST(Symbol Name, llvm::ArrayRef<Symbol> Args)
+                 : Name(Name), Args(Args) {}
+
+    Symbol getName() const { return Name; }
+    llvm::ArrayRef<Symbol> getArgs() const { return Args; }
+};
+
+/// OptPipeline - The LLVM optimization pipelines a function can be compiled
+/// with. A definition may ask for one with an annotation, 'def [O3] f(x) ...';
+/// OPT_Default leaves the choice to the driver.
+enum OptPipeline : uint8_t {
+    OPT_Default,
+    OPT_O0,   // no optimization at all
+    OPT_Fast, // mem2reg, instcombine, reassociate, GVN and simplifycfg
+    OPT_O3,   // LLVM's standard -O3 pipeline
+};
+
+/// FunctionAST - This class represents a function definition itself
+class FunctionAST {
+    PrototypeAST *Proto;
+    ExprAST *Body;
+    OptPipeline Opt;
+
+public:
+    FunctionAST(PrototypeAST *Proto, ExprAST *Body,
+                OptPipeline Opt = OPT_Default)
+                : Proto(Proto), Body(Body), Opt(Opt) {}
+
+    PrototypeAST *getProto() const { return Proto; }
+    ExprAST *getBody() const { return Body; }
+    OptPipeline getOpt() const { return Opt; }
+};
+
+} // end of the namespace
+
+// How each OptPipeline is spelled in annotations and options.
+static const char *const OptPipelineNames[] = {"default", "O0", "fast", "O3"};
+
+//===----------------------------------------------------------------------===//
+// AST Visitors
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// ExprVisitor - CRTP base class for traversals of the ExprAST classes.
+/// visit() switches on the node's kind tag and calls the matching
+/// visit*Expr of Derived directly, so no virtual call is made per node and
+/// the handlers can be inlined. Derived overrides the visit*Expr methods it
+/// cares about; the others fall back to visitExpr, which does nothing unless
+/// Derived overrides that as well.
+template <typename Derived, typename RetT = void> class ExprVisitor {
+    Derived &derived() { return *static_cast<Derived *>(this); }
+
+public:
+    RetT visit(ExprAST *E) {
+        switch(E->getKind()) {
+        case ExprAST::EK_Number:
+            return derived().visitNumberExpr(llvm::cast<NumberExprAST>(E));
+        case ExprAST::EK_Variable:
+            return derived().visitVariableExpr(llvm::cast<VariableExprAST>(E));
+        case ExprAST::EK_Binary:
+            return derived().visitBinaryExpr(llvm::cast<BinaryExprAST>(E));
+        case ExprAST::EK_Call:
+            return derived().visitCallExpr(llvm::cast<CallExprAST>(E));
+        }
+        llvm_unreachable("unknown expression kind");
+    }
+
+    RetT visitNumberExpr(NumberExprAST *E) { return derived().visitExpr(E); }
+    RetT visitVariableExpr(VariableExprAST *E) { return derived().visitExpr(E); }
+    RetT visitBinaryExpr(BinaryExprAST *E) { return derived().visitExpr(E); }
+    RetT visitCallExpr(CallExprAST *E) { return derived().visitExpr(E); }
+    RetT visitExpr(ExprAST *) { return RetT(); }
+};
+
+/// ASTPrinter - Prints expressions as S-expressions, e.g. (+ x (* y 2)).
+class ASTPrinter: public ExprVisitor<ASTPrinter> {
+    const SymbolTable &Symbols;
+    FILE *OS;
+
+    void printName(Symbol S) {
+        llvm::StringRef Name = Symbols.getName(S);
+        fprintf(OS, "%.*s", int(Name.size()), Name.data());
+    }
+
+public:
+    ASTPrinter(const SymbolTable &Symbols, FILE *OS): Symbols(Symbols), OS(OS) {}
+
+    void visitNumberExpr(NumberExprAST *E) { fprintf(OS, "%g", E->getVal()); }
+    void visitVariableExpr(VariableExprAST *E) { printName(E->getName()); }
+    void visitBinaryExpr(BinaryExprAST *E) {
+        fprintf(OS, "(%c ", E->getOp());
+        visit(E->getLHS());
+        fputc(' ', OS);
+        visit(E->getRHS());
+        fputc(')', OS);
+    }
+    void visitCallExpr(CallExprAST *E) {
+        fputc('(', OS);
+        printName(E->getCallee());
+        for(ExprAST *Arg : E->getArgs()) {
+            fputc(' ', OS);
+            visit(Arg);
+        }
+        fputc(')', OS);
+    }
+
+    void printPrototype(PrototypeAST *P) {
+        printName(P->getName());
+        fputc('(', OS);
+        for(size_t I = 0, E = P->getArgs().size(); I != E; ++I) {
+            if(I) { fputc(' ', OS); }
+            printName(P->getArgs()[I]);
+        }
+        fputc(')', OS);
+    }
+
+    void printFunction(FunctionAST *F) {
+        if(F->getOpt() != OPT_Default) {
+            fprintf(OS, "[%s] ", OptPipelineNames[F->getOpt()]);
+        }
+        printPrototype(F->getProto());
+        fputc(' ', OS);
+        visit(F->getBody());
+        fputc('\n', OS);
+    }
+};
+
+/// ASTCloner - Deep-copies ASTs into another ASTContext, for the few that
+/// must outlive the arena they were parsed into.
+class ASTCloner: public ExprVisitor<ASTCloner, ExprAST *> {
+    ASTContext &Ctx;
+
+public:
+    explicit ASTCloner(ASTContext &Ctx): Ctx(Ctx) {}
+
+    PrototypeAST *clone(PrototypeAST *Proto) {
+        return Ctx.create<PrototypeAST>(Proto->getName(),
+                                        Ctx.copyArray(Proto->getArgs()));
+    }
+    FunctionAST *clone(FunctionAST *F) {
+        return Ctx.create<FunctionAST>(clone(F->getProto()),
+                                       visit(F->getBody()), F->getOpt());
+    }
+
+    ExprAST *visitNumberExpr(NumberExprAST *E) {
+        return Ctx.create<NumberExprAST>(E->getVal());
+    }
+    ExprAST *visitVariableExpr(VariableExprAST *E) {
+        return Ctx.create<VariableExprAST>(E->getName());
+    }
+    ExprAST *visitBinaryExpr(BinaryExprAST *E) {
+        ExprAST *LHS = visit(E->getLHS());
+        return Ctx.create<BinaryExprAST>(E->getOp(), LHS, visit(E->getRHS()));
+    }
+    ExprAST *visitCallExpr(CallExprAST *E) {
+        llvm::SmallVector<ExprAST *, 8> Args;
+        for(ExprAST *Arg : E->getArgs()) { Args.push_back(visit(Arg)); }
+        return Ctx.create<CallExprAST>(E->getCallee(),
+                                       Ctx.copyArray<ExprAST *>(Args));
+    }
+};
+
+/// SourceHasher - Hashes a function definition in a normal form: the shape of
+/// the tree, its operators and constants, the optimization annotation and the
+/// names of the function and its callees. Parameters count by position, so
+/// renaming them or reformatting the source doesn't change the hash.
+class SourceHasher: public ExprVisitor<SourceHasher> {
+    const SymbolTable &Symbols;
+    llvm::ArrayRef<Symbol> Params;
+    llvm::MD5 Hash;
+
+    void addByte(uint8_t B) { Hash.update(llvm::makeArrayRef(&B, 1)); }
+    void addInt(uint64_t V) {
+        uint8_t Bytes[sizeof(V)];
+        memcpy(Bytes, &V, sizeof(V));
+        Hash.update(Bytes);
+    }
+    void addName(Symbol S) {
+        llvm::StringRef Name = Symbols.getName(S);
+        addInt(Name.size());
+        Hash.update(Name);
+    }
+
+public:
+    explicit SourceHasher(const SymbolTable &Symbols): Symbols(Symbols) {}
+
+    void visitNumberExpr(NumberExprAST *E) {
+        double Val = E->getVal();
+        uint64_t Bits;
+        memcpy(&Bits, &Val, sizeof(Bits));
+        addByte('n');
+        addInt(Bits);
+    }
+    void visitVariableExpr(VariableExprAST *E) {
+        auto Param = llvm::find(Params, E->getName());
+        if(Param != Params.end()) {
+            addByte('p');
+            addInt(Param - Params.begin());
+        } else {
+            addByte('v');
+            addName(E->getName());
+        }
+    }
+    void visitBinaryExpr(BinaryExprAST *E) {
+        addByte('b');
+        addByte(E->getOp());
+        visit(E->getLHS());
+        visit(E->getRHS());
+    }
+    void visitCallExpr(CallExprAST *E) {
+        addByte('c');
+        addName(E->getCallee());
+        addInt(E->getArgs().size());
+        for(ExprAST *Arg : E->getArgs()) { visit(Arg); }
+    }
+
+    /// hash - The hash of F as 32 hex digits. A SourceHasher hashes only once.
+    llvm::SmallString<32> hash(FunctionAST *F) {
+        addByte(F->getOpt());
+        addName(F->getProto()->getName());
+        Params = F->getProto()->getArgs();
+        addInt(Params.size());
+        visit(F->getBody());
+
+        llvm::MD5::MD5Result Result;
+        Hash.final(Result);
+        llvm::SmallString<32> Hex;
+        llvm::MD5::stringifyResult(Result, Hex);
+        return Hex;
+    }
+};
+} // end of the namespace
+
+//===----------------------------------------------------------------------===//
+// Flat AST
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// NodeId - A node of a FlatExprPool.
+using NodeId = uint32_t;
+
+/// FlatExprPool - Struct-of-arrays storage for the expressions of a module,
+/// an alternative to the ExprAST classes. A node is a 32-bit index into
+/// parallel arrays; there are no vtables or child pointers. Operands are
+/// always added before their users, so passes that need operand results
+/// first (evaluation, code generation) are one forward loop over a node range.
+class FlatExprPool {
+public:
+    enum NodeKind : uint8_t { Number, Variable, Binary, Call };
+
+private:
+    std::vector<NodeKind> Kinds;
+    // Operand fields; what they hold depends on the node kind:
+    //   Number:   A = index into Literals
+    //   Variable: A = Symbol ID
+    //   Binary:   A = LHS, B = RHS, C = operator character
+    //   Call:     A = callee Symbol ID, B = first index into CallArgs, C = #args
+    std::vector<uint32_t> A, B, C;
+    std::vector<double> Literals;
+    std::vector<NodeId> CallArgs;
+
+    NodeId addNode(NodeKind K, uint32_t OpA, uint32_t OpB = 0, uint32_t OpC = 0) {
+        Kinds.push_back(K);
+        A.push_back(OpA);
+        B.push_back(OpB);
+        C.push_back(OpC);
+        return Kinds.size() - 1;
+    }
+
+public:
+    NodeId addNumber(double Val) {
+        Literals.push_back(Val);
+        return addNode(Number, Literals.size() - 1);
+    }
+    NodeId addVariable(Symbol Name) { return addNode(Variable, Name.getID()); }
+    NodeId addBinary(char Op, NodeId LHS, NodeId RHS) {
+        return addNode(Binary, LHS, RHS, (unsigned char)Op);
+    }
+    NodeId addCall(Symbol Callee, llvm::ArrayRef<NodeId> Args) {
+        uint32_t First = CallArgs.size();
+        CallArgs.insert(CallArgs.end(), Args.begin(), Args.end());
+        return addNode(Call, Callee.getID(), First, Args.size());
+    }
+
+    /// flatten - Append a copy of the expression tree E; returns its root.
+    NodeId flatten(ExprAST *E);
+
+    size_t size() const { return Kinds.size(); }
+    NodeKind getKind(NodeId N) const { return Kinds[N]; }
+    double getNumber(NodeId N) const { return Literals[A[N]]; }
+    Symbol getSymbol(NodeId N) const { return Symbol(A[N]); } // Variable, Call
+    char getOp(NodeId N) const { return C[N]; }
+    NodeId getLHS(NodeId N) const { return A[N]; }
+    NodeId getRHS(NodeId N) const { return B[N]; }
+    llvm::ArrayRef<NodeId> getArgs(NodeId N) const {
+        return llvm::makeArrayRef(CallArgs).slice(B[N], C[N]);
+    }
+
+    /// getMemoryBytes - Bytes used by the nodes, literals and argument lists.
+    size_t getMemoryBytes() const {
+        return Kinds.size() * (sizeof(NodeKind) + 3 * sizeof(uint32_t)) +
+               Literals.size() * sizeof(double) + CallArgs.size() * sizeof(NodeId);
+    }
+};
+} // end of the namespace
+
+namespace {
+/// FlatExprBuilder - Copies an ExprAST tree into a FlatExprPool, operands
+/// first.
+class FlatExprBuilder: public ExprVisitor<FlatExprBuilder, NodeId> {
+    FlatExprPool &Pool;
+
+public:
+    explicit FlatExprBuilder(FlatExprPool &Pool): Pool(Pool) {}
+
+    NodeId visitNumberExpr(NumberExprAST *E) { return Pool.addNumber(E->getVal()); }
+    NodeId visitVariableExpr(VariableExprAST *E) {
+        return Pool.addVariable(E->getName());
+    }
+    NodeId visitBinaryExpr(BinaryExprAST *E) {
+        NodeId LHS = visit(E->getLHS());
+        NodeId RHS = visit(E->getRHS());
+        return Pool.addBinary(E->getOp(), LHS, RHS);
+    }
+    NodeId visitCallExpr(CallExprAST *E) {
+        llvm::SmallVector<NodeId, 8> Args;
+        for(ExprAST *Arg : E->getArgs()) { Args.push_back(visit(Arg)); }
+        return Pool.addCall(E->getCallee(), Args);
+    }
+};
+} // end of the namespace
+
+NodeId FlatExprPool::flatten(ExprAST *E) { return FlatExprBuilder(*this).visit(E); }
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// BinopTable - The precedence and associativity of every binary operator,
+/// indexed directly by the operator character. Looking an operator up is a
+/// single load and never modifies the table.
+class BinopTable {
+    // Low 7 bits: precedence, 0 if the character is not a binary operator.
+    // High bit: set for right-associative operators.
+    uint8_t Entries[256];
+    static constexpr uint8_t RightAssocBit = 0x80;
+
+public:
+    static constexpr unsigned MaxPrecedence = 0x7F;
+
+    constexpr BinopTable(): Entries() {}
+
+    /// getStandard - The built-in operators. 1 is the lowest precedence.
+    static constexpr BinopTable getStandard() {
+        BinopTable T;
+        T.Entries['<'] = 10;
+        T.Entries['+'] = 20;
+        T.Entries['-'] = 20;
+        T.Entries['*'] = 40; // highest.
+        return T;
+    }
+
+    /// addBinop - Register (or redefine) Op as a binary operator. Returns false
+    /// if Prec is outside [1, MaxPrecedence].
+    bool addBinop(unsigned char Op, unsigned Prec, bool RightAssoc = false) {
+        if(Prec == 0 || Prec > MaxPrecedence) { return false; }
+        Entries[Op] = Prec | (RightAssoc ? RightAssocBit : 0);
+        return true;
+    }
+
+    void removeBinop(unsigned char Op) { Entries[Op] = 0; }
+
+    /// getPrecedence - The precedence of token Tok, or -1 if it is not a
+    /// binary operator.
+    int getPrecedence(int Tok) const {
+        if(unsigned(Tok) > 255) { return -1; }
+        int Prec = Entries[Tok] & MaxPrecedence;
+        return Prec ? Prec : -1;
+    }
+
+    bool isRightAssoc(int Tok) const {
+        return unsigned(Tok) <= 255 && (Entries[Tok] & RightAssocBit);
+    }
+};
+
+static constexpr BinopTable StandardBinops = BinopTable::getStandard();
+
+/// DefaultBinops - The operators new Parsers start with: the standard ones
+/// plus any the driver registers before parsing begins.
+static BinopTable DefaultBinops = StandardBinops;
+
+/// Parser - A recursive descent parser over a TokenStream. The parser owns all
+/// of its state (stream position, current token, operator precedences) and
+/// allocates nodes in the ASTContext it is given, so independent Parsers can
+/// run concurrently without locking, even over one complete TokenStream.
+class Parser {
+    std::unique_ptr<TokenStream> OwnedToks; // set if the parser lexes itself
+    TokenStream &Toks;
+    ASTContext &Ctx;   // arena for the nodes this parser creates
+    DiagnosticEngine &Diags;
+    size_t Pos;        // index of the token after CurTok
+    int CurTok;        // current token that the parser is looking at
+    uint32_t CurValue; // payload of CurTok, see TokenRecord::Value
+
+    /// the precedence of each binary operator
+    /// - the compiler uses Binops to record the precendence of operators 
+    /// - in parsing the the binop, the precedence, instead of the pre-set grammar, 
+    /// - is used to determine the parse order
+    BinopTable Binops = DefaultBinops;
+
+    /// An entry on the operator stack of the iterative expression parser.
+    struct OpFrame {
+        enum FrameKind : uint8_t { Binop, Paren, Call } Kind;
+        char Op;         // Binop: the operator
+        uint8_t Prec;    // Binop: its precedence
+        bool RightAssoc; // Binop: whether it is right-associative
+        Symbol Callee;       // Call: the function being called
+        union {
+            ExprAST *LHS;     // Binop: its left operand
+            uint32_t ArgBase; // Call: operand stack depth before the args
+        };
+    };
+    bool Iterative = false; // parse expressions with ParseExpressionIterative
+    // Stacks for ParseExpressionIterative, kept to reuse their storage.
+    std::vector<ExprAST *> Operands; // finished call arguments
+    std::vector<OpFrame> Operators;
+
+    Parser(std::unique_ptr<TokenStream> Owned, TokenStream &Toks,
+           ASTContext &Ctx, DiagnosticEngine &Diags, size_t Begin)
+        : OwnedToks(std::move(Owned)), Toks(Toks), Ctx(Ctx), Diags(Diags),
+          Pos(Begin), CurTok(tok_eof), CurValue(0) {}
+
+    /// LogError* - Report Str at the current token; return null for the caller.
+    ExprAST *LogError(const char *Str) {
+        Diags.error(getTokenOffset(), Str);
+        return nullptr;
+    }
+    PrototypeAST *LogErrorP(const char *Str) {
+        LogError(Str);
+        return nullptr;
+    }
+
+    Symbol getIdentifier() const { return Symbol(CurValue); }
+    double getNumVal() const { return Toks.getNumber(CurValue); }
+
+    int GetTokPrecedence() const { return Binops.getPrecedence(CurTok); }
+
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseParenExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParsePrimary();
+    ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
+    ExprAST *ParseExpression();
+    ExprAST *ParseExpressionIterative();
+    ExprAST *ReduceBinops(ExprAST *Cur, size_t OperatorBase, int Prec);
+    ExprAST *ReduceCall();
+    PrototypeAST *ParsePrototype();
+
+public:
+    /// Parser - Parse Source, lexing it on demand as parsing proceeds.
+    Parser(SourceBuffer &Source, SymbolTable &Symbols, ASTContext &Ctx,
+           DiagnosticEngine &Diags)
+        : Parser(new TokenStream(Source, Symbols, Diags), Ctx, Diags) {}
+
+    /// Parser - Parse the tokens of Toks from index Begin on, reporting syntax
+    /// errors to Diags. Toks must outlive the parser.
+    Parser(TokenStream &Toks, ASTContext &Ctx, DiagnosticEngine &Diags,
+           size_t Begin = 0)
+        : Parser(nullptr, Toks, Ctx, Diags, Begin) {}
+
+    int GetNextToken() {
+        const TokenRecord &T = Toks.get(Pos++);
+        CurValue = T.Value;
+        return CurTok = T.Kind;
+    }
+    int getCurToken() const { return CurTok; }
+    /// getTokenOffset - The byte offset of the current token in the source.
+    uint32_t getTokenOffset() { return Toks.get(Pos - 1).Offset; }
+    /// getTokenIndex - The index of the current token in the stream.
+    size_t getTokenIndex() const { return Pos - 1; }
+    /// peekToken - The kind of the token N places after the current one.
+    int peekToken(size_t N = 1) { return Toks.get(Pos + N - 1).Kind; }
+    TokenStream &getTokens() const { return Toks; }
+    DiagnosticEngine &getDiagnostics() const { return Diags; }
+    /// getBinops - The operator table, for registering user-defined operators.
+    BinopTable &getBinops() { return Binops; }
+    /// setIterative - Parse expressions without recursion, so that nesting
+    /// depth is not limited by the native stack.
+    void setIterative(bool Enable) { Iterative = Enable; }
+
+    OptPipeline ParseOptAnnotation();
+    FunctionAST *ParseDefinition();
+    PrototypeAST *ParseExtern();
+    FunctionAST *ParseTopLevelExpr();
+
+private:
+    Parser(TokenStream *Owned, ASTContext &Ctx, DiagnosticEngine &Diags)
+        : Parser(std::unique_ptr<TokenStream>(Owned), *Owned, Ctx, Diags, 0) {}
+};
+} // end of the namespace
+
+/// numberexpr ::= number
+ExprAST *Parser::ParseNumberExpr() {
+    auto Result = Ctx.create<NumberExprAST>(getNumVal());
+    GetNextToken(); // advance the lexer to the next token
+    return Result;
+}
+
+/// parenexpr ::= '(' expression ')'
+ExprAST *Parser::ParseParenExpr() {
+    GetNextToken(); // eat (
+    auto V = ParseExpression();
+    if(!V) { return nullptr; }
+    if(CurTok != ')') { return LogError("expected ')'"); }
+
+    GetNextToken(); // eat )
+    return V;
+}
+
+/// identifierexpr
+///     ::= identifier
+///     ::= identifier '(' expression* ')'
+ExprAST *Parser::ParseIdentifierExpr() {
+    Symbol IdName = getIdentifier();
+    GetNextToken(); // eat identifier
+
+    // Variable
+    if(CurTok != '(') { return Ctx.create<VariableExprAST>(IdName); }
+
+    // Function Call
+    GetNextToken(); // eat ( and read the next token
+    llvm::SmallVector<ExprAST *, 8> Args;
+    if(CurTok != ')') {
+        while(true) {
+            if(auto Arg = ParseExpression()) { Args.push_back(Arg); }
+            else { return nullptr; }
+
+            if(CurTok == ')') { break; }
+
+            if(CurTok != ',') {
+                return LogError("Expected ')' or ',' in argument list");
+            }
+            GetNextToken();
+        }
+    }
+
+    GetNextToken(); // eat ')'
+    return Ctx.create<CallExprAST>(IdName, Ctx.copyArray<ExprAST *>(Args));
+}
+
+/// primary
+///     ::= identifierexpr
+///     ::= numberexpr
+///     ::= parenexpr
+ExprAST *Parser::ParsePrimary() {
+    switch(CurTok) {
+        default: return LogError("Unknown token when expecting an expression");
+        case tok_identifier: return ParseIdentifierExpr();
+        case tok_number: return ParseNumberExpr();
+        case '(': return ParseParenExpr();
+    }
+}
+
+/// binoprhs
+///     ::= ('+' primary)*
+ExprAST *Parser::ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
+    // If this is a binop, get its precedence
+    // The binop should be bound to what side is determined by the precedence
+    while(true) {
+        int TokPrec = GetTokPrecedence();
+
+        // If this is a binop that binds at least as tightly as the current binop,
+        // consume it, otherwise we are done
+        if(TokPrec < ExprPrec) { return LHS; }
+
+        // This is a binop
+        int BinOp = CurTok;
+        GetNextToken(); // eat binop
+
+        // Parse the primary expression after the binop
+        auto RHS = ParsePrimary();
+        if(!RHS) { return nullptr; }
+
+        // If BinOp binds less tightly with RHS than the operator after RHS,
+        // let the pending operator take RHS as its LHS. A right-associative
+        // BinOp also yields RHS to a following operator of equal precedence.
+        int NextPrec = GetTokPrecedence();
+        bool RightAssoc = Binops.isRightAssoc(BinOp);
+        if(TokPrec < NextPrec || (RightAssoc && TokPrec == NextPrec)) {
+            RHS = ParseBinOpRHS(RightAssoc ? TokPrec : TokPrec+1, RHS);
+            if(!RHS) { return nullptr; }
+        }
+
+        // Merge LHS?RHS
+        LHS = Ctx.create<BinaryExprAST>(BinOp, LHS, RHS);
+    }
+}
+
+/// expression
+///     ::= primary binoprhs
+ExprAST *Parser::ParseExpression() {
+    if(Iterative) { return ParseExpressionIterative(); }
+
+    auto LHS = ParsePrimary();
+    if(!LHS) { return nullptr; }
+
+    return ParseBinOpRHS(0, LHS);
+}
+
+/// ReduceBinops - Fold Cur into the pending binary operators above
+/// OperatorBase that bind at least as tightly as an incoming operator of
+/// precedence Prec. As in ParseBinOpRHS, the pending operator decides
+/// associativity: a right-associative one of equal precedence keeps waiting
+/// for its RHS. Prec 0 folds every pending operator down to the innermost
+/// paren or call.
+ExprAST *Parser::ReduceBinops(ExprAST *Cur, size_t OperatorBase, int Prec) {
+    while(Operators.size() > OperatorBase) {
+        const OpFrame &Top = Operators.back();
+        if(Top.Kind != OpFrame::Binop || Top.Prec < Prec ||
+           (Top.RightAssoc && Top.Prec == Prec)) {
+            break;
+        }
+        Cur = Ctx.create<BinaryExprAST>(Top.Op, Top.LHS, Cur);
+        Operators.pop_back();
+    }
+    return Cur;
+}
+
+/// ReduceCall - Pop the call frame on top of the operator stack and build the
+/// call from the arguments collected on the operand stack.
+ExprAST *Parser::ReduceCall() {
+    OpFrame Frame = Operators.back();
+    Operators.pop_back();
+    llvm::ArrayRef<ExprAST *> Args(Operands.data() + Frame.ArgBase,
+                                   Operands.size() - Frame.ArgBase);
+    auto *Call = Ctx.create<CallExprAST>(Frame.Callee, Ctx.copyArray(Args));
+    Operands.resize(Frame.ArgBase);
+    return Call;
+}
+
+/// expression
+///     ::= primary binoprhs
+/// parsed without recursion. The operand being built is kept in Cur; pending
+/// operators (each with its LHS), parens and calls wait on an explicit stack,
+/// and finished call arguments on the operand stack. Nesting depth and chain
+/// length are therefore bounded only by memory, an operator only waits on the
+/// stack when the one after it binds tighter, and the trees match the
+/// recursive parser's.
+ExprAST *Parser::ParseExpressionIterative() {
+    size_t OperandBase = Operands.size(), OperatorBase = Operators.size();
+    auto Fail = [&](const char *Str) {
+        Operands.resize(OperandBase);
+        Operators.resize(OperatorBase);
+        return LogError(Str);
+    };
+
+    ExprAST *Cur;
+    while(true) {
+        // Expecting an operand.
+        switch(CurTok) {
+        case tok_number:
+            Cur = Ctx.create<NumberExprAST>(getNumVal());
+            GetNextToken(); // eat number
+            break;
+        case tok_identifier: {
+            Symbol IdName = getIdentifier();
+            GetNextToken(); // eat identifier
+            if(CurTok != '(') {
+                Cur = Ctx.create<VariableExprAST>(IdName);
+                break;
+            }
+            GetNextToken(); // eat (
+            OpFrame Frame{};
+            Frame.Kind = OpFrame::Call;
+            Frame.Callee = IdName;
+            Frame.ArgBase = Operands.size();
+            Operators.push_back(Frame);
+            if(CurTok != ')') { continue; } // parse the first argument
+            GetNextToken(); // eat )
+            Cur = ReduceCall();
+            break;
+        }
+        case '(': {
+            GetNextToken(); // eat (
+            OpFrame Frame{};
+            Frame.Kind = OpFrame::Paren;
+            Operators.push_back(Frame);
+            continue;
+        }
+        default:
+            return Fail("Unknown token when expecting an expression");
+        }
+
+        // Expecting a binary operator, or the end of a paren, call argument
+        // or the whole expression.
+        int TokPrec = GetTokPrecedence();
+        while(true) {
+            if(TokPrec > 0) {
+                // Fast path for the bulk of most expressions: operators whose
+                // operand is a number or a variable, read straight from the
+                // lexed tokens with the stream position kept in locals. Each
+                // operand joins Cur at once unless the operator after it
+                // binds tighter (by ParseBinOpRHS's rules).
+                llvm::ArrayRef<TokenRecord> Lexed = Toks.getTokens();
+                size_t P = Pos; // index of the operand
+                int Tok = CurTok;
+                while(P + 1 < Lexed.size()) {
+                    const TokenRecord &Operand = Lexed[P];
+                    ExprAST *RHS;
+                    if(Operand.Kind == tok_number) {
+                        RHS = Ctx.create<NumberExprAST>(Toks.getNumber(Operand.Value));
+                    } else if(Operand.Kind == tok_identifier &&
+                              Lexed[P + 1].Kind != '(') {
+                        RHS = Ctx.create<VariableExprAST>(Symbol(Operand.Value));
+                    } else {
+                        break;
+                    }
+                    int Op = Tok;
+                    bool RightAssoc = Binops.isRightAssoc(Op);
+                    ExprAST *LHS = Operators.size() > OperatorBase
+                                       ? ReduceBinops(Cur, OperatorBase, TokPrec)
+                                       : Cur;
+                    Tok = Lexed[P + 1].Kind;
+                    P += 2;
+                    int NextPrec = Binops.getPrecedence(Tok);
+                    if(NextPrec < TokPrec || (NextPrec == TokPrec && !RightAssoc)) {
+                        Cur = Ctx.create<BinaryExprAST>(Op, LHS, RHS);
+                    } else {
+                        OpFrame Frame{};
+                        Frame.Kind = OpFrame::Binop;
+                        Frame.Op = Op;
+                        Frame.Prec = TokPrec;
+                        Frame.RightAssoc = RightAssoc;
+                        Frame.LHS = LHS;
+                        Operators.push_back(Frame);
+                        Cur = RHS;
+                    }
+                    TokPrec = NextPrec;
+                    if(TokPrec <= 0) { break; }
+                }
+                Pos = P;
+                CurTok = Tok;
+                CurValue = Lexed[P - 1].Value;
+                if(TokPrec <= 0) { continue; }
+
+                // Otherwise the operator waits on the stack for an operand
+                // parsed by the outer loop.
+                OpFrame Frame{};
+                Frame.Kind = OpFrame::Binop;
+                Frame.Op = CurTok;
+                Frame.Prec = TokPrec;
+                Frame.RightAssoc = Binops.isRightAssoc(CurTok);
+                Frame.LHS = ReduceBinops(Cur, OperatorBase, TokPrec);
+                Operators.push_back(Frame);
+                GetNextToken(); // eat binop
+                break;
+            }
+
+            Cur = ReduceBinops(Cur, OperatorBase, 0);
+            if(Operators.size() == OperatorBase) { return Cur; }
+
+            OpFrame::FrameKind Kind = Operators.back().Kind;
+            if(CurTok == ')') {
+                GetNextToken(); // eat )
+                if(Kind == OpFrame::Paren) {
+                    Operators.pop_back();
+                } else {
+                    Operands.push_back(Cur);
+                    Cur = ReduceCall();
+                }
+                TokPrec = GetTokPrecedence();
+                continue;
+            }
+            if(Kind == OpFrame::Call && CurTok == ',') {
+                GetNextToken(); // eat ,
+                Operands.push_back(Cur);
+                break;
+            }
+            return Fail(Kind == OpFrame::Paren
+                            ? "expected ')'"
+                            : "Expected ')' or ',' in argument list");
+        }
+    }
+}
+
+/// prototype
+///     ::= id '(' id* ')'
+PrototypeAST *Parser::ParsePrototype() {
+    if(CurTok != tok_identifier) { 
+        return LogErrorP("Expected function name in prototype"); 
+    }
+
+    Symbol FnName = getIdentifier();
+    GetNextToken();
+
+    if(CurTok != '(') {
+        return LogErrorP("Expected '(' in prototype"); 
+    }
+
+    // Read the list of argument names
+    llvm::SmallVector<Symbol, 8> ArgNames;
+    while(GetNextToken() == tok_identifier) {
+        ArgNames.push_back(getIdentifier());
+    }
+    if(CurTok != ')') {
+        return LogErrorP("Expected ')' in prototype");
+    }
+
+    // success
+    GetNextToken(); // eat ')'
+    return Ctx.create<PrototypeAST>(FnName, Ctx.copyArray<Symbol>(ArgNames));
+}
+
+/// optannotation ::= '[' ('O0' | 'fast' | 'O3') ']'
+///
+/// Returns OPT_Default on error.
+OptPipeline Parser::ParseOptAnnotation() {
+    GetNextToken(); // eat [
+    OptPipeline Opt = OPT_Default;
+    if(CurTok == tok_identifier) {
+        llvm::StringRef Name = Toks.getSymbols().getName(getIdentifier());
+        for(unsigned I = OPT_O0; I <= OPT_O3; ++I) {
+            if(Name == OptPipelineNames[I]) { Opt = OptPipeline(I); }
+        }
+    }
+    if(Opt == OPT_Default) {
+        LogError("Expected O0, fast or O3 in optimization annotation");
+        return OPT_Default;
+    }
+    if(GetNextToken() != ']') {
+        LogError("Expected ']' after optimization level");
+        return OPT_Default;
+    }
+    GetNextToken(); // eat ]
+    return Opt;
+}
+
+/// definition ::= 'def' optannotation? prototype expression
+FunctionAST *Parser::ParseDefinition() {
+    GetNextToken(); // eat "def"
+    OptPipeline Opt = OPT_Default;
+    if(CurTok == '[') {
+        Opt = ParseOptAnnotation();
+        if(Opt == OPT_Default) { return nullptr; }
+    }
+    auto Proto = ParsePrototype();
+    if(!Proto) { return nullptr; }
+
+    if(auto E = ParseExpression()) {
+        return Ctx.create<FunctionAST>(Proto, E, Opt);
+    }
+    return nullptr;
+}
+
+/// external ::= 'extern' prototype
+PrototypeAST *Parser::ParseExtern() {
+    GetNextToken(); // eat "extern"
+    return ParsePrototype();
+}
+
+/// toplevelexpr ::= expression
+FunctionAST *Parser::ParseTopLevelExpr() {
+    if(auto E = ParseExpression()) {
+        // Make an anonymous proto.
+        auto Proto = Ctx.create<PrototypeAST>(
+            Toks.getSymbols().getAnonExpr(), llvm::ArrayRef<Symbol>());
+        return Ctx.create<FunctionAST>(Proto, E);
+    }
+    return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+// The string attribute that carries a definition's OptPipeline annotation,
+// spelled as in the source, to the JIT.
+static const char OptPipelineAttr[] = "kaleidoscope-opt";
+// The string attribute that holds the SourceHasher hash of a definition.
+static const char SourceHashAttr[] = "kaleidoscope-source-hash";
+
+namespace {
+/// PrototypeMap - Prototypes by Symbol ID, for resolving calls to functions
+/// that live in other modules.
+using PrototypeMap = llvm::DenseMap<uint32_t, PrototypeAST *>;
+
+/// CodeGen - Emits LLVM IR for top-level items into a module of its own. Each
+/// CodeGen owns its LLVMContext, Module and IRBuilder and shares nothing
+/// mutable with other instances, so any number of compilations may run on
+/// separate threads at once; the AST and the SymbolTable are only read.
+class CodeGen: public ExprVisitor<CodeGen, llvm::Value *> {
+    const SymbolTable &Symbols;
+    DiagnosticEngine &Diags;
+    std::unique_ptr<llvm::LLVMContext> Context;
+    std::unique_ptr<llvm::Module> TheModule;
+    llvm::IRBuilder<> Builder;
+    llvm::DenseMap<uint32_t, llvm::Value *> NamedValues; // Symbol ID -> arg
+    const PrototypeMap *Prototypes = nullptr;
+    size_t Offset = 0; // start of the item being generated, for diagnostics
+
+    llvm::Value *LogErrorV(const char *Str) {
+        Diags.error(Offset, Str);
+        return nullptr;
+    }
+
+    llvm::StringRef getName(Symbol S) const { return Symbols.getName(S); }
+
+    /// getFunction - The function Name in this module, declaring it from
+    /// Prototypes if it is defined elsewhere.
+    llvm::Function *getFunction(Symbol Name);
+    /// createFunction - Add a new, bodiless function with Proto's signature.
+    llvm::Function *createFunction(PrototypeAST *Proto);
+
+public:
+    CodeGen(const SymbolTable &Symbols, DiagnosticEngine &Diags,
+            llvm::StringRef ModuleName)
+        : Symbols(Symbols), Diags(Diags),
+          Context(std::make_unique<llvm::LLVMContext>()),
+          TheModule(std::make_unique<llvm::Module>(ModuleName, *Context)),
+          Builder(*Context) {}
+
+    /// setPrototypes - Resolve calls this module can't resolve itself through
+    /// Protos, which must outlive the CodeGen.
+    void setPrototypes(const PrototypeMap *Protos) { Prototypes = Protos; }
+    /// setItemOffset - Report diagnostics at Offset until told otherwise.
+    void setItemOffset(size_t Offset) { this->Offset = Offset; }
+
+    llvm::LLVMContext &getContext() { return *Context; }
+    llvm::Module &getModule() { return *TheModule; }
+    /// takeModule - Hand over the module, with its context, to the JIT. The
+    /// CodeGen can't be used afterwards.
+    llvm::orc::ThreadSafeModule takeModule() {
+        return llvm::orc::ThreadSafeModule(std::move(TheModule),
+                                           std::move(Context));
+    }
+
+    llvm::Value *codegen(ExprAST *E) { return visit(E); }
+    /// codegen - Declare Proto, unless the module already has its function.
+    llvm::Function *codegen(PrototypeAST *Proto) {
+        if(auto *F = TheModule->getFunction(getName(Proto->getName()))) {
+            return F;
+        }
+        return createFunction(Proto);
+    }
+    llvm::Function *codegen(FunctionAST *F);
+
+    llvm::Value *visitNumberExpr(NumberExprAST *E);
+    llvm::Value *visitVariableExpr(VariableExprAST *E);
+    llvm::Value *visitBinaryExpr(BinaryExprAST *E);
+    llvm::Value *visitCallExpr(CallExprAST *E);
+};
+} // end of the namespace
+
+llvm::Function *CodeGen::getFunction(Symbol Name) {
+    if(auto *F = TheModule->getFunction(getName(Name))) { return F; }
+    if(Prototypes) {
+        auto It = Prototypes->find(Name.getID());
+        if(It != Prototypes->end()) { return codegen(It->second); }
+    }
+    return nullptr;
+}
+
+llvm::Value *CodeGen::visitNumberExpr(NumberExprAST *E) {
+    return llvm::ConstantFP::get(*Context, llvm::APFloat(E->getVal()));
+}
+
+llvm::Value *CodeGen::visitVariableExpr(VariableExprAST *E) {
+    // Look this variable up in the function.
+    llvm::Value *V = NamedValues.lookup(E->getName().getID());
+    if(!V) { return LogErrorV("Unknown variable name"); }
+    return V;
+}
+
+llvm::Value *CodeGen::visitBinaryExpr(BinaryExprAST *E) {
+    llvm::Value *L = visit(E->getLHS());
+    llvm::Value *R = visit(E->getRHS());
+    if(!L || !R) { return nullptr; }
+
+    switch(E->getOp()) {
+    case '+': return Builder.CreateFAdd(L, R, "addtmp");
+    case '-': return Builder.CreateFSub(L, R, "subtmp");
+    case '*': return Builder.CreateFMul(L, R, "multmp");
+    case '<':
+        L = Builder.CreateFCmpULT(L, R, "cmptmp");
+        // Convert bool 0/1 to double 0.0 or 1.0
+        return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(*Context),
+                                    "booltmp");
+    default: return LogErrorV("invalid binary operator");
+    }
+}
+
+llvm::Value *CodeGen::visitCallExpr(CallExprAST *E) {
+    // Look up the name in the global module table.
+    llvm::Function *CalleeF = getFunction(E->getCallee());
+    if(!CalleeF) { return LogErrorV("Unknown function referenced"); }
+
+    // If argument mismatch error.
+    llvm::ArrayRef<ExprAST *> Args = E->getArgs();
+    if(CalleeF->arg_size() != Args.size()) {
+        return LogErrorV("Incorrect # arguments passed");
+    }
+
+    llvm::SmallVector<llvm::Value *, 8> ArgsV;
+    for(ExprAST *Arg : Args) {
+        ArgsV.push_back(visit(Arg));
+        if(!ArgsV.back()) { return nullptr; }
+    }
+    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+llvm::Function *CodeGen::createFunction(PrototypeAST *Proto) {
+    // Make the function type:  double(double,double) etc.
+    llvm::ArrayRef<Symbol> Args = Proto->getArgs();
+    llvm::SmallVector<llvm::Type *, 8> Doubles(
+        Args.size(), llvm::Type::getDoubleTy(*Context));
+    llvm::FunctionType *FT = llvm::FunctionType::get(
+        llvm::Type::getDoubleTy(*Context), Doubles, false);
+
+    llvm::Function *F = llvm::Function::Create(
+        FT, llvm::Function::ExternalLinkage, getName(Proto->getName()),
+        TheModule.get());
+
+    // Set names for all arguments.
+    unsigned Idx = 0;
+    for(auto &Arg : F->args()) { Arg.setName(getName(Args[Idx++])); }
+    return F;
+}
+
+llvm::Function *CodeGen::codegen(FunctionAST *Fn) {
+    PrototypeAST *Proto = Fn->getProto();
+    // Top-level expressions all share one name; each gets a fresh function,
+    // which the module renames apart.
+    bool IsAnon = Proto->getName() == Symbols.getAnonExpr();
+
+    // Reuse the function of a previous 'extern' declaration, if any.
+    llvm::Function *TheFunction =
+        IsAnon ? createFunction(Proto) : codegen(Proto);
+    if(!TheFunction->empty()) {
+        LogErrorV("Function cannot be redefined.");
+        return nullptr;
+    }
+    if(TheFunction->arg_size() != Proto->getArgs().size()) {
+        LogErrorV("Function redefined with a different number of arguments");
+        return nullptr;
+    }
+
+    // Leave the annotation for the JIT, which picks the pipelines.
+    if(Fn->getOpt() != OPT_Default) {
+        TheFunction->addFnAttr(OptPipelineAttr, OptPipelineNames[Fn->getOpt()]);
+    }
+
+    // Create a new basic block to start insertion into.
+    llvm::BasicBlock *BB =
+        llvm::BasicBlock::Create(*Context, "entry", TheFunction);
+    Builder.SetInsertPoint(BB);
+
+    // Record the function arguments in the NamedValues map.
+    NamedValues.clear();
+    for(auto &Arg : TheFunction->args()) {
+        NamedValues[Proto->getArgs()[Arg.getArgNo()].getID()] = &Arg;
+    }
+
+    if(llvm::Value *RetVal = visit(Fn->getBody())) {
+        // Finish off the function.
+        Builder.CreateRet(RetVal);
+
+        // Validate the generated code, checking for consistency.
+        llvm::verifyFunction(*TheFunction);
+        TheFunction->addFnAttr(SourceHashAttr, SourceHasher(Symbols).hash(Fn));
+        return TheFunction;
+    }
+
+    // Error reading body, remove function.
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// JIT
+//===----------------------------------------------------------------------===//
+
+using BenchClock = std::chrono::steady_clock;
+
+static double SecondsSince(BenchClock::time_point Start) {
+    return std::chrono::duration<double>(BenchClock::now() - Start).count();
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" double printd(double X) {
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+/// LazyCompileFailed - Where a call through a lazy stub lands if the function
+/// behind it can't be compiled. The failure has been reported to the session
+/// by then, so the caller's result, NaN, is thrown away.
+static double LazyCompileFailed() {
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+/// MaxNativeArgs - The most arguments CallNative passes.
+static constexpr size_t MaxNativeArgs = 8;
+
+template <size_t... I>
+static double CallWithArgs(llvm::JITTargetAddress Addr, const double *Args,
+                           std::index_sequence<I...>) {
+    using FnTy = double (*)(decltype((void)I, 0.0)...);
+    return llvm::jitTargetAddressToPointer<FnTy>(Addr)(Args[I]...);
+}
+
+/// CallNative - Call the native function at Addr, which takes Args.size()
+/// doubles and returns a double.
+static double CallNative(llvm::JITTargetAddress Addr,
+                         llvm::ArrayRef<double> Args) {
+    switch(Args.size()) {
+    case 0: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<0>());
+    case 1: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<1>());
+    case 2: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<2>());
+    case 3: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<3>());
+    case 4: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<4>());
+    case 5: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<5>());
+    case 6: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<6>());
+    case 7: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<7>());
+    case 8: return CallWithArgs(Addr, Args.data(), std::make_index_sequence<8>());
+    }
+    llvm_unreachable("too many arguments for CallNative");
+}
+
+namespace {
+/// PassTimeReport - Wall time spent in each optimization pass and analysis,
+/// summed over the pipeline runs, on any thread, that report to it. A pass's
+/// time excludes the passes and analyses it runs itself, so pass managers
+/// and adaptors are charged only for their own overhead.
+class PassTimeReport {
+public:
+    struct Entry {
+        double Seconds = 0;
+        unsigned Runs = 0;
+    };
+
+    /// add - Record one run of Pipeline that took Seconds, Passes included.
+    void add(OptPipeline Pipeline, double Seconds,
+             const llvm::StringMap<Entry> &Passes);
+    /// print - Print the time spent per pipeline, then per pass, slowest
+    /// first.
+    void print(FILE *OS);
+
+private:
+    std::mutex Lock;
+    Entry Pipelines[OPT_O3 + 1]; // runs are modules
+    llvm::StringMap<Entry> Passes;
+};
+} // end of the namespace
+
+void PassTimeReport::add(OptPipeline Pipeline, double Seconds,
+                         const llvm::StringMap<Entry> &Times) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Pipelines[Pipeline].Seconds += Seconds;
+    ++Pipelines[Pipeline].Runs;
+    for(const auto &KV : Times) {
+        Entry &E = Passes[KV.getKey()];
+        E.Seconds += KV.getValue().Seconds;
+        E.Runs += KV.getValue().Runs;
+    }
+}
+
+void PassTimeReport::print(FILE *OS) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    double Total = 0;
+    fprintf(OS, "Optimization pipelines:\n");
+    for(unsigned I = OPT_O0; I <= OPT_O3; ++I) {
+        fprintf(OS, "  %-5s %7u modules %10.3f ms\n", OptPipelineNames[I],
+                Pipelines[I].Runs, Pipelines[I].Seconds * 1e3);
+        Total += Pipelines[I].Seconds;
+    }
+
+    std::vector<const llvm::StringMapEntry<Entry> *> Sorted;
+    for(const auto &KV : Passes) { Sorted.push_back(&KV); }
+    std::sort(Sorted.begin(), Sorted.end(), [](auto *L, auto *R) {
+        return L->getValue().Seconds > R->getValue().Seconds;
+    });
+    fprintf(OS, "Passes and analyses, slowest first:\n");
+    for(const auto *KV : Sorted) {
+        const Entry &E = KV->getValue();
+        fprintf(OS, "  %10.3f ms %5.1f%% %7u runs  %s\n", E.Seconds * 1e3,
+                Total > 0 ? 100 * E.Seconds / Total : 0.0, E.Runs,
+                KV->getKey().str().c_str());
+    }
+}
+
+/// RunPipeline - Run Pipeline over M, reporting the time spent in each pass
+/// to Times if that isn't null. Functions marked optnone are skipped.
+static void RunPipeline(llvm::Module &M, OptPipeline Pipeline,
+                        PassTimeReport *Times) {
+    assert(Pipeline != OPT_Default && "pipeline not settled");
+    auto Start = BenchClock::now();
+    llvm::StringMap<PassTimeReport::Entry> Passes;
+    if(Pipeline == OPT_O0) {
+        if(Times) { Times->add(Pipeline, SecondsSince(Start), Passes); }
+        return;
+    }
+
+    llvm::PassInstrumentationCallbacks PIC;
+    llvm::OptNoneInstrumentation OptNone(/*DebugLogging=*/false);
+    OptNone.registerCallbacks(PIC);
+
+    // The passes and analyses under way, innermost last, with the time each
+    // last resumed. One starting stops the clock of the one it runs in.
+    std::vector<std::pair<llvm::StringRef, BenchClock::time_point>> Running;
+    auto Enter = [&](llvm::StringRef Name, const llvm::Any &) {
+        auto Now = BenchClock::now();
+        if(!Running.empty()) {
+            Passes[Running.back().first].Seconds +=
+                std::chrono::duration<double>(Now - Running.back().second).count();
+        }
+        Running.emplace_back(Name, Now);
+    };
+    auto Leave = [&] {
+        auto Now = BenchClock::now();
+        PassTimeReport::Entry &E = Passes[Running.back().first];
+        E.Seconds +=
+            std::chrono::duration<double>(Now - Running.back().second).count();
+        ++E.Runs;
+        Running.pop_back();
+        if(!Running.empty()) { Running.back().second = Now; }
+    };
+    if(Times) {
+        PIC.registerBeforeNonSkippedPassCallback(Enter);
+        PIC.registerAfterPassCallback(
+            [&](llvm::StringRef, const llvm::Any &,
+                const llvm::PreservedAnalyses &) { Leave(); });
+        PIC.registerAfterPassInvalidatedCallback(
+            [&](llvm::StringRef, const llvm::PreservedAnalyses &) { Leave(); });
+        PIC.registerBeforeAnalysisCallback(Enter);
+        PIC.registerAfterAnalysisCallback(
+            [&](llvm::StringRef, const llvm::Any &) { Leave(); });
+    }
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), llvm::None,
+                         &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM;
+    if(Pipeline == OPT_O3) {
+        MPM = PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+    } else {
+        llvm::FunctionPassManager FPM;
+        // Promote allocas to registers.
+        FPM.addPass(llvm::PromotePass());
+        // Do simple "peephole" optimizations and bit-twiddling optzns.
+        FPM.addPass(llvm::InstCombinePass());
+        // Reassociate expressions.
+        FPM.addPass(llvm::ReassociatePass());
+        // Eliminate Common SubExpressions.
+        FPM.addPass(llvm::GVNPass());
+        // Simplify the control flow graph (deleting unreachable blocks, etc).
+        FPM.addPass(llvm::SimplifyCFGPass());
+        MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(FPM)));
+    }
+    MPM.run(M, MAM);
+    if(Times) { Times->add(Pipeline, SecondsSince(Start), Passes); }
+}
+
+/// SettlePipelines - Decide the pipeline of each function M defines: its own
+/// annotation if it has one, else Expressions for top-level expressions and
+/// Definitions for the rest, and record it in the function's OptPipelineAttr.
+/// Functions left at O0 are marked optnone, so that neither the pipeline nor
+/// the code generator spends time on them, and the pipeline returned for the
+/// module is the most aggressive one asked for.
+static OptPipeline SettlePipelines(llvm::Module &M, OptPipeline Definitions,
+                                   OptPipeline Expressions) {
+    OptPipeline Result = OPT_O0;
+    for(llvm::Function &F : M) {
+        if(F.isDeclaration()) { continue; }
+        OptPipeline Own =
+            F.getName().startswith("__anon_expr") ? Expressions : Definitions;
+        if(F.hasFnAttribute(OptPipelineAttr)) {
+            llvm::StringRef Name =
+                F.getFnAttribute(OptPipelineAttr).getValueAsString();
+            for(unsigned I = OPT_O0; I <= OPT_O3; ++I) {
+                if(Name == OptPipelineNames[I]) { Own = OptPipeline(I); }
+            }
+        }
+        F.addFnAttr(OptPipelineAttr, OptPipelineNames[Own]);
+        if(Own == OPT_O0) {
+            F.addFnAttr(llvm::Attribute::OptimizeNone);
+            F.addFnAttr(llvm::Attribute::NoInline);
+        }
+        Result = std::max(Result, Own);
+    }
+    return Result;
+}
+
+/// DetectHost - A JITTargetMachineBuilder for the host, generating code at
+/// OptLevel. Returns None (after reporting) if the host can't be targeted.
+static llvm::Optional<llvm::orc::JITTargetMachineBuilder>
+DetectHost(llvm::CodeGenOpt::Level OptLevel) {
+    auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if(!JTMB) {
+        llvm::logAllUnhandledErrors(JTMB.takeError(), llvm::errs(), "Error: ");
+        return llvm::None;
+    }
+    JTMB->setCodeGenOptLevel(OptLevel);
+    return std::move(*JTMB);
+}
+
+namespace {
+/// ObjectFileCache - An llvm::ObjectCache that keeps compiled objects in a
+/// directory, so that later sessions load them rather than compile the same
+/// code again. An object is keyed by the MD5 of the LLVM version, the
+/// CodeGenVersion and the host it was compiled for, the code generator's
+/// level noted by SetCodeGenOptLevel() and, for each function its module
+/// defines, the name, the SourceHashAttr and the pipeline settled on; a
+/// module without a level, or with a function that has no source hash, isn't
+/// cached. Files are named the way llvm::pruneCache() expects, which evicts
+/// them by age and total size. May be used from any number of threads, and
+/// by several sessions sharing the directory.
+class ObjectFileCache: public llvm::ObjectCache {
+    std::string Dir;
+    std::string Host; // what besides the IR and the level decides the object
+    std::atomic<unsigned> Hits{0}, Misses{0}, Stores{0};
+    std::atomic<uint64_t> StoredBytes{0};
+    unsigned Evicted = 0;
+
+    ObjectFileCache(std::string Dir, std::string Host)
+        : Dir(std::move(Dir)), Host(std::move(Host)) {}
+
+    /// getPath - The file the object of M is kept in, or "" if M can't be
+    /// cached.
+    std::string getPath(const llvm::Module &M) const;
+    /// countFiles - The number and total size of the objects on disk.
+    std::pair<unsigned, uint64_t> countFiles() const;
+
+public:
+    /// create - A cache in Dir, which is created if need be, for objects
+    /// compiled for the host. Returns nullptr (after reporting) on failure.
+    static std::unique_ptr<ObjectFileCache> create(llvm::StringRef Dir);
+
+    /// contains - Whether the object of M is on disk, which makes optimizing M
+    /// wasted work. If so, M is marked, so that an object compiled from it
+    /// unoptimized, should the file be evicted before it's loaded, isn't kept.
+    bool contains(llvm::Module &M);
+
+    void notifyObjectCompiled(const llvm::Module *M,
+                              llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+    /// prune - Evict the objects unused for MaxAge (if not 0), then the least
+    /// recently used ones until they take up at most MaxBytes (if not 0).
+    void prune(std::chrono::seconds MaxAge, uint64_t MaxBytes);
+    void printStats(FILE *OS) const;
+};
+} // end of the namespace
+
+// Marks a module whose object is expected from the cache.
+static const char FromCacheMD[] = "kaleidoscope.from-cache";
+// Holds the level the code generator compiles a module at.
+static const char CodeGenOptMD[] = "kaleidoscope.codegen-opt";
+// Part of every key; bump it when a change to how the JIT generates code
+// makes the objects compiled before it unfit to load.
+static const char CodeGenVersion[] = "kaleidoscope-codegen-1";
+
+/// SetCodeGenOptLevel - Note on M the level it is about to be compiled at,
+/// which ObjectFileCache keys its object by.
+static void SetCodeGenOptLevel(llvm::Module &M, llvm::CodeGenOpt::Level Level) {
+    llvm::LLVMContext &Ctx = M.getContext();
+    llvm::NamedMDNode *Node = M.getOrInsertNamedMetadata(CodeGenOptMD);
+    Node->clearOperands();
+    Node->addOperand(llvm::MDNode::get(
+        Ctx, llvm::MDString::get(Ctx, std::to_string(unsigned(Level)))));
+}
+
+std::unique_ptr<ObjectFileCache> ObjectFileCache::create(llvm::StringRef Dir) {
+    if(std::error_code EC = llvm::sys::fs::create_directories(Dir)) {
+        fprintf(stderr, "Error: can't create object cache '%s': %s\n",
+                Dir.str().c_str(), EC.message().c_str());
+        return nullptr;
+    }
+    auto JTMB = DetectHost(llvm::CodeGenOpt::Default);
+    if(!JTMB) { return nullptr; }
+    std::string Host = std::string(LLVM_VERSION_STRING) + ' ' + CodeGenVersion +
+                       ' ' + JTMB->getTargetTriple().str() + ' ' +
+                       JTMB->getCPU() + ' ' + JTMB->getFeatures().getString();
+    return std::unique_ptr<ObjectFileCache>(
+        new ObjectFileCache(Dir.str(), std::move(Host)));
+}
+
+std::string ObjectFileCache::getPath(const llvm::Module &M) const {
+    llvm::MD5 Hash;
+    auto Add = [&](llvm::StringRef Field) {
+        Hash.update(Field);
+        Hash.update(llvm::StringRef("", 1)); // keep the fields apart
+    };
+    const llvm::NamedMDNode *Level = M.getNamedMetadata(CodeGenOptMD);
+    if(!Level || Level->getNumOperands() != 1) { return ""; }
+    Add(Host);
+    Add(llvm::cast<llvm::MDString>(Level->getOperand(0)->getOperand(0))
+            ->getString());
+    for(const llvm::Function &F : M) {
+        if(F.isDeclaration()) { continue; }
+        if(!F.hasFnAttribute(SourceHashAttr)) { return ""; }
+        Add(F.getName());
+        Add(F.getFnAttribute(SourceHashAttr).getValueAsString());
+        Add(F.getFnAttribute(OptPipelineAttr).getValueAsString());
+    }
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Hex;
+    llvm::MD5::stringifyResult(Result, Hex);
+
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, "llvmcache-" + Hex);
+    return std::string(Path);
+}
+
+bool ObjectFileCache::contains(llvm::Module &M) {
+    std::string Path = getPath(M);
+    if(Path.empty() || !llvm::sys::fs::exists(Path)) { return false; }
+    M.getOrInsertNamedMetadata(FromCacheMD);
+    return true;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+ObjectFileCache::getObject(const llvm::Module *M) {
+    std::string Path = getPath(*M);
+    if(Path.empty()) { return nullptr; }
+    auto Buffer = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false);
+    if(!Buffer) {
+        ++Misses;
+        return nullptr;
+    }
+    ++Hits;
+    // Pruning evicts the least recently used objects first.
+    utimensat(AT_FDCWD, Path.c_str(), nullptr, 0);
+    return std::move(*Buffer);
+}
+
+void ObjectFileCache::notifyObjectCompiled(const llvm::Module *M,
+                                           llvm::MemoryBufferRef Obj) {
+    if(M->getNamedMetadata(FromCacheMD)) { return; }
+    std::string Path = getPath(*M);
+    if(Path.empty()) { return; }
+
+    // Write to a file of our own and rename it into place, so that no one
+    // loads a partial object. Failing that, the object just isn't kept.
+    int FD;
+    llvm::SmallString<128> TempPath;
+    if(llvm::sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TempPath)) {
+        return;
+    }
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Obj.getBuffer();
+    OS.close();
+    if(OS.has_error()) {
+        OS.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return;
+    }
+    if(llvm::sys::fs::rename(TempPath, Path)) {
+        llvm::sys::fs::remove(TempPath);
+        return;
+    }
+    ++Stores;
+    StoredBytes += Obj.getBufferSize();
+}
+
+std::pair<unsigned, uint64_t> ObjectFileCache::countFiles() const {
+    unsigned Files = 0;
+    uint64_t Bytes = 0;
+    std::error_code EC;
+    for(llvm::sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+        It.increment(EC)) {
+        if(!llvm::sys::path::filename(It->path()).startswith("llvmcache-")) {
+            continue;
+        }
+        ++Files;
+        if(auto Status = It->status()) { Bytes += Status->getSize(); }
+    }
+    return {Files, Bytes};
+}
+
+void ObjectFileCache::prune(std::chrono::seconds MaxAge, uint64_t MaxBytes) {
+    llvm::CachePruningPolicy Policy;
+    Policy.Interval = std::chrono::seconds(0); // now, however recent the last
+    Policy.Expiration = MaxAge;
+    Policy.MaxSizeBytes = MaxBytes;
+    unsigned Before = countFiles().first;
+    llvm::pruneCache(Dir, Policy);
+    unsigned After = countFiles().first;
+    Evicted += Before > After ? Before - After : 0;
+}
+
+void ObjectFileCache::printStats(FILE *OS) const {
+    unsigned Lookups = Hits + Misses;
+    auto OnDisk = countFiles();
+    fprintf(OS,
+            "Object cache: %u hits, %u misses (%.1f%% hits), %u objects "
+            "stored (%.1f KiB), %u evicted; %u objects (%.1f KiB) in %s\n",
+            unsigned(Hits), unsigned(Misses),
+            Lookups ? 100.0 * Hits / Lookups : 0.0, unsigned(Stores),
+            StoredBytes / 1024.0, Evicted, OnDisk.first,
+            OnDisk.second / 1024.0, Dir.c_str());
+}
+
+namespace {
+/// JITOptions - How a KaleidoscopeJIT optimizes and compiles.
+struct JITOptions {
+    // The pipelines for functions without an annotation of their own.
+    OptPipeline Definitions = OPT_Fast;
+    OptPipeline Expressions = OPT_O0;
+    // If not 0, reoptimize on this many background threads.
+    unsigned ReoptimizeThreads = 0;
+    // If set, the time spent in each pass is reported to it.
+    PassTimeReport *PassTimes = nullptr;
+    // If set, objects are looked up in and added to it.
+    ObjectFileCache *Cache = nullptr;
+    // Whether the main layers may compile on several threads at once, as a
+    // tiered JITSession's compiler thread does alongside the REPL thread.
+    bool ConcurrentCompiles = false;
+};
+
+/// KaleidoscopeJIT - A thin layer over ORC's LLJIT. Modules added without a
+/// ResourceTracker stay for the rest of the session; evaluate() gives its
+/// module a tracker of its own and frees the module's code and data as soon
+/// as it has run, so one-shot expressions don't accumulate. Calls to
+/// functions the session doesn't define resolve to the library functions
+/// above, then to symbols of the host process.
+///
+/// Every module is optimized on its way to the compiler, and only once one of
+/// its symbols is looked up. Each function it defines settles on a pipeline,
+/// its annotation or else the one JITOptions gives for its kind, and the
+/// module runs the most aggressive of these, with the O0 functions exempt.
+/// addLazy() goes further for single functions: the main dylib only gets a
+/// call-through stub, and the materialization unit behind it, kept in a dylib
+/// of its own, isn't asked for the body until the stub is first called.
+///
+/// A JIT created to reoptimize compiles in two tiers instead. Modules go
+/// through the main layers unoptimized, with the code generator at -O0, so
+/// that nothing stalls the caller. Each function defined by addModule() is
+/// called through a stub, and its first call queues an -O3 copy of its
+/// module on a background pool, which points the stub at the optimized code
+/// once it is ready; functions annotated with a pipeline get that one there
+/// instead. Code that has been replaced is kept, since a call may still be
+/// running in it.
+class KaleidoscopeJIT {
+    /// ReoptimizableModule - The -O3 copy of a module added for
+    /// reoptimization, and the functions it defines.
+    struct ReoptimizableModule {
+        llvm::orc::ThreadSafeModule Optimized;
+        std::vector<std::string> Names;
+        bool Queued = false; // guarded by StubLock
+    };
+
+    std::unique_ptr<llvm::orc::LLJIT> J;
+    JITOptions Opts;
+    // Set up on first use by addLazy() or a reoptimizing addModule().
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> LCTM;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> ISM;
+    llvm::orc::JITDylib *ImplJD = nullptr; // bodies behind the lazy stubs
+    llvm::orc::JITDylib *DetachedJD = nullptr; // see compileDetached()
+    llvm::CodeGenOpt::Level CodeGenLevel = llvm::CodeGenOpt::Default; // main layers
+    std::atomic<unsigned> NumCompiled{0}; // non-anonymous functions
+
+    // Reoptimization.
+    std::unique_ptr<llvm::orc::IRCompileLayer> OptCompileLayer; // at -O3
+    std::mutex StubLock;
+    llvm::StringSet<> Reoptimized; // stubs pointing at -O3 code
+    double ReoptimizeSeconds = 0;  // guarded by StubLock
+    // Errors ORC reports on its own, once collectErrors() has been called.
+    std::mutex ErrorLock;
+    std::vector<std::string> Errors; // guarded by ErrorLock
+    // Last, so that queued work finishes before anything it uses goes away.
+    std::unique_ptr<llvm::ThreadPool> Optimizer;
+
+    KaleidoscopeJIT(std::unique_ptr<llvm::orc::LLJIT> J, const JITOptions &Opts);
+
+    llvm::Error initStubs();
+    llvm::Error addReoptimizable(llvm::orc::ThreadSafeModule TSM);
+    void reoptimize(std::shared_ptr<ReoptimizableModule> RM);
+
+public:
+    /// create - Set up a JIT for the host, configured by Opts. Returns nullptr
+    /// (after reporting) if the host can't be targeted.
+    static std::unique_ptr<KaleidoscopeJIT>
+    create(const JITOptions &Opts = JITOptions());
+
+    bool isReoptimizing() const { return Optimizer != nullptr; }
+    /// waitForReoptimization - Block until the queued reoptimizations are done.
+    void waitForReoptimization() {
+        if(Optimizer) { Optimizer->wait(); }
+    }
+    /// getNumReoptimized - How many functions run optimized code by now, and
+    /// the time spent on them.
+    unsigned getNumReoptimized(double &Seconds) {
+        std::lock_guard<std::mutex> Lock(StubLock);
+        Seconds = ReoptimizeSeconds;
+        return Reoptimized.size();
+    }
+
+    /// collectErrors - Queue the errors the session reports outside of any
+    /// call into the JIT, such as a failed lazy compile behind a stub, for
+    /// takeErrors(), instead of printing them to stderr. They may come from
+    /// any thread.
+    void collectErrors() {
+        J->getExecutionSession().setErrorReporter([this](llvm::Error Err) {
+            std::lock_guard<std::mutex> Lock(ErrorLock);
+            Errors.push_back(llvm::toString(std::move(Err)));
+        });
+    }
+    /// takeErrors - The errors queued since the last call.
+    std::vector<std::string> takeErrors() {
+        std::lock_guard<std::mutex> Lock(ErrorLock);
+        return std::exchange(Errors, {});
+    }
+
+    const llvm::DataLayout &getDataLayout() const { return J->getDataLayout(); }
+    llvm::orc::SymbolStringPtr mangle(llvm::StringRef Name) {
+        return llvm::orc::MangleAndInterner(J->getExecutionSession(),
+                                            getDataLayout())(Name);
+    }
+    /// getNumCompiled - How many function definitions, top-level expressions
+    /// aside, have been handed to the compiler.
+    unsigned getNumCompiled() const { return NumCompiled; }
+
+    /// addModule - Add TSM to the session for good.
+    llvm::Error addModule(llvm::orc::ThreadSafeModule TSM) {
+        if(Optimizer) { return addReoptimizable(std::move(TSM)); }
+        return J->addIRModule(std::move(TSM));
+    }
+
+    /// addLazy - Add the callable symbols of MU to the session for good,
+    /// behind stubs that materialize MU on the first call to any of them.
+    llvm::Error addLazy(std::unique_ptr<llvm::orc::MaterializationUnit> MU);
+
+    /// compileDetached - Compile TSM, which defines the function Name, and
+    /// return Name's address. The code is kept in a dylib of its own, apart
+    /// from the body behind Name's lazy stub, and its calls go through the
+    /// stubs, so nothing behind a stub is materialized for it. May be called
+    /// from any thread once addLazy() has been.
+    llvm::Expected<llvm::JITEvaluatedSymbol>
+    compileDetached(llvm::orc::ThreadSafeModule TSM, llvm::StringRef Name) {
+        if(llvm::Error Err = J->addIRModule(*DetachedJD, std::move(TSM))) {
+            return Err;
+        }
+        return J->getExecutionSession().lookup({DetachedJD}, mangle(Name));
+    }
+
+    /// emit - Optimize and compile TSM on behalf of a materialization unit,
+    /// which hands its responsibility R over.
+    void emit(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+              llvm::orc::ThreadSafeModule TSM) {
+        J->getIRTransformLayer().emit(std::move(R), std::move(TSM));
+    }
+
+    llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef Name) {
+        return J->lookup(Name);
+    }
+
+    /// evaluate - Compile TSM under a ResourceTracker of its own, call its
+    /// function Name, which takes no arguments, and free the module again.
+    llvm::Expected<double> evaluate(llvm::orc::ThreadSafeModule TSM,
+                                    llvm::StringRef Name);
+};
+} // end of the namespace
+
+KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<llvm::orc::LLJIT> J,
+                                 const JITOptions &Options)
+    : J(std::move(J)), Opts(Options) {
+    this->J->getIRTransformLayer().setTransform(
+        [this](llvm::orc::ThreadSafeModule TSM,
+               const llvm::orc::MaterializationResponsibility &) {
+            TSM.withModuleDo([this](llvm::Module &M) {
+                for(llvm::Function &F : M) {
+                    if(!F.isDeclaration() &&
+                       !F.getName().startswith("__anon_expr")) {
+                        ++NumCompiled;
+                    }
+                }
+                OptPipeline Pipeline =
+                    SettlePipelines(M, Opts.Definitions, Opts.Expressions);
+                SetCodeGenOptLevel(M, CodeGenLevel);
+                bool Cached = Opts.Cache && Opts.Cache->contains(M);
+                // When reoptimizing, this is the quick first compile.
+                if(!Optimizer && !Cached) {
+                    RunPipeline(M, Pipeline, Opts.PassTimes);
+                }
+            });
+            return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(TSM));
+        });
+}
+
+std::unique_ptr<KaleidoscopeJIT> KaleidoscopeJIT::create(const JITOptions &Opts) {
+    llvm::orc::LLJITBuilder Builder;
+    // The main layers generate code at the default level, or at -O0 when
+    // reoptimizing.
+    llvm::CodeGenOpt::Level CodeGenLevel = Opts.ReoptimizeThreads
+                                               ? llvm::CodeGenOpt::None
+                                               : llvm::CodeGenOpt::Default;
+    auto JTMB = DetectHost(CodeGenLevel);
+    if(!JTMB) { return nullptr; }
+    Builder.setJITTargetMachineBuilder(std::move(*JTMB));
+    if(Opts.Cache || Opts.ConcurrentCompiles) {
+        // LLJIT's own choices for one or several compile threads, plus the
+        // cache.
+        ObjectFileCache *Cache = Opts.Cache;
+        bool Concurrent = Opts.ConcurrentCompiles;
+        Builder.setCompileFunctionCreator(
+            [Cache, Concurrent](llvm::orc::JITTargetMachineBuilder JTMB)
+                -> llvm::Expected<
+                    std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                if(Concurrent) {
+                    return std::make_unique<llvm::orc::ConcurrentIRCompiler>(
+                        std::move(JTMB), Cache);
+                }
+                auto TM = JTMB.createTargetMachine();
+                if(!TM) { return TM.takeError(); }
+                return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+                    std::move(*TM), Cache);
+            });
+    }
+    auto J = Builder.create();
+    if(!J) {
+        llvm::logAllUnhandledErrors(J.takeError(), llvm::errs(), "Error: ");
+        return nullptr;
+    }
+
+    llvm::orc::JITDylib &JD = (*J)->getMainJITDylib();
+    const llvm::DataLayout &DL = (*J)->getDataLayout();
+    llvm::orc::MangleAndInterner Mangle((*J)->getExecutionSession(), DL);
+    llvm::orc::SymbolMap Library;
+    Library[Mangle("putchard")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&putchard), llvm::JITSymbolFlags::Exported);
+    Library[Mangle("printd")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&printd), llvm::JITSymbolFlags::Exported);
+    llvm::Error Err = JD.define(llvm::orc::absoluteSymbols(std::move(Library)));
+
+    auto Process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        DL.getGlobalPrefix());
+    if(Process) {
+        JD.addGenerator(std::move(*Process));
+    } else {
+        Err = llvm::joinErrors(std::move(Err), Process.takeError());
+    }
+    if(Err) {
+        llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Error: ");
+        return nullptr;
+    }
+    std::unique_ptr<KaleidoscopeJIT> JIT(new KaleidoscopeJIT(std::move(*J), Opts));
+    JIT->CodeGenLevel = CodeGenLevel;
+
+    if(Opts.ReoptimizeThreads) {
+        auto JTMB = DetectHost(llvm::CodeGenOpt::Aggressive);
+        if(!JTMB) { return nullptr; }
+        // A TargetMachine per compilation, so any number may run at once.
+        JIT->OptCompileLayer = std::make_unique<llvm::orc::IRCompileLayer>(
+            JIT->J->getExecutionSession(), JIT->J->getObjLinkingLayer(),
+            std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(*JTMB),
+                                                              Opts.Cache));
+        JIT->Optimizer = std::make_unique<llvm::ThreadPool>(
+            llvm::hardware_concurrency(Opts.ReoptimizeThreads));
+    }
+    return JIT;
+}
+
+llvm::Error KaleidoscopeJIT::initStubs() {
+    const llvm::Triple &TT = J->getTargetTriple();
+    auto CallThrough = llvm::orc::createLocalLazyCallThroughManager(
+        TT, J->getExecutionSession(),
+        llvm::pointerToJITTargetAddress(&LazyCompileFailed));
+    if(!CallThrough) { return CallThrough.takeError(); }
+    LCTM = std::move(*CallThrough);
+    ISM = llvm::orc::createLocalIndirectStubsManagerBuilder(TT)();
+    return llvm::Error::success();
+}
+
+llvm::Error
+KaleidoscopeJIT::addLazy(std::unique_ptr<llvm::orc::MaterializationUnit> MU) {
+    if(!LCTM) {
+        if(llvm::Error Err = initStubs()) { return Err; }
+    }
+    if(!ImplJD) {
+        auto Impl = J->createJITDylib("<lazy bodies>");
+        if(!Impl) { return Impl.takeError(); }
+        auto Detached = J->createJITDylib("<detached bodies>");
+        if(!Detached) { return Detached.takeError(); }
+        ImplJD = &*Impl;
+        DetachedJD = &*Detached;
+        // Both resolve every symbol through the main dylib only, so calls
+        // between bodies go through the stubs too. Binding a body directly to
+        // another body's MU here would pull that body in (and fail along with
+        // it) when the caller is compiled.
+        for(llvm::orc::JITDylib *JD : {ImplJD, DetachedJD}) {
+            JD->setLinkOrder(
+                {{&J->getMainJITDylib(),
+                  llvm::orc::JITDylibLookupFlags::MatchAllSymbols}},
+                /*LinkAgainstThisJITDylibFirst=*/false);
+        }
+    }
+    llvm::orc::SymbolAliasMap Stubs;
+    for(auto &KV : MU->getSymbols()) {
+        Stubs[KV.first] = llvm::orc::SymbolAliasMapEntry(KV.first, KV.second);
+    }
+    if(llvm::Error Err = ImplJD->define(std::move(MU))) { return Err; }
+    return J->getMainJITDylib().define(
+        llvm::orc::lazyReexports(*LCTM, *ISM, *ImplJD, std::move(Stubs)));
+}
+
+// The names the two compilations of a reoptimized function f go by; f itself
+// names its stub.
+static const char FastSuffix[] = ".fast";
+static const char OptSuffix[] = ".opt";
+
+llvm::Error KaleidoscopeJIT::addReoptimizable(llvm::orc::ThreadSafeModule TSM) {
+    if(!LCTM) {
+        if(llvm::Error Err = initStubs()) { return Err; }
+    }
+
+    // A function defined before already has its stub; say so by the name
+    // the user gave it rather than by an internal one below.
+    llvm::Error Dup = TSM.withModuleDo([&](llvm::Module &M) -> llvm::Error {
+        for(llvm::Function &F : M) {
+            if(!F.isDeclaration() && ISM->findStub(F.getName(), false)) {
+                return llvm::make_error<llvm::orc::DuplicateDefinition>(
+                    F.getName().str());
+            }
+        }
+        return llvm::Error::success();
+    });
+    if(Dup) { return Dup; }
+
+    // Keep an untouched copy, in the same context, for the -O3 compile, and
+    // rename the definitions in both apart from their stubs.
+    auto RM = std::make_shared<ReoptimizableModule>();
+    RM->Optimized = TSM.withModuleDo([&](llvm::Module &M) {
+        std::unique_ptr<llvm::Module> Copy = llvm::CloneModule(M);
+        for(llvm::Function &F : M) {
+            if(F.isDeclaration()) { continue; }
+            std::string Name = F.getName().str();
+            F.setName(Name + FastSuffix);
+            Copy->getFunction(Name)->setName(Name + OptSuffix);
+            RM->Names.push_back(std::move(Name));
+        }
+        return llvm::orc::ThreadSafeModule(std::move(Copy), TSM.getContext());
+    });
+    llvm::orc::JITDylib &JD = J->getMainJITDylib();
+    if(llvm::Error Err = J->addIRModule(std::move(TSM))) { return Err; }
+
+    // Each stub starts out at a trampoline that compiles the quick version
+    // on the first call, points the stub at it and queues the module for -O3.
+    llvm::orc::SymbolMap Stubs;
+    for(const std::string &Name : RM->Names) {
+        auto Trampoline = LCTM->getCallThroughTrampoline(
+            JD, mangle(Name + FastSuffix),
+            [this, RM, Name](llvm::JITTargetAddress Fast) -> llvm::Error {
+                std::lock_guard<std::mutex> Lock(StubLock);
+                if(!Reoptimized.count(Name)) {
+                    if(llvm::Error Err = ISM->updatePointer(Name, Fast)) {
+                        return Err;
+                    }
+                }
+                if(!RM->Queued) {
+                    RM->Queued = true;
+                    Optimizer->async([this, RM] { reoptimize(RM); });
+                }
+                return llvm::Error::success();
+            });
+        if(!Trampoline) { return Trampoline.takeError(); }
+        auto Flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+        if(llvm::Error Err = ISM->createStub(Name, *Trampoline, Flags)) {
+            return Err;
+        }
+        Stubs[mangle(Name)] = ISM->findStub(Name, /*ExportedStubsOnly=*/true);
+    }
+    return JD.define(llvm::orc::absoluteSymbols(std::move(Stubs)));
+}
+
+void KaleidoscopeJIT::reoptimize(std::shared_ptr<ReoptimizableModule> RM) {
+    auto Start = BenchClock::now();
+    llvm::orc::ExecutionSession &ES = J->getExecutionSession();
+    llvm::orc::JITDylib &JD = J->getMainJITDylib();
+    // Annotated functions keep their own pipeline.
+    RM->Optimized.withModuleDo([this](llvm::Module &M) {
+        OptPipeline Pipeline = SettlePipelines(M, OPT_O3, Opts.Expressions);
+        SetCodeGenOptLevel(M, llvm::CodeGenOpt::Aggressive); // OptCompileLayer's
+        if(!Opts.Cache || !Opts.Cache->contains(M)) {
+            RunPipeline(M, Pipeline, Opts.PassTimes);
+        }
+    });
+    if(llvm::Error Err = OptCompileLayer->add(JD, std::move(RM->Optimized))) {
+        ES.reportError(std::move(Err));
+        return;
+    }
+
+    std::vector<llvm::JITTargetAddress> Addrs;
+    for(const std::string &Name : RM->Names) {
+        auto Sym = ES.lookup({&JD}, mangle(Name + OptSuffix));
+        if(!Sym) {
+            // The quick versions stay in use.
+            ES.reportError(Sym.takeError());
+            return;
+        }
+        Addrs.push_back(Sym->getAddress());
+    }
+    std::lock_guard<std::mutex> Lock(StubLock);
+    for(size_t I = 0; I != Addrs.size(); ++I) {
+        if(llvm::Error Err = ISM->updatePointer(RM->Names[I], Addrs[I])) {
+            ES.reportError(std::move(Err));
+            continue;
+        }
+        Reoptimized.insert(RM->Names[I]);
+    }
+    ReoptimizeSeconds += SecondsSince(Start);
+}
+
+llvm::Expected<double> KaleidoscopeJIT::evaluate(llvm::orc::ThreadSafeModule TSM,
+                                                 llvm::StringRef Name) {
+    llvm::orc::ResourceTrackerSP RT =
+        J->getMainJITDylib().createResourceTracker();
+    if(llvm::Error Err = J->addIRModule(RT, std::move(TSM))) {
+        return Err;
+    }
+
+    // Get the symbol's address and cast it to the right type (takes no
+    // arguments, returns a double) so we can call it as a native function.
+    auto Sym = J->lookup(Name);
+    if(!Sym) { return llvm::joinErrors(Sym.takeError(), RT->remove()); }
+    auto *FP = llvm::jitTargetAddressToPointer<double (*)()>(Sym->getAddress());
+    double Result = FP();
+
+    // Delete the anonymous expression module from the JIT.
+    if(llvm::Error Err = RT->remove()) { return Err; }
+    return Result;
+}
+
+//===----------------------------------------------------------------------===//
+// Bytecode VM
+//===----------------------------------------------------------------------===//
+
+namespace {
+/// Opcode - The bytecode instructions. Registers hold doubles and are
+/// numbered from the base of the current call's window; the parameters are
+/// its first registers.
+enum Opcode : uint16_t {
+    OP_LoadK, // rA = K[B]
+    OP_Move,  // rA = rB
+    OP_Add,   // rA = rB + rC
+    OP_Sub,   // rA = rB - rC
+    OP_Mul,   // rA = rB * rC
+    OP_Lt,    // rA = rB < rC ? 1 : 0
+    OP_Call,  // rA = call target B with the arguments from rC up
+    OP_Ret,   // return rA
+};
+
+/// Instr - One instruction in 8 bytes: an opcode and three operands.
+struct Instr {
+    Opcode Op;
+    uint16_t A, B, C;
+};
+static_assert(sizeof(Instr) == 8, "Instr should stay compact");
+
+/// BytecodeFunction - A function lowered to bytecode, or a top-level
+/// expression, which takes no parameters.
+struct BytecodeFunction {
+    Symbol Name;
+    unsigned NumParams = 0;
+    unsigned NumRegs = 0; // the size of its register window
+    std::vector<Instr> Code;
+    std::vector<double> Constants;
+
+    explicit BytecodeFunction(Symbol Name): Name(Name) {}
+};
+
+/// CallTarget - What an OP_Call calls: a function defined in bytecode,
+/// otherwise a host or library function. A target may gain a definition
+/// after calls to it have been lowered; the definition then wins.
+struct CallTarget {
+    Symbol Name;
+    unsigned NumArgs;
+    const BytecodeFunction *Fn = nullptr;
+    llvm::JITTargetAddress Native = 0;
+
+    CallTarget(Symbol Name, unsigned NumArgs): Name(Name), NumArgs(NumArgs) {}
+};
+
+/// BytecodeModule - The functions of a bytecode session and the call targets
+/// that bind them together, one per callee name.
+class BytecodeModule {
+    std::vector<std::unique_ptr<BytecodeFunction>> Functions;
+    std::vector<CallTarget> Targets;
+    llvm::DenseMap<uint32_t, unsigned> TargetIDs; // Symbol ID -> Targets index
+
+public:
+    /// getTargetID - The target for calls to Name, which takes NumArgs
+    /// arguments, creating it on first use.
+    unsigned getTargetID(Symbol Name, unsigned NumArgs) {
+        auto Ins = TargetIDs.try_emplace(Name.getID(), Targets.size());
+        if(Ins.second) { Targets.emplace_back(Name, NumArgs); }
+        return Ins.first->second;
+    }
+    CallTarget &getTarget(unsigned ID) { return Targets[ID]; }
+    const CallTarget &getTarget(unsigned ID) const { return Targets[ID]; }
+    size_t getNumTargets() const { return Targets.size(); }
+
+    /// isDefined - Whether Name has a bytecode definition.
+    bool isDefined(Symbol Name) const {
+        auto It = TargetIDs.find(Name.getID());
+        return It != TargetIDs.end() && Targets[It->second].Fn;
+    }
+
+    /// define - Add Fn and bind calls to its name to it.
+    void define(std::unique_ptr<BytecodeFunction> Fn) {
+        getTarget(getTargetID(Fn->Name, Fn->NumParams)).Fn = Fn.get();
+        Functions.push_back(std::move(Fn));
+    }
+
+    /// print - Disassemble Fn, one instruction per line.
+    void print(const BytecodeFunction &Fn, const SymbolTable &Symbols,
+               FILE *OS) const;
+};
+
+/// BytecodeCompiler - Lowers a FunctionAST to a BytecodeFunction. Each
+/// expression yields the register that holds its value: a parameter's own
+/// register, or the next free one, allocated like a stack. The arguments of
+/// a call are lowered into consecutive registers above every live value, so
+/// that they become the callee's parameters in place. Reports the errors the
+/// code generator would, and those of functions too large to encode.
+class BytecodeCompiler: public ExprVisitor<BytecodeCompiler, unsigned> {
+    BytecodeModule &Module;
+    const PrototypeMap &Protos;
+    // Resolves a callee with no bytecode definition; 0 if there is none.
+    llvm::function_ref<llvm::JITTargetAddress(Symbol)> ResolveExtern;
+    DiagnosticEngine &Diags;
+    size_t Offset;
+    BytecodeFunction *Fn = nullptr;
+    PrototypeAST *FnProto = nullptr; // not in Protos until Fn is defined
+    llvm::ArrayRef<Symbol> Params;
+    unsigned Top = 0; // first free register
+    bool Failed = false;
+
+    unsigned fail(const char *Msg) {
+        if(!Failed) { Diags.error(Offset, Msg); }
+        Failed = true;
+        return 0;
+    }
+
+    unsigned allocate() {
+        if(Top == UINT16_MAX) { return fail("function too large for bytecode"); }
+        Fn->NumRegs = std::max(Fn->NumRegs, Top + 1);
+        return Top++;
+    }
+
+    void emit(Opcode Op, unsigned A, unsigned B = 0, unsigned C = 0) {
+        Fn->Code.push_back({Op, uint16_t(A), uint16_t(B), uint16_t(C)});
+    }
+
+public:
+    BytecodeCompiler(BytecodeModule &Module, const PrototypeMap &Protos,
+                     llvm::function_ref<llvm::JITTargetAddress(Symbol)> Resolve,
+                     DiagnosticEngine &Diags, size_t Offset)
+        : Module(Module), Protos(Protos), ResolveExtern(Resolve), Diags(Diags),
+          Offset(Offset) {}
+
+    /// compile - Lower F. Returns nullptr (after reporting) on error.
+    std::unique_ptr<BytecodeFunction> compile(FunctionAST *F);
+
+    unsigned visitNumberExpr(NumberExprAST *E);
+    unsigned visitVariableExpr(VariableExprAST *E);
+    unsigned visitBinaryExpr(BinaryExprAST *E);
+    unsigned visitCallExpr(CallExprAST *E);
+};
+
+/// BytecodeVM - Runs bytecode on one register stack: each call's window
+/// starts at its arguments in the caller's window. Instructions are
+/// dispatched by computed goto where the compiler supports it, so that every
+/// handler ends in an indirect jump of its own, else by a switch.
+class BytecodeVM {
+    struct Frame {
+        const Instr *PC; // the caller's OP_Call
+        double *Regs;
+        const BytecodeFunction *Fn;
+    };
+    std::vector<double> Stack;
+    std::vector<Frame> Frames;
+    size_t MaxDepth; // calls in progress; a call need not use any registers
+
+public:
+    explicit BytecodeVM(size_t StackSize = 1 << 20, size_t MaxDepth = 1 << 18)
+        : Stack(StackSize), MaxDepth(MaxDepth) {}
+
+    /// run - Evaluate the top-level expression Entry of Module. Returns false
+    /// if the register stack overflows or calls nest deeper than MaxDepth.
+    bool run(const BytecodeModule &Module, const BytecodeFunction &Entry,
+             double &Result);
+};
+} // end of the namespace
+
+void BytecodeModule::print(const BytecodeFunction &Fn,
+                           const SymbolTable &Symbols, FILE *OS) const {
+    static const char *const Names[] = {"loadk", "move", "add", "sub",
+                                        "mul",   "lt",   "call", "ret"};
+    llvm::StringRef Name = Symbols.getName(Fn.Name);
+    fprintf(OS, "%.*s: %u params, %u registers\n", int(Name.size()),
+            Name.data(), Fn.NumParams, Fn.NumRegs);
+    for(size_t I = 0; I != Fn.Code.size(); ++I) {
+        const Instr &In = Fn.Code[I];
+        fprintf(OS, "  %4zu  ", I);
+        switch(In.Op) {
+        case OP_LoadK:
+            fprintf(OS, "r%u = loadk %g\n", In.A, Fn.Constants[In.B]);
+            break;
+        case OP_Move:
+            fprintf(OS, "r%u = move r%u\n", In.A, In.B);
+            break;
+        case OP_Call: {
+            const CallTarget &T = getTarget(In.B);
+            llvm::StringRef Callee = Symbols.getName(T.Name);
+            fprintf(OS, "r%u = call %.*s(%u args from r%u)\n", In.A,
+                    int(Callee.size()), Callee.data(), T.NumArgs, In.C);
+            break;
+        }
+        case OP_Ret:
+            fprintf(OS, "ret r%u\n", In.A);
+            break;
+        default:
+            fprintf(OS, "r%u = %s r%u, r%u\n", In.A, Names[In.Op], In.B, In.C);
+            break;
+        }
+    }
+}
+
+std::unique_ptr<BytecodeFunction> BytecodeCompiler::compile(FunctionAST *F) {
+    PrototypeAST *Proto = F->getProto();
+    auto Result = std::make_unique<BytecodeFunction>(Proto->getName());
+    Fn = Result.get();
+    FnProto = Proto;
+    Params = Proto->getArgs();
+    if(Params.size() > UINT16_MAX) {
+        fail("function too large for bytecode");
+        return nullptr;
+    }
+    Fn->NumParams = Fn->NumRegs = Top = Params.size();
+    unsigned Reg = visit(F->getBody());
+    emit(OP_Ret, Reg);
+    if(Fn->Constants.size() > UINT16_MAX) { fail("function too large for bytecode"); }
+    if(Failed) { return nullptr; }
+    return Result;
+}
+
+unsigned BytecodeCompiler::visitNumberExpr(NumberExprAST *E) {
+    unsigned Reg = allocate();
+    emit(OP_LoadK, Reg, Fn->Constants.size());
+    Fn->Constants.push_back(E->getVal());
+    return Reg;
+}
+
+unsigned BytecodeCompiler::visitVariableExpr(VariableExprAST *E) {
+    for(size_t I = 0; I != Params.size(); ++I) {
+        if(Params[I] == E->getName()) { return I; }
+    }
+    return fail("Unknown variable name");
+}
+
+unsigned BytecodeCompiler::visitBinaryExpr(BinaryExprAST *E) {
+    Opcode Op;
+    switch(E->getOp()) {
+    case '+':
+        Op = OP_Add;
+        break;
+    case '-':
+        Op = OP_Sub;
+        break;
+    case '*':
+        Op = OP_Mul;
+        break;
+    case '<':
+        Op = OP_Lt;
+        break;
+    default:
+        return fail("invalid binary operator");
+    }
+    // The operands' registers are free again once the result is computed.
+    unsigned Mark = Top;
+    unsigned L = visit(E->getLHS());
+    unsigned R = visit(E->getRHS());
+    Top = Mark;
+    unsigned Reg = allocate();
+    emit(Op, Reg, L, R);
+    return Reg;
+}
+
+unsigned BytecodeCompiler::visitCallExpr(CallExprAST *E) {
+    // Look up the name in the global module table, unless it is the function
+    // being defined.
+    bool IsSelf = E->getCallee() == Fn->Name;
+    PrototypeAST *Proto =
+        IsSelf ? FnProto : Protos.lookup(E->getCallee().getID());
+    if(!Proto) { return fail("Unknown function referenced"); }
+    // If argument mismatch error.
+    unsigned NumArgs = E->getArgs().size();
+    if(Proto->getArgs().size() != NumArgs) {
+        return fail("Incorrect # arguments passed");
+    }
+
+    // Calls to the function being defined are bound once it is.
+    bool Defined = IsSelf || Module.isDefined(E->getCallee());
+    llvm::JITTargetAddress Native = 0;
+    if(!Defined) {
+        if(NumArgs > MaxNativeArgs) {
+            return fail("Too many arguments for a host function");
+        }
+        if(!(Native = ResolveExtern(E->getCallee()))) {
+            Failed = true; // reported by ResolveExtern
+            return 0;
+        }
+    }
+    if(Module.getNumTargets() == UINT16_MAX) {
+        return fail("too many call targets for bytecode");
+    }
+    unsigned Target = Module.getTargetID(E->getCallee(), NumArgs);
+    if(Native) { Module.getTarget(Target).Native = Native; }
+
+    // Argument I is lowered with Base + I as the first free register, which
+    // is where a computed value lands anyway; only parameters need moving.
+    unsigned Base = Top;
+    for(unsigned I = 0; I != NumArgs; ++I) {
+        Top = Base + I;
+        unsigned Reg = visit(E->getArgs()[I]);
+        Top = Base + I;
+        if(allocate() != Reg) { emit(OP_Move, Base + I, Reg); }
+    }
+    // The result lands on the first argument, which is dead by then.
+    Top = Base;
+    unsigned Reg = allocate();
+    emit(OP_Call, Reg, Target, Base);
+    return Reg;
+}
+
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+bool BytecodeVM::run(const BytecodeModule &Module,
+                     const BytecodeFunction &Entry, double &Result) {
+    double *Regs = Stack.data();
+    double *StackEnd = Stack.data() + Stack.size();
+    if(Regs + Entry.NumRegs > StackEnd) { return false; }
+    const BytecodeFunction *Fn = &Entry;
+    const double *K = Fn->Constants.data();
+    const Instr *PC = Fn->Code.data();
+    Frames.clear();
+
+#if VM_COMPUTED_GOTO
+    // In Opcode order.
+    static const void *const Labels[] = {&&OP_LoadK, &&OP_Move, &&OP_Add,
+                                         &&OP_Sub,   &&OP_Mul,  &&OP_Lt,
+                                         &&OP_Call,  &&OP_Ret};
+#define VM_CASE(Op) Op:
+#define VM_DISPATCH() goto *Labels[PC->Op]
+#define VM_NEXT() goto *Labels[(++PC)->Op]
+    VM_DISPATCH();
+#else
+#define VM_CASE(Op) case Op:
+#define VM_DISPATCH() continue
+#define VM_NEXT() { ++PC; continue; }
+    for(;;) {
+        switch(PC->Op) {
+#endif
+
+    VM_CASE(OP_LoadK) {
+        Regs[PC->A] = K[PC->B];
+        VM_NEXT();
+    }
+    VM_CASE(OP_Move) {
+        Regs[PC->A] = Regs[PC->B];
+        VM_NEXT();
+    }
+    VM_CASE(OP_Add) {
+        Regs[PC->A] = Regs[PC->B] + Regs[PC->C];
+        VM_NEXT();
+    }
+    VM_CASE(OP_Sub) {
+        Regs[PC->A] = Regs[PC->B] - Regs[PC->C];
+        VM_NEXT();
+    }
+    VM_CASE(OP_Mul) {
+        Regs[PC->A] = Regs[PC->B] * Regs[PC->C];
+        VM_NEXT();
+    }
+    VM_CASE(OP_Lt) {
+        Regs[PC->A] = Regs[PC->B] < Regs[PC->C] ? 1.0 : 0.0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_Call) {
+        const CallTarget &T = Module.getTarget(PC->B);
+        double *Args = Regs + PC->C;
+        if(!T.Fn) {
+            Regs[PC->A] = CallNative(T.Native, llvm::ArrayRef<double>(Args, T.NumArgs));
+            VM_NEXT();
+        }
+        if(Args + T.Fn->NumRegs > StackEnd || Frames.size() == MaxDepth) {
+            return false;
+        }
+        Frames.push_back({PC, Regs, Fn});
+        Fn = T.Fn;
+        K = Fn->Constants.data();
+        PC = Fn->Code.data();
+        Regs = Args;
+        VM_DISPATCH();
+    }
+    VM_CASE(OP_Ret) {
+        double Value = Regs[PC->A];
+        if(Frames.empty()) {
+            Result = Value;
+            return true;
+        }
+        const Frame &Caller = Frames.back();
+        PC = Caller.PC;
+        Regs = Caller.Regs;
+        Fn = Caller.Fn;
+        K = Fn->Constants.data();
+        Frames.pop_back();
+        Regs[PC->A] = Value;
+        VM_NEXT();
+    }
+
+#if !VM_COMPUTED_GOTO
+        }
+    }
+#endif
+    llvm_unreachable("every instruction dispatches or returns");
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_CASE
+}
+#undef VM_COMPUTED_GOTO
+
+namespace {
+class JITSession;
+
+/// ExecutionMode - How a JITSession runs the code it is given.
+enum ExecutionMode : uint8_t {
+    EM_Eager,   // compile each item as it is read
+    EM_Lazy,    // compile each definition on its first call
+    EM_Tiered,  // interpret, then compile hot functions in the background
+    EM_Bytecode // lower everything to bytecode for the BytecodeVM
+};
+
+/// LazyDefinition - A function definition of a lazy JITSession, from being
+/// read until the end of the session.
+struct LazyDefinition {
+    FunctionAST *Fn; // a copy, owned by the session
+    size_t Offset;   // start of the definition, for diagnostics
+
+    // Tiered execution. Calls, Promoted and Compiled belong to the REPL
+    // thread; Native is published by the compiler thread once the code is
+    // ready.
+    unsigned Calls = 0;
+    bool Promoted = false;
+    std::shared_future<void> Compiled; // the promotion's compilation
+    std::atomic<llvm::JITTargetAddress> Native{0};
+
+    LazyDefinition(FunctionAST *Fn, size_t Offset): Fn(Fn), Offset(Offset) {}
+};
+
+/// LazyFunctionMU - Supplies one function of a JITSession from its AST.
+/// Nothing is generated for it until it is materialized, which a lazy stub
+/// only asks for on the function's first call.
+class LazyFunctionMU: public llvm::orc::MaterializationUnit {
+    JITSession &S;
+    LazyDefinition &Def;
+
+public:
+    LazyFunctionMU(JITSession &S, llvm::orc::SymbolStringPtr Name,
+                   LazyDefinition &Def)
+        : MaterializationUnit(Interface(
+              llvm::orc::SymbolFlagsMap{
+                  {std::move(Name), llvm::JITSymbolFlags::Exported |
+                                        llvm::JITSymbolFlags::Callable}},
+              nullptr)),
+          S(S), Def(Def) {}
+
+    llvm::StringRef getName() const override { return "LazyFunctionMU"; }
+    void materialize(
+        std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override;
+
+private:
+    // A definition is never replaced: redefining a function is an error.
+    void discard(const llvm::orc::JITDylib &,
+                 const llvm::orc::SymbolStringPtr &) override {}
+};
+
+/// JITSession - What the REPL keeps between top-level items: the JIT, the
+/// module the current CodeGen is filling, and every prototype seen so far.
+/// Each definition is compiled in a module of its own and moved into the JIT,
+/// so later modules call it through a declaration made from its prototype.
+/// In lazy mode a definition is only registered, with a copy of its AST, and
+/// generated in a module of its own when it is first called; the prototypes
+/// known at that point resolve its calls.
+///
+/// Bytecode mode leaves LLVM out altogether: items are lowered to bytecode
+/// as they are read and run by a BytecodeVM, and the JIT is only asked for
+/// the addresses of host functions.
+///
+/// Tiered mode builds on lazy mode. Top-level expressions are interpreted
+/// and never reach LLVM; a function that the interpreter has called
+/// TierThreshold times has its IR generated on the spot and is compiled on
+/// a background thread, and the interpreter calls its native code from the
+/// moment it is published. The compiler thread only gets the finished module,
+/// which calls other functions through their stubs, and never materializes
+/// anything of the session's; only native code, which runs on the REPL
+/// thread, calls the stubs. So CodeGen, the symbol table and diagnostics stay
+/// on the REPL thread and need no locking.
+class JITSession {
+    const SymbolTable &Symbols;
+    DiagnosticEngine &Diags;
+    KaleidoscopeJIT &JIT;
+    ExecutionMode Mode;
+    unsigned TierThreshold; // 0 unless tiered
+    ASTContext SessionCtx; // copies of Protos and lazy definitions
+    PrototypeMap Protos;
+    std::unique_ptr<CodeGen> CG;
+    std::vector<std::unique_ptr<LazyDefinition>> LazyDefs;
+    llvm::DenseMap<uint32_t, LazyDefinition *> LazyDefsByName;
+    llvm::DenseMap<uint32_t, llvm::JITTargetAddress> Externs; // resolved
+    BytecodeModule Bytecode;
+    BytecodeVM VM;
+
+    // Statistics.
+    unsigned NumDefinitions = 0;
+    double LazySeconds = 0; // generating and compiling on first calls
+    unsigned NumPromoted = 0;
+    uint64_t NumInterpretedCalls = 0, NumNativeCalls = 0;
+    std::vector<double> Latencies; // per top-level expression
+
+    // Last, so that pending compilations finish before anything they use
+    // goes away.
+    std::unique_ptr<llvm::ThreadPool> Compiler;
+
+    void startModule() {
+        CG = std::make_unique<CodeGen>(Symbols, Diags, "my cool jit");
+        CG->getModule().setDataLayout(JIT.getDataLayout());
+        CG->setPrototypes(&Protos);
+    }
+
+    void reportError(size_t Offset, llvm::Error Err) {
+        Diags.error(Offset, llvm::toString(std::move(Err)));
+    }
+    /// reportJITErrors - Report the errors the JIT has queued at Offset.
+    /// Returns whether there were any.
+    bool reportJITErrors(size_t Offset) {
+        std::vector<std::string> Errors = JIT.takeErrors();
+        for(std::string &Msg : Errors) { Diags.error(Offset, std::move(Msg)); }
+        return !Errors.empty();
+    }
+
+public:
+    /// JITSession - TierThreshold, at least 1, only matters in EM_Tiered.
+    JITSession(const SymbolTable &Symbols, DiagnosticEngine &Diags,
+               KaleidoscopeJIT &JIT, ExecutionMode Mode,
+               unsigned TierThreshold = 1)
+        : Symbols(Symbols), Diags(Diags), JIT(JIT), Mode(Mode),
+          TierThreshold(Mode == EM_Tiered ? TierThreshold : 0) {
+        JIT.collectErrors();
+        startModule();
+        if(Mode == EM_Tiered) {
+            Compiler = std::make_unique<llvm::ThreadPool>(
+                llvm::hardware_concurrency(1));
+        }
+    }
+
+    bool isLazy() const { return Mode == EM_Lazy || Mode == EM_Tiered; }
+    bool isTiered() const { return Mode == EM_Tiered; }
+    bool isBytecode() const { return Mode == EM_Bytecode; }
+    DiagnosticEngine &getDiagnostics() { return Diags; }
+    CodeGen &getCodeGen() { return *CG; }
+
+    /// addPrototype - Remember Proto for calls from later modules.
+    void addPrototype(PrototypeAST *Proto) {
+        Protos[Proto->getName().getID()] = ASTCloner(SessionCtx).clone(Proto);
+    }
+    PrototypeAST *getPrototype(Symbol Name) const {
+        return Protos.lookup(Name.getID());
+    }
+    /// checkArity - Whether Proto, of an item starting at Offset, has as many
+    /// parameters as the prototype already known by its name, if any. Each
+    /// definition gets a module of its own, so CodeGen can't check this.
+    bool checkArity(PrototypeAST *Proto, size_t Offset) {
+        PrototypeAST *Known = getPrototype(Proto->getName());
+        if(!Known || Known->getArgs().size() == Proto->getArgs().size()) {
+            return true;
+        }
+        Diags.error(Offset, "Function redefined with a different number of arguments");
+        return false;
+    }
+
+    /// addModule - Move the current module, which holds a definition, into
+    /// the JIT and start a new one. Returns false on error.
+    bool addModule(size_t Offset) {
+        llvm::Error Err = JIT.addModule(CG->takeModule());
+        startModule();
+        if(Err) {
+            reportError(Offset, std::move(Err));
+            return false;
+        }
+        ++NumDefinitions;
+        return true;
+    }
+
+    /// addLazyDefinition - Register F, which starts at Offset, to be compiled
+    /// on its first call. Returns false on error.
+    bool addLazyDefinition(FunctionAST *F, size_t Offset) {
+        F = ASTCloner(SessionCtx).clone(F);
+        Symbol Name = F->getProto()->getName();
+        auto Def = std::make_unique<LazyDefinition>(F, Offset);
+        if(llvm::Error Err = JIT.addLazy(std::make_unique<LazyFunctionMU>(
+               *this, JIT.mangle(Symbols.getName(Name)), *Def))) {
+            reportError(Offset, std::move(Err));
+            return false;
+        }
+        ++NumDefinitions;
+        addPrototype(F->getProto());
+        LazyDefsByName[Name.getID()] = Def.get();
+        LazyDefs.push_back(std::move(Def));
+        return true;
+    }
+    LazyDefinition *getLazyDefinition(Symbol Name) const {
+        return LazyDefsByName.lookup(Name.getID());
+    }
+
+    /// materialize - Fulfil R with Def's native code if a promotion has
+    /// published it, else with a module generated for Def now.
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+                     LazyDefinition &Def);
+
+    /// evaluate - Run the anonymous function Name of the current module, free
+    /// its code and start a new module. Returns false on error, including a
+    /// function that failed to compile on its first call during the run.
+    bool evaluate(llvm::StringRef Name, size_t Offset, double &Result) {
+        reportJITErrors(Offset); // left over from background work
+        auto Value = JIT.evaluate(CG->takeModule(), Name);
+        startModule();
+        if(!Value) {
+            reportError(Offset, Value.takeError());
+            return false;
+        }
+        Result = *Value;
+        return !reportJITErrors(Offset);
+    }
+
+    /// lowerBytecode - Lower F, which starts at Offset, to bytecode. Returns
+    /// nullptr on error.
+    std::unique_ptr<BytecodeFunction> lowerBytecode(FunctionAST *F,
+                                                    size_t Offset) {
+        return BytecodeCompiler(Bytecode, Protos,
+                                [&](Symbol Name) {
+                                    return lookupExtern(Name, Offset);
+                                },
+                                Diags, Offset)
+            .compile(F);
+    }
+    /// addBytecodeDefinition - Lower F, which starts at Offset, and define it
+    /// for later calls. Returns the function, or nullptr on error.
+    const BytecodeFunction *addBytecodeDefinition(FunctionAST *F,
+                                                  size_t Offset) {
+        if(Bytecode.isDefined(F->getProto()->getName())) {
+            Diags.error(Offset, "Function cannot be redefined.");
+            return nullptr;
+        }
+        auto Fn = lowerBytecode(F, Offset);
+        if(!Fn) { return nullptr; }
+        ++NumDefinitions;
+        addPrototype(F->getProto());
+        const BytecodeFunction *Result = Fn.get();
+        Bytecode.define(std::move(Fn));
+        return Result;
+    }
+    /// runBytecode - Run the lowered top-level expression Fn, which starts at
+    /// Offset. Returns false on error.
+    bool runBytecode(const BytecodeFunction &Fn, size_t Offset,
+                     double &Result) {
+        if(VM.run(Bytecode, Fn, Result)) { return true; }
+        Diags.error(Offset, "bytecode register stack overflow");
+        return false;
+    }
+    /// printBytecode - Disassemble Fn.
+    void printBytecode(const BytecodeFunction &Fn, FILE *OS) const {
+        Bytecode.print(Fn, Symbols, OS);
+    }
+
+    /// lookup - The address of the compiled function Name. Returns None
+    /// (after reporting at Offset) on error.
+    llvm::Optional<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef Name,
+                                                    size_t Offset) {
+        auto Sym = JIT.lookup(Name);
+        if(!Sym) {
+            reportError(Offset, Sym.takeError());
+            return llvm::None;
+        }
+        return *Sym;
+    }
+
+    /// interpret - Evaluate the top-level expression F, which starts at
+    /// Offset, without compiling it. Returns false on error.
+    bool interpret(FunctionAST *F, size_t Offset, double &Result);
+
+    /// countCall - Note an interpreted call to Def and promote Def once it
+    /// has had TierThreshold of them.
+    void countCall(LazyDefinition &Def) {
+        ++NumInterpretedCalls;
+        if(++Def.Calls >= TierThreshold && !Def.Promoted) { promote(Def); }
+    }
+    void countNativeCall() { ++NumNativeCalls; }
+
+    /// promote - Generate Def's IR and compile it in the background.
+    void promote(LazyDefinition &Def);
+
+    /// lookupExtern - The address of the host or library function Name, or 0
+    /// (after reporting at Offset) if there is none.
+    llvm::JITTargetAddress lookupExtern(Symbol Name, size_t Offset);
+
+    /// recordLatency - Note how long a top-level expression took from being
+    /// parsed to its result.
+    void recordLatency(double Seconds) { Latencies.push_back(Seconds); }
+
+    /// printStats - Report how many of the definitions were compiled and how
+    /// top-level expressions fared.
+    void printStats(FILE *OS);
+};
+
+/// Interpreter - The first tier of a tiered JITSession: evaluates a top-level
+/// expression by walking its AST, counting the calls to session functions and
+/// making those that have been compiled natively. Errors the code generator
+/// would have reported are reported as they are met, and abandon the
+/// evaluation.
+class Interpreter: public ExprVisitor<Interpreter, double> {
+    JITSession &S;
+    size_t Offset;
+    // The innermost interpreted call.
+    llvm::ArrayRef<Symbol> Params;
+    const double *Args = nullptr;
+    bool Failed = false;
+
+    double fail(const llvm::Twine &Msg) {
+        if(!Failed) { S.getDiagnostics().error(Offset, Msg.str()); }
+        Failed = true;
+        return 0;
+    }
+
+public:
+    Interpreter(JITSession &S, size_t Offset): S(S), Offset(Offset) {}
+
+    /// run - Evaluate the body of the parameterless F. Returns false on error.
+    bool run(FunctionAST *F, double &Result) {
+        Result = visit(F->getBody());
+        return !Failed;
+    }
+
+    double visitNumberExpr(NumberExprAST *E) { return E->getVal(); }
+    double visitVariableExpr(VariableExprAST *E);
+    double visitBinaryExpr(BinaryExprAST *E);
+    double visitCallExpr(CallExprAST *E);
+};
+} // end of the namespace
+
+void LazyFunctionMU::materialize(
+    std::unique_ptr<llvm::orc::MaterializationResponsibility> R) {
+    S.materialize(std::move(R), Def);
+}
+
+void JITSession::materialize(
+    std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+    LazyDefinition &Def) {
+    // The stub of a promoted function points at the compiled code rather
+    // than a second copy, once the compiler thread is done with it.
+    if(Def.Compiled.valid()) { Def.Compiled.wait(); }
+    if(llvm::JITTargetAddress Native =
+           Def.Native.load(std::memory_order_acquire)) {
+        llvm::orc::SymbolMap Resolved;
+        for(auto &KV : R->getSymbols()) {
+            Resolved[KV.first] = llvm::JITEvaluatedSymbol(Native, KV.second);
+        }
+        llvm::Error Err = R->notifyResolved(Resolved);
+        if(!Err) { Err = R->notifyEmitted(); }
+        if(Err) {
+            R->getExecutionSession().reportError(std::move(Err));
+            R->failMaterialization();
+        }
+        return;
+    }
+    auto Start = BenchClock::now();
+    CodeGen LazyCG(Symbols, Diags, "lazy");
+    LazyCG.getModule().setDataLayout(JIT.getDataLayout());
+    LazyCG.setPrototypes(&Protos);
+    LazyCG.setItemOffset(Def.Offset);
+    if(LazyCG.codegen(Def.Fn)) {
+        JIT.emit(std::move(R), LazyCG.takeModule());
+    } else {
+        R->failMaterialization();
+    }
+    LazySeconds += SecondsSince(Start);
+}
+
+bool JITSession::interpret(FunctionAST *F, size_t Offset, double &Result) {
+    reportJITErrors(Offset); // left over from background work
+    bool OK = Interpreter(*this, Offset).run(F, Result);
+    return !reportJITErrors(Offset) && OK;
+}
+
+void JITSession::promote(LazyDefinition &Def) {
+    Def.Promoted = true;
+    // The interpreter can't call more arguments than CallNative passes.
+    if(Def.Fn->getProto()->getArgs().size() > MaxNativeArgs) { return; }
+
+    CodeGen PromoteCG(Symbols, Diags, "tiered");
+    PromoteCG.getModule().setDataLayout(JIT.getDataLayout());
+    PromoteCG.setPrototypes(&Protos);
+    PromoteCG.setItemOffset(Def.Offset);
+    if(!PromoteCG.codegen(Def.Fn)) { return; }
+    ++NumPromoted;
+
+    // The task owns the module; ThreadPool tasks have to be copyable.
+    auto TSM =
+        std::make_shared<llvm::orc::ThreadSafeModule>(PromoteCG.takeModule());
+    std::string Name = Symbols.getName(Def.Fn->getProto()->getName()).str();
+    Def.Compiled = Compiler->async([this, &Def, TSM, Name] {
+        auto Sym = JIT.compileDetached(std::move(*TSM), Name);
+        if(!Sym) {
+            llvm::consumeError(Sym.takeError()); // the JIT has queued it
+            return;
+        }
+        Def.Native.store(Sym->getAddress(), std::memory_order_release);
+    });
+}
+
+llvm::JITTargetAddress JITSession::lookupExtern(Symbol Name, size_t Offset) {
+    auto It = Externs.find(Name.getID());
+    if(It != Externs.end()) { return It->second; }
+    auto Sym = JIT.lookup(Symbols.getName(Name));
+    if(!Sym) {
+        reportError(Offset, Sym.takeError());
+        return 0;
+    }
+    return Externs[Name.getID()] = Sym->getAddress();
+}
+
+void JITSession::printStats(FILE *OS) {
+    if(Compiler) { Compiler->wait(); }
+    unsigned Compiled = JIT.getNumCompiled();
+    if(isBytecode()) {
+        fprintf(OS, "Bytecode: %u definitions\n", NumDefinitions);
+    } else {
+        fprintf(OS, "JIT: %u definitions, %u compiled (%.1f%%)", NumDefinitions,
+                Compiled,
+                NumDefinitions ? 100.0 * Compiled / NumDefinitions : 0.0);
+        if(isLazy()) {
+            fprintf(OS, ", %.3f ms compiling on first calls", LazySeconds * 1e3);
+        }
+        if(JIT.isReoptimizing()) {
+            JIT.waitForReoptimization();
+            double Seconds;
+            unsigned Reoptimized = JIT.getNumReoptimized(Seconds);
+            fprintf(OS, ", %u reoptimized in the background in %.3f ms",
+                    Reoptimized, Seconds * 1e3);
+        }
+        fputc('\n', OS);
+    }
+    if(isTiered()) {
+        fprintf(OS,
+                "Tiers: threshold %u, %u functions promoted, %llu interpreted "
+                "and %llu native calls\n",
+                TierThreshold, NumPromoted,
+                (unsigned long long)NumInterpretedCalls,
+                (unsigned long long)NumNativeCalls);
+    }
+    if(Latencies.empty()) { return; }
+    // Steady state is the second half of the session.
+    size_t Half = Latencies.size() / 2;
+    double Steady = 0;
+    for(size_t I = Half; I != Latencies.size(); ++I) { Steady += Latencies[I]; }
+    Steady /= Latencies.size() - Half;
+    fprintf(OS,
+            "Expressions: %zu, first result after %.3f ms, then %.2f us each "
+            "(%.0f/s) over the last %zu\n",
+            Latencies.size(), Latencies.front() * 1e3, Steady * 1e6,
+            Steady > 0 ? 1 / Steady : 0.0, Latencies.size() - Half);
+}
+
+double Interpreter::visitVariableExpr(VariableExprAST *E) {
+    for(size_t I = 0; I != Params.size(); ++I) {
+        if(Params[I] == E->getName()) { return Args[I]; }
+    }
+    return fail("Unknown variable name");
+}
+
+double Interpreter::visitBinaryExpr(BinaryExprAST *E) {
+    double L = visit(E->getLHS());
+    double R = visit(E->getRHS());
+    switch(E->getOp()) {
+    case '+':
+        return L + R;
+    case '-':
+        return L - R;
+    case '*':
+        return L * R;
+    case '<':
+        return L < R ? 1.0 : 0.0;
+    default:
+        return fail("invalid binary operator");
+    }
+}
+
+double Interpreter::visitCallExpr(CallExprAST *E) {
+    PrototypeAST *Proto = S.getPrototype(E->getCallee());
+    if(!Proto) { return fail("Unknown function referenced"); }
+    if(Proto->getArgs().size() != E->getArgs().size()) {
+        return fail("Incorrect # arguments passed");
+    }
+
+    llvm::SmallVector<double, 8> Vals;
+    for(ExprAST *Arg : E->getArgs()) { Vals.push_back(visit(Arg)); }
+    if(Failed) { return 0; }
+
+    LazyDefinition *Def = S.getLazyDefinition(E->getCallee());
+    if(!Def) {
+        // A host or library function.
+        if(Vals.size() > MaxNativeArgs) {
+            return fail("Too many arguments for a host function");
+        }
+        llvm::JITTargetAddress Addr = S.lookupExtern(E->getCallee(), Offset);
+        if(!Addr) {
+            Failed = true;
+            return 0;
+        }
+        return CallNative(Addr, Vals);
+    }
+    if(llvm::JITTargetAddress Addr =
+           Def->Native.load(std::memory_order_acquire)) {
+        S.countNativeCall();
+        return CallNative(Addr, Vals);
+    }
+
+    S.countCall(*Def);
+    llvm::ArrayRef<Symbol> CallerParams = Params;
+    const double *CallerArgs = Args;
+    size_t CallerOffset = Offset;
+    Params = Def->Fn->getProto()->getArgs();
+    Args = Vals.data();
+    Offset = Def->Offset; // report errors in the body at the definition
+    double Result = visit(Def->Fn->getBody());
+    Params = CallerParams;
+    Args = CallerArgs;
+    Offset = CallerOffset;
+    return Result;
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+static llvm::cl::opt<bool>
+    PrintAST("print-ast", llvm::cl::desc("Print each parsed item's AST"));
+
+static void HandleDefinition(Parser &P, JITSession &S) {
+  size_t Offset = P.getTokenOffset();
+  S.getCodeGen().setItemOffset(Offset);
+  if (auto *F = P.ParseDefinition()) {
+    if (PrintAST)
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printFunction(F);
+    if (!S.checkArity(F->getProto(), Offset)) {
+      // Reported; nothing to define.
+    } else if (S.isBytecode()) {
+      if (auto *Fn = S.addBytecodeDefinition(F, Offset)) {
+        fprintf(stderr, "Read function definition: ");
+        S.printBytecode(*Fn, stderr);
+      }
+    } else if (S.isLazy()) {
+      // Only a stub for now; the body is generated when first called.
+      llvm::StringRef Name =
+          P.getTokens().getSymbols().getName(F->getProto()->getName());
+      if (S.addLazyDefinition(F, Offset))
+        fprintf(stderr, "Read function definition: %.*s (lazy)\n",
+                int(Name.size()), Name.data());
+    } else if (auto *FnIR = S.getCodeGen().codegen(F)) {
+      fprintf(stderr, "Read function definition:");
+      FnIR->print(llvm::errs());
+      fprintf(stderr, "\n");
+      if (S.addModule(Offset))
+        S.addPrototype(F->getProto());
+    }
+  } else {
+    // Skip token for error recovery.
+    P.GetNextToken();
+  }
+}
+
+static void HandleExtern(Parser &P, JITSession &S) {
+  size_t Offset = P.getTokenOffset();
+  S.getCodeGen().setItemOffset(Offset);
+  if (auto *Proto = P.ParseExtern()) {
+    if (PrintAST) {
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printPrototype(Proto);
+      fputc('\n', stderr);
+    }
+    if (!S.checkArity(Proto, Offset))
+      return;
+    if (auto *FnIR = S.getCodeGen().codegen(Proto)) {
+      fprintf(stderr, "Read extern: ");
+      FnIR->print(llvm::errs());
+      fprintf(stderr, "\n");
+      S.addPrototype(Proto);
+    }
+  } else {
+    // Skip token for error recovery.
+    P.GetNextToken();
+  }
+}
+
+static void HandleTopLevelExpression(Parser &P, JITSession &S) {
+  size_t Offset = P.getTokenOffset();
+  S.getCodeGen().setItemOffset(Offset);
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto *F = P.ParseTopLevelExpr()) {
+    if (PrintAST)
+      ASTPrinter(P.getTokens().getSymbols(), stderr).printFunction(F);
+    // Time to the result, leaving out the printing of the IR.
+    auto Start = BenchClock::now();
+    double Result, Seconds;
+    if (S.isBytecode()) {
+      auto Fn = S.lowerBytecode(F, Offset);
+      if (!Fn)
+        return;
+      Seconds = SecondsSince(Start);
+      fprintf(stderr, "Read top-level expression: ");
+      S.printBytecode(*Fn, stderr);
+
+      Start = BenchClock::now();
+      if (!S.runBytecode(*Fn, Offset, Result))
+        return;
+      Seconds += SecondsSince(Start);
+    } else if (S.isTiered()) {
+      // Interpret the expression; only hot functions are compiled.
+      if (!S.interpret(F, Offset, Result))
+        return;
+      Seconds = SecondsSince(Start);
+    } else {
+      auto *FnIR = S.getCodeGen().codegen(F);
+      if (!FnIR)
+        return;
+      Seconds = SecondsSince(Start);
+      fprintf(stderr, "Read top-level expression:");
+      FnIR->print(llvm::errs());
+      fprintf(stderr, "\n");
+
+      // JIT the module containing the anonymous expression, run it and free
+      // it again.
+      std::string Name = FnIR->getName().str();
+      Start = BenchClock::now();
+      if (!S.evaluate(Name, Offset, Result))
+        return;
+      Seconds += SecondsSince(Start);
+    }
+    S.recordLatency(Seconds);
+    fprintf(stderr, "Evaluated to %f\n", Result);
+  } else {
+    // Skip token for error recovery.
+    P.GetNextToken();
+  }
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop(Parser &P, ASTContext &Ctx, JITSession &S) {
+  while (true) {
+    // Only the IR outlives its top-level item, so recycle the arena.
+    Ctx.reset();
+    P.getDiagnostics().flush(stderr);
+    fprintf(stderr, "ready> ");
+    switch (P.getCurToken()) {
+    case tok_eof:
+      return;
+    case ';': // ignore top-level semicolons.
+      P.GetNextToken();
+      break;
+    case tok_def:
+      HandleDefinition(P, S);
+      break;
+    case tok_extern:
+      HandleExtern(P, S);
+      break;
+    default:
+      HandleTopLevelExpression(P, S);
+      break;
+    }
+  }
+}
+
+/// ParseAllFunctions - Quietly parse every remaining top-level item, appending
+/// definitions and top-level expressions to Fns, and externs to Externs if
+/// given. Returns the number of items that failed to parse.
+static unsigned
+ParseAllFunctions(Parser &P, std::vector<FunctionAST *> &Fns,
+                  std::vector<PrototypeAST *> *Externs = nullptr) {
+  unsigned Errors = 0;
+  while (true) {
+    FunctionAST *F = nullptr;
+    bool OK;
+    switch (P.getCurToken()) {
+    case tok_eof:
+      return Errors;
+    case ';':
+      P.GetNextToken();
+      continue;
+    case tok_def:
+      OK = (F = P.ParseDefinition());
+      break;
+    case tok_extern: {
+      PrototypeAST *Proto = P.ParseExtern();
+      if (Proto && Externs)
+        Externs->push_back(Proto);
+      OK = Proto;
+      break;
+    }
+    default:
+      OK = (F = P.ParseTopLevelExpr());
+      break;
+    }
+    if (F)
+      Fns.push_back(F);
+    if (!OK) {
+      ++Errors;
+      P.GetNextToken(); // Skip token for error recovery.
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel parsing
+//===----------------------------------------------------------------------===//
+
+/// TopLevelItem - The result of parsing, and then generating, one top-level
+/// item.
+struct TopLevelItem {
+    int Kind;             // tok_def, tok_extern, or 0 for an expression
+    uint32_t Offset;      // where the item starts in the source
+    FunctionAST *Fn;      // the definition or expression, null on error
+    PrototypeAST *Proto;  // the extern, null on error
+    uint32_t DiagEnd;     // end of this item's diagnostics in ParsedChunk::Diags
+    llvm::Function *IR;   // set by GenerateInParallel, null on error; it
+                          // dangles once RunInJIT has taken the module
+    uint32_t CGDiagEnd;   // likewise, in ParsedChunk::CGDiags
+};
+
+/// ParsedChunk - The items of one run of the token stream, with the arena
+/// their nodes live in and the diagnostics reported while parsing them; after
+/// GenerateInParallel, also the module holding their IR.
+struct ParsedChunk {
+    size_t Begin, End; // token indices; items start in [Begin, End)
+    ASTContext Ctx;
+    DiagnosticEngine Diags;
+    std::vector<TopLevelItem> Items;
+    std::unique_ptr<CodeGen> CG;
+    DiagnosticEngine CGDiags;
+
+    explicit ParsedChunk(const SourceBuffer &Source)
+        : Diags(Source), CGDiags(Source) {}
+};
+
+/// SplitTopLevel - Cut the complete stream Toks into at most NumChunks runs of
+/// roughly equal token count. Every cut falls on a 'def' or 'extern', where a
+/// well-formed top-level item must start.
+static std::vector<std::unique_ptr<ParsedChunk>>
+SplitTopLevel(TokenStream &Toks, unsigned NumChunks) {
+    llvm::ArrayRef<TokenRecord> Tokens = Toks.getTokens();
+    std::vector<std::unique_ptr<ParsedChunk>> Chunks;
+    size_t Begin = 0;
+    for(unsigned I = 1; I <= NumChunks && Begin < Tokens.size(); ++I) {
+        size_t End = Tokens.size() * I / NumChunks;
+        while(End < Tokens.size() && Tokens[End].Kind != tok_def &&
+              Tokens[End].Kind != tok_extern) {
+            ++End;
+        }
+        if(End <= Begin) { continue; }
+        Chunks.push_back(std::make_unique<ParsedChunk>(Toks.getSource()));
+        Chunks.back()->Begin = Begin;
+        Chunks.back()->End = End;
+        Begin = End;
+    }
+    return Chunks;
+}
+
+/// ParseChunk - Parse the items of Chunk into its own arena, recovering from
+/// errors the way MainLoop does.
+static void ParseChunk(TokenStream &Toks, ParsedChunk &Chunk, bool Iterative) {
+    Parser P(Toks, Chunk.Ctx, Chunk.Diags, Chunk.Begin);
+    P.setIterative(Iterative);
+    P.GetNextToken();
+    while(P.getTokenIndex() < Chunk.End) {
+        TopLevelItem Item = {P.getCurToken(), P.getTokenOffset(), nullptr,
+                             nullptr, 0, nullptr, 0};
+        bool OK;
+        switch(Item.Kind) {
+        case tok_eof:
+            return;
+        case ';':
+            P.GetNextToken();
+            continue;
+        case tok_def:
+            OK = (Item.Fn = P.ParseDefinition());
+            break;
+        case tok_extern:
+            OK = (Item.Proto = P.ParseExtern());
+            break;
+        default:
+            Item.Kind = 0;
+            OK = (Item.Fn = P.ParseTopLevelExpr());
+            break;
+        }
+        if(!OK) { P.GetNextToken(); } // Skip token for error recovery.
+        Item.DiagEnd = Chunk.Diags.getDiagnostics().size();
+        Chunk.Items.push_back(Item);
+    }
+}
+
+/// ParseInParallel - Parse the complete stream Toks on up to NumThreads
+/// threads. The stream is split at top-level 'def'/'extern' boundaries into
+/// several chunks per thread, for load balance, and each chunk is parsed by
+/// its own Parser into its own arena; concatenating the chunks gives the items
+/// in source order. Error recovery restarts at every chunk boundary, so
+/// malformed input may cascade differently than in MainLoop.
+static std::vector<std::unique_ptr<ParsedChunk>>
+ParseInParallel(TokenStream &Toks, unsigned NumThreads, bool Iterative) {
+    auto Chunks = SplitTopLevel(Toks, NumThreads == 1 ? 1 : NumThreads * 8);
+    if(NumThreads == 1) {
+        for(auto &Chunk : Chunks) { ParseChunk(Toks, *Chunk, Iterative); }
+        return Chunks;
+    }
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumThreads));
+    for(auto &Chunk : Chunks) {
+        ParsedChunk *C = Chunk.get();
+        Pool.async([&Toks, C, Iterative] { ParseChunk(Toks, *C, Iterative); });
+    }
+    Pool.wait();
+    return Chunks;
+}
+
+/// GenerateChunk - Generate IR for the items of Chunk into a module of its own.
+/// Protos maps each function name to its first prototype in the file, and
+/// Definitions to its first definition that agrees with that prototype.
+static void GenerateChunk(ParsedChunk &Chunk, const SymbolTable &Symbols,
+                          const PrototypeMap &Protos,
+                          const llvm::DenseMap<uint32_t, FunctionAST *> &Definitions,
+                          llvm::StringRef Name) {
+    Chunk.CG = std::make_unique<CodeGen>(Symbols, Chunk.CGDiags, Name);
+    CodeGen &CG = *Chunk.CG;
+    CG.setPrototypes(&Protos);
+    for(TopLevelItem &Item : Chunk.Items) {
+        CG.setItemOffset(Item.Offset);
+        // An earlier prototype or definition may be in another module, where
+        // CodeGen can't see it; catch conflicts with it here.
+        PrototypeAST *Proto = Item.Fn ? Item.Fn->getProto() : nullptr;
+        if(Item.Kind == tok_def && Item.Fn &&
+           Protos.lookup(Proto->getName().getID())->getArgs().size() !=
+               Proto->getArgs().size()) {
+            Chunk.CGDiags.error(Item.Offset, "Function redefined with a different "
+                                             "number of arguments");
+        } else if(Item.Kind == tok_def && Item.Fn &&
+                  Definitions.lookup(Proto->getName().getID()) != Item.Fn) {
+            Chunk.CGDiags.error(Item.Offset, "Function cannot be redefined.");
+        } else if(Item.Fn) {
+            Item.IR = CG.codegen(Item.Fn);
+            // Keep top-level expressions apart from those of other chunks.
+            if(Item.IR && Item.Kind == 0) {
+                Item.IR->setName("__anon_expr." + Name + "." +
+                                 llvm::Twine(&Item - Chunk.Items.data()));
+            }
+        } else if(Item.Proto) {
+            Item.IR = CG.codegen(Item.Proto);
+        }
+        Item.CGDiagEnd = Chunk.CGDiags.getDiagnostics().size();
+    }
+}
+
+/// GenerateInParallel - Generate IR for the items of Chunks on up to
+/// NumThreads threads, one module per chunk, each with its own LLVMContext.
+/// A call to a function from another chunk is resolved by declaring it from
+/// the first prototype of that name anywhere in the file, so, unlike in
+/// MainLoop, a call may precede the definition it refers to.
+static void GenerateInParallel(
+    llvm::ArrayRef<std::unique_ptr<ParsedChunk>> Chunks,
+    const SymbolTable &Symbols, unsigned NumThreads) {
+    PrototypeMap Protos;
+    llvm::DenseMap<uint32_t, FunctionAST *> Definitions;
+    for(auto &Chunk : Chunks) {
+        for(const TopLevelItem &Item : Chunk->Items) {
+            PrototypeAST *Proto = Item.Kind == tok_def && Item.Fn
+                                      ? Item.Fn->getProto() : Item.Proto;
+            if(!Proto) { continue; }
+            uint32_t ID = Proto->getName().getID();
+            PrototypeAST *First = Protos.try_emplace(ID, Proto).first->second;
+            if(Item.Kind == tok_def && Item.Fn &&
+               First->getArgs().size() == Proto->getArgs().size()) {
+                Definitions.try_emplace(ID, Item.Fn);
+            }
+        }
+    }
+
+    auto Generate = [&](size_t I) {
+        GenerateChunk(*Chunks[I], Symbols, Protos, Definitions,
+                      "chunk" + std::to_string(I));
+    };
+    if(NumThreads == 1) {
+        for(size_t I = 0; I != Chunks.size(); ++I) { Generate(I); }
+        return;
+    }
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumThreads));
+    for(size_t I = 0; I != Chunks.size(); ++I) {
+        Pool.async([&Generate, I] { Generate(I); });
+    }
+    Pool.wait();
+}
+
+/// ReplayDiagnostics - Pass the parse and then the codegen diagnostics of
+/// the item at Index in Chunk on to Diags.
+static void ReplayDiagnostics(const ParsedChunk &Chunk, size_t Index,
+                              DiagnosticEngine &Diags) {
+  const TopLevelItem &Item = Chunk.Items[Index];
+  const TopLevelItem *Prev = Index ? &Chunk.Items[Index - 1] : nullptr;
+  uint32_t DiagBegin = Prev ? Prev->DiagEnd : 0;
+  for (const Diagnostic &D :
+       Chunk.Diags.getDiagnostics().slice(DiagBegin, Item.DiagEnd - DiagBegin))
+    Diags.report(D);
+  uint32_t CGDiagBegin = Prev ? Prev->CGDiagEnd : 0;
+  for (const Diagnostic &D : Chunk.CGDiags.getDiagnostics().slice(
+           CGDiagBegin, Item.CGDiagEnd - CGDiagBegin))
+    Diags.report(D);
+}
+
+/// ReportParsedChunks - Report the items of Chunks in source order, as
+/// MainLoop would have while compiling them.
+static void ReportParsedChunks(
+    llvm::ArrayRef<std::unique_ptr<ParsedChunk>> Chunks, SymbolTable &Symbols,
+    DiagnosticEngine &Diags) {
+  for (auto &Chunk : Chunks) {
+    for (size_t I = 0; I != Chunk->Items.size(); ++I) {
+      const TopLevelItem &Item = Chunk->Items[I];
+      ReplayDiagnostics(*Chunk, I, Diags);
+      Diags.flush(stderr);
+      if (PrintAST && Item.Proto) {
+        ASTPrinter(Symbols, stderr).printPrototype(Item.Proto);
+        fputc('\n', stderr);
+      } else if (PrintAST && Item.Fn) {
+        ASTPrinter(Symbols, stderr).printFunction(Item.Fn);
+      }
+      if (!Item.IR)
+        continue;
+      fprintf(stderr, Item.Kind == tok_def      ? "Read function definition:"
+                      : Item.Kind == tok_extern ? "Read extern: "
+                                                : "Read top-level expression:");
+      Item.IR->print(llvm::errs());
+      fprintf(stderr, "\n");
+    }
+  }
+}
+
+/// RunInJIT - Move the modules of Chunks into JIT, then run their top-level
+/// expressions in source order, reporting failures to Diags and, if Print is
+/// set, printing each value as MainLoop would.
+static void RunInJIT(llvm::ArrayRef<std::unique_ptr<ParsedChunk>> Chunks,
+                     KaleidoscopeJIT &JIT, DiagnosticEngine &Diags,
+                     bool Print) {
+  std::vector<std::pair<std::string, uint32_t>> Exprs; // name, source offset
+  for (auto &Chunk : Chunks) {
+    for (const TopLevelItem &Item : Chunk->Items)
+      if (Item.Kind == 0 && Item.IR)
+        Exprs.emplace_back(Item.IR->getName().str(), Item.Offset);
+    if (llvm::Error Err = JIT.addModule(Chunk->CG->takeModule())) {
+      Diags.error(Chunk->Items.empty() ? 0 : Chunk->Items.front().Offset,
+                  llvm::toString(std::move(Err)));
+    }
+  }
+
+  for (auto &Expr : Exprs) {
+    auto Sym = JIT.lookup(Expr.first);
+    if (!Sym) {
+      Diags.error(Expr.second, llvm::toString(Sym.takeError()));
+      continue;
+    }
+    double Result =
+        llvm::jitTargetAddressToPointer<double (*)()>(Sym->getAddress())();
+    if (Print) {
+      Diags.flush(stderr);
+      fprintf(stderr, "Evaluated to %f\n", Result);
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+/// ClassifyIdentifierLinear - Keyword detection as GetTok originally did it:
+/// materialize the spelling, then compare it against each keyword in turn.
+/// Kept only as the baseline for RunLexerBenchmark.
+static int ClassifyIdentifierLinear(llvm::StringRef Spelling) {
+    std::string IdentifierStr = Spelling.str();
+    for(const KeywordInfo &K : Keywords) {
+        if(IdentifierStr == K.Spelling) { return K.Tok; }
+    }
+    return tok_identifier;
+}
+
+/// EvalBinop - The value of L Op R; unknown operators yield 0.
+static double EvalBinop(char Op, double L, double R) {
+    switch(Op) {
+    case '+': return L + R;
+    case '-': return L - R;
+    case '*': return L * R;
+    case '<': return L < R ? 1.0 : 0.0;
+    default: return 0.0;
+    }
+}
+
+namespace {
+/// TreeEvaluator - The traversal timed for the ExprAST classes: evaluate with
+/// every variable bound to 1 and every call returning the sum of its
+/// arguments. Also counts the nodes visited and the bytes they occupy.
+class TreeEvaluator: public ExprVisitor<TreeEvaluator, double> {
+public:
+    size_t Nodes = 0, Bytes = 0;
+
+    double visitNumberExpr(NumberExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(NumberExprAST);
+        return E->getVal();
+    }
+    double visitVariableExpr(VariableExprAST *) {
+        ++Nodes;
+        Bytes += sizeof(VariableExprAST);
+        return 1.0;
+    }
+    double visitBinaryExpr(BinaryExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(BinaryExprAST);
+        double L = visit(E->getLHS());
+        return EvalBinop(E->getOp(), L, visit(E->getRHS()));
+    }
+    double visitCallExpr(CallExprAST *E) {
+        ++Nodes;
+        Bytes += sizeof(CallExprAST) + E->getArgs().size() * sizeof(ExprAST *);
+        double Sum = 0;
+        for(ExprAST *Arg : E->getArgs()) { Sum += visit(Arg); }
+        return Sum;
+    }
+};
+} // end of the namespace
+
+/// EvalFlat - The same evaluation over a FlatExprPool, as one forward loop
+/// that stores each node's value in Values.
+static void EvalFlat(const FlatExprPool &Pool, std::vector<double> &Values) {
+    Values.resize(Pool.size());
+    for(NodeId N = 0, E = Pool.size(); N != E; ++N) {
+        switch(Pool.getKind(N)) {
+        case FlatExprPool::Number:
+            Values[N] = Pool.getNumber(N);
+            break;
+        case FlatExprPool::Variable:
+            Values[N] = 1.0;
+            break;
+        case FlatExprPool::Binary:
+            Values[N] = EvalBinop(Pool.getOp(N), Values[Pool.getLHS(N)],
+                                  Values[Pool.getRHS(N)]);
+            break;
+        case FlatExprPool::Call: {
+            double Sum = 0;
+            for(NodeId Arg : Pool.getArgs(N)) { Sum += Values[Arg]; }
+            Values[N] = Sum;
+            break;
+        }
+        }
+    }
+}
+
+/// RunASTBenchmark - Parse Source into ExprAST classes and into a
+/// FlatExprPool, then compare their size and how fast each is traversed.
+static int RunASTBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-ast needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    ASTContext Ctx;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+    Parser P(Toks, Ctx, Diags);
+    P.GetNextToken();
+    std::vector<FunctionAST *> Fns;
+    ParseAllFunctions(P, Fns);
+
+    auto Start = BenchClock::now();
+    FlatExprPool Pool;
+    std::vector<NodeId> Roots;
+    for(FunctionAST *F : Fns) { Roots.push_back(Pool.flatten(F->getBody())); }
+    double FlattenTime = SecondsSince(Start);
+
+    TreeEvaluator Eval;
+    double TreeSum = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        Eval = TreeEvaluator();
+        TreeSum = 0;
+        for(FunctionAST *F : Fns) { TreeSum += Eval.visit(F->getBody()); }
+    }
+    double TreeTime = SecondsSince(Start);
+    size_t Nodes = Eval.Nodes, Bytes = Eval.Bytes;
+
+    std::vector<double> Values;
+    double FlatSum = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        EvalFlat(Pool, Values);
+        FlatSum = 0;
+        for(NodeId Root : Roots) { FlatSum += Values[Root]; }
+    }
+    double FlatTime = SecondsSince(Start);
+
+    double Visited = double(Nodes) * Iterations;
+    fprintf(stderr, "class AST: %zu nodes, %.1f bytes/node, %.1f Mnodes/s\n",
+            Nodes, Nodes ? double(Bytes) / Nodes : 0.0, Visited / TreeTime / 1e6);
+    fprintf(stderr, "flat AST:  %zu nodes, %.1f bytes/node, %.1f Mnodes/s (%.2fx), "
+            "built in %.3fs\n", Pool.size(),
+            Pool.size() ? double(Pool.getMemoryBytes()) / Pool.size() : 0.0,
+            Visited / FlatTime / 1e6, TreeTime / FlatTime, FlattenTime);
+    if(TreeSum != FlatSum) {
+        fprintf(stderr, "Error: traversal results differ (%g vs %g)\n", TreeSum, FlatSum);
+        return 1;
+    }
+    return 0;
+}
+
+/// SameExpr - Whether A and B are structurally identical expressions.
+static bool SameExpr(const ExprAST *A, const ExprAST *B) {
+    if(A->getKind() != B->getKind()) { return false; }
+    switch(A->getKind()) {
+    case ExprAST::EK_Number:
+        return llvm::cast<NumberExprAST>(A)->getVal() ==
+               llvm::cast<NumberExprAST>(B)->getVal();
+    case ExprAST::EK_Variable:
+        return llvm::cast<VariableExprAST>(A)->getName() ==
+               llvm::cast<VariableExprAST>(B)->getName();
+    case ExprAST::EK_Binary: {
+        auto *BA = llvm::cast<BinaryExprAST>(A), *BB = llvm::cast<BinaryExprAST>(B);
+        return BA->getOp() == BB->getOp() && SameExpr(BA->getLHS(), BB->getLHS()) &&
+               SameExpr(BA->getRHS(), BB->getRHS());
+    }
+    case ExprAST::EK_Call: {
+        auto *CA = llvm::cast<CallExprAST>(A), *CB = llvm::cast<CallExprAST>(B);
+        if(CA->getCallee() != CB->getCallee() ||
+           CA->getArgs().size() != CB->getArgs().size()) { return false; }
+        for(size_t I = 0, E = CA->getArgs().size(); I != E; ++I) {
+            if(!SameExpr(CA->getArgs()[I], CB->getArgs()[I])) { return false; }
+        }
+        return true;
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+/// RunParserBenchmark - Parse the pre-lexed Source Iterations times with the
+/// recursive and with the iterative expression parser, then check that both
+/// built the same trees.
+static int RunParserBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-parse needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+
+    for(bool Iterative : {false, true}) {
+        size_t Items = 0, Nodes = 0;
+        unsigned Errors = 0;
+        auto Start = BenchClock::now();
+        for(unsigned I = 0; I != Iterations; ++I) {
+            ASTContext Ctx;
+            Parser P(Toks, Ctx, Diags);
+            P.setIterative(Iterative);
+            P.GetNextToken();
+            std::vector<FunctionAST *> Fns;
+            Errors = ParseAllFunctions(P, Fns);
+            Items = Fns.size();
+            Nodes = Ctx.getNumNodes();
+        }
+        double Time = SecondsSince(Start);
+        fprintf(stderr, "%-9s parser: %zu items, %zu nodes, %u errors, %.3fs, %.1f Mnodes/s\n",
+                Iterative ? "iterative" : "recursive", Items, Nodes, Errors,
+                Time, double(Nodes) * Iterations / Time / 1e6);
+    }
+
+    // One more, untimed, parse with each to compare what they built.
+    ASTContext Ctxs[2];
+    std::vector<FunctionAST *> Fns[2];
+    for(bool Iterative : {false, true}) {
+        Parser P(Toks, Ctxs[Iterative], Diags);
+        P.setIterative(Iterative);
+        P.GetNextToken();
+        ParseAllFunctions(P, Fns[Iterative]);
+    }
+    if(Fns[0].size() != Fns[1].size()) {
+        fprintf(stderr, "Error: the parsers found %zu and %zu items\n",
+                Fns[0].size(), Fns[1].size());
+        return 1;
+    }
+    for(size_t I = 0, E = Fns[0].size(); I != E; ++I) {
+        if(!SameExpr(Fns[0][I]->getBody(), Fns[1][I]->getBody())) {
+            fprintf(stderr, "Error: the parsers disagree on item %zu\n", I);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// RunParallelBenchmark - Parse the pre-lexed Source with ParseInParallel on
+/// 1, 2, 4, ... up to MaxThreads threads and report the speedup over one.
+static int RunParallelBenchmark(SourceBuffer &Source, unsigned MaxThreads) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-parallel needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+
+    fprintf(stderr, "%u hardware threads, %zu tokens\n",
+            llvm::hardware_concurrency().compute_thread_count(), Toks.size());
+    double BaseTime = 0;
+    for(unsigned Threads = 1;; Threads = std::min(Threads * 2, MaxThreads)) {
+        // Best of three, to keep scheduling noise out of the curve.
+        double Time = 1e30;
+        size_t Items = 0, Nodes = 0;
+        for(int Run = 0; Run != 3; ++Run) {
+            auto Start = BenchClock::now();
+            auto Chunks = ParseInParallel(Toks, Threads, false);
+            Time = std::min(Time, SecondsSince(Start));
+            Items = Nodes = 0;
+            for(auto &Chunk : Chunks) {
+                Items += Chunk->Items.size();
+                Nodes += Chunk->Ctx.getNumNodes();
+            }
+        }
+        if(Threads == 1) { BaseTime = Time; }
+        fprintf(stderr, "%3u threads: %zu items, %zu nodes, %.3fs, %.1f Mnodes/s, %.2fx\n",
+                Threads, Items, Nodes, Time, double(Nodes) / Time / 1e6,
+                BaseTime / Time);
+        if(Threads == MaxThreads) { break; }
+    }
+    return 0;
+}
+
+/// RunLexerBenchmark - Lex Source Iterations times and report token and
+/// identifier throughput, then time keyword classification of every word in
+/// the input with the original linear chain and with the perfect hash.
+static int RunLexerBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-lex needs a file or piped input\n");
+        return 1;
+    }
+
+    size_t Tokens = 0, Idents = 0;
+    std::vector<llvm::StringRef> Words; // identifier and keyword spellings
+    auto Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        SymbolTable Symbols;
+        DiagnosticEngine Diags(Source);
+        Lexer Lex(Source, Symbols, Diags);
+        for(int Tok = Lex.getNextToken(); Tok != tok_eof; Tok = Lex.getNextToken()) {
+            ++Tokens;
+            if(Tok == tok_identifier || Tok == tok_def || Tok == tok_extern) {
+                ++Idents;
+                if(I == 0) { Words.push_back(Lex.getTokenSpelling()); }
+            }
+        }
+    }
+    double LexTime = SecondsSince(Start);
+    double GB = double(Source.getBufferSize()) * Iterations / 1e9;
+    fprintf(stderr, "lexer:   [%s] %zu tokens in %.3fs: %.1f Mtok/s, %.1f Mident/s, %.3f GB/s\n",
+            DefaultScanKernels->Name, Tokens, LexTime, Tokens / LexTime / 1e6,
+            Idents / LexTime / 1e6, GB / LexTime);
+
+    // Keyword classification alone, before and after.
+    unsigned Sink = 0;
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        for(llvm::StringRef W : Words) { Sink += ClassifyIdentifierLinear(W); }
+    }
+    double LinearTime = SecondsSince(Start);
+    Start = BenchClock::now();
+    for(unsigned I = 0; I != Iterations; ++I) {
+        for(llvm::StringRef W : Words) { Sink += ClassifyIdentifier(W.data(), W.size()); }
+    }
+    double HashTime = SecondsSince(Start);
+    double NumWords = double(Words.size()) * Iterations;
+    fprintf(stderr, "keyword: linear %.1f Mident/s, perfect hash %.1f Mident/s (%.2fx) [%u]\n",
+            NumWords / LinearTime / 1e6, NumWords / HashTime / 1e6,
+            LinearTime / HashTime, Sink);
+    return 0;
+}
+
+/// RunVMBenchmark - Evaluate the top-level expressions of Source Iterations
+/// times with the AST interpreter, the bytecode VM and the JIT, each in a
+/// session and JIT of its own, and report what each engine costs up front
+/// and per expression.
+static int RunVMBenchmark(SourceBuffer &Source, unsigned Iterations) {
+    if(Source.isInteractive()) {
+        fprintf(stderr, "Error: -bench-vm needs a file or piped input\n");
+        return 1;
+    }
+
+    SymbolTable Symbols;
+    ASTContext Ctx;
+    DiagnosticEngine Diags(Source);
+    TokenStream Toks(Source, Symbols, Diags);
+    Toks.lexAll();
+    Parser P(Toks, Ctx, Diags);
+    P.GetNextToken();
+    std::vector<FunctionAST *> Fns, Defs, Exprs;
+    std::vector<PrototypeAST *> Externs;
+    ParseAllFunctions(P, Fns, &Externs);
+    for(FunctionAST *F : Fns) {
+        bool IsAnon = F->getProto()->getName() == Symbols.getAnonExpr();
+        (IsAnon ? Exprs : Defs).push_back(F);
+    }
+    // Every engine has to accept a function that calls itself, though nothing
+    // can call this one: without a conditional, the recursion never ends. Its
+    // name can't be spelled in the input, so it doesn't clash with any there.
+    Symbol SelfName = Symbols.intern("bench.self"), X = Symbols.intern("x");
+    ExprAST *SelfArgs[] = {Ctx.create<VariableExprAST>(X)};
+    Defs.push_back(Ctx.create<FunctionAST>(
+        Ctx.create<PrototypeAST>(SelfName, Ctx.copyArray<Symbol>(X)),
+        Ctx.create<CallExprAST>(SelfName, Ctx.copyArray<ExprAST *>(SelfArgs))));
+
+    struct EngineTimes {
+        const char *Name;
+        double Setup, Run, Sum;
+    };
+    std::vector<EngineTimes> Engines;
+    // Sets up a session in Mode with Setup, then times Iterations rounds of
+    // Eval over every top-level expression.
+    auto Measure = [&](const char *Name, ExecutionMode Mode, auto Setup,
+                       auto Eval) {
+        auto JIT = KaleidoscopeJIT::create();
+        if(!JIT) { return false; }
+        JITSession S(Symbols, Diags, *JIT, Mode, UINT_MAX);
+        for(PrototypeAST *Proto : Externs) { S.addPrototype(Proto); }
+        auto Start = BenchClock::now();
+        Setup(S);
+        double SetupTime = SecondsSince(Start);
+        if(Diags.getNumErrors()) { return false; }
+
+        double Sum = 0;
+        Start = BenchClock::now();
+        for(unsigned I = 0; I != Iterations; ++I) {
+            Sum = 0;
+            for(size_t E = 0; E != Exprs.size(); ++E) {
+                double Result;
+                if(!Eval(S, E, Result)) { return false; }
+                Sum += Result;
+            }
+        }
+        Engines.push_back({Name, SetupTime, SecondsSince(Start), Sum});
+        return true;
+    };
+
+    // The interpreter of a tiered session that never promotes anything.
+    bool OK = !Diags.getNumErrors() && Measure(
+        "AST interpreter", EM_Tiered,
+        [&](JITSession &S) {
+            for(FunctionAST *F : Defs) { S.addLazyDefinition(F, 0); }
+        },
+        [&](JITSession &S, size_t E, double &Result) {
+            return S.interpret(Exprs[E], 0, Result);
+        });
+
+    std::vector<std::unique_ptr<BytecodeFunction>> Lowered;
+    OK = OK && Measure(
+        "bytecode VM", EM_Bytecode,
+        [&](JITSession &S) {
+            for(FunctionAST *F : Defs) { S.addBytecodeDefinition(F, 0); }
+            for(FunctionAST *F : Exprs) { Lowered.push_back(S.lowerBytecode(F, 0)); }
+        },
+        [&](JITSession &S, size_t E, double &Result) {
+            return S.runBytecode(*Lowered[E], 0, Result);
+        });
+
+    // Every expression gets a function of its own in one module, compiled
+    // before the clock starts.
+    std::vector<llvm::JITTargetAddress> Compiled;
+    OK = OK && Measure(
+        "JIT", EM_Eager,
+        [&](JITSession &S) {
+            for(FunctionAST *F : Defs) {
+                if(S.getCodeGen().codegen(F) && S.addModule(0)) {
+                    S.addPrototype(F->getProto());
+                }
+            }
+            std::vector<std::string> Names;
+            for(FunctionAST *F : Exprs) {
+                if(auto *FnIR = S.getCodeGen().codegen(F)) {
+                    Names.push_back(FnIR->getName().str());
+                }
+            }
+            S.addModule(0);
+            for(const std::string &Name : Names) {
+                auto Sym = S.lookup(Name, 0);
+                Compiled.push_back(Sym ? Sym->getAddress() : 0);
+            }
+        },
+        [&](JITSession &, size_t E, double &Result) {
+            Result = CallNative(Compiled[E], llvm::None);
+            return true;
+        });
+
+    if(!OK) {
+        Diags.finish();
+        Diags.flush(stderr);
+        fprintf(stderr, "Error: the input can't be benchmarked\n");
+        return 1;
+    }
+    double Evals = double(Exprs.size()) * Iterations;
+    for(const EngineTimes &E : Engines) {
+        fprintf(stderr, "%-16s setup %8.3f ms, %9.1f ns/expr (%.2fx)\n",
+                E.Name, E.Setup * 1e3, E.Run / Evals * 1e9,
+                Engines[0].Run / E.Run);
+    }
+    for(const EngineTimes &E : Engines) {
+        if(E.Sum != Engines[0].Sum) {
+            fprintf(stderr, "Error: results differ (%g vs %g)\n", Engines[0].Sum, E.Sum);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+static llvm::cl::list<std::string> InputFilenames(llvm::cl::Positional,
+                                                  llvm::cl::desc("<input files>"),
+                                                  llvm::cl::ZeroOrMore);
+
+static llvm::cl::opt<bool> Batch(
+    "batch",
+    llvm::cl::desc("Compile the input files without prompts or per-item "
+                   "messages, then print their diagnostics and one summary"));
+
+static llvm::cl::opt<bool>
+    ASTStats("ast-stats",
+             llvm::cl::desc("Print AST arena allocation statistics on exit"));
+
+static llvm::cl::opt<unsigned> BenchLex(
+    "bench-lex", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Lex the input N times, report throughput and exit"));
+
+static llvm::cl::opt<bool> Pretokenize(
+    "pretokenize",
+    llvm::cl::desc("Lex the whole input into a token array before parsing"));
+
+static llvm::cl::opt<unsigned> BenchAST(
+    "bench-ast", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Compare N traversals of the class and flat ASTs and exit"));
+
+static llvm::cl::opt<bool> IterativeParser(
+    "iterative-parser",
+    llvm::cl::desc("Parse expressions with explicit stacks, not recursion"));
+
+static llvm::cl::list<std::string> UserBinops(
+    "binop", llvm::cl::value_desc("op:prec[:right]"),
+    llvm::cl::desc("Register a binary operator with the given precedence "
+                   "(1-127; 0 removes it), optionally right-associative"));
+
+static llvm::cl::opt<unsigned> BenchVM(
+    "bench-vm", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Evaluate the top-level expressions N times with the AST "
+                   "interpreter, the bytecode VM and the JIT, and exit"));
+
+static llvm::cl::opt<unsigned> BenchParse(
+    "bench-parse", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Parse the input N times with each expression parser and exit"));
+
+static llvm::cl::opt<unsigned> ParseThreads(
+    "parallel-parse", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Lex the whole input, then parse its top-level items on N "
+                   "threads (0 = all hardware threads)"));
+
+static llvm::cl::opt<unsigned> BenchParallel(
+    "bench-parallel", llvm::cl::value_desc("N"),
+    llvm::cl::desc("Report parallel parsing speedup on up to N threads and exit"));
+
+static llvm::cl::opt<std::string> LexKernel(
+    "lex-kernel", llvm::cl::init("auto"),
+    llvm::cl::desc("Lexer scanning kernels: auto, scalar, sse2 or avx2"));
+
+static llvm::cl::opt<bool> EmitLLVM(
+    "emit-llvm",
+    llvm::cl::desc("With -batch or -parallel-parse, print the generated "
+                   "modules to standard output"));
+
+static llvm::cl::opt<bool> LazyJIT(
+    "lazy",
+    llvm::cl::desc("In the REPL, generate and compile each function "
+                   "definition on its first call rather than when it is read"));
+
+static llvm::cl::opt<bool> Tiered(
+    "tiered",
+    llvm::cl::desc("In the REPL, interpret top-level expressions and compile "
+                   "functions in the background once they are hot (implies "
+                   "-lazy)"));
+
+static llvm::cl::opt<unsigned> TierThreshold(
+    "tier-threshold", llvm::cl::init(100), llvm::cl::value_desc("N"),
+    llvm::cl::desc("With -tiered, compile a function after N interpreted "
+                   "calls (at least 1)"));
+
+static llvm::cl::opt<bool> BytecodeVMMode(
+    "vm",
+    llvm::cl::desc("In the REPL, lower everything to bytecode and run it on "
+                   "a register VM instead of compiling it (overrides -lazy "
+                   "and -tiered)"));
+
+static llvm::cl::opt<unsigned> Reoptimize(
+    "reoptimize", llvm::cl::value_desc("N"),
+    llvm::cl::desc("In the eager REPL, compile quickly at -O0, then recompile "
+                   "each called function at -O3 on N background threads "
+                   "(0 = all hardware threads)"));
+
+static llvm::cl::opt<OptPipeline> DefinitionPipeline(
+    "opt", llvm::cl::init(OPT_Fast),
+    llvm::cl::desc("Optimization pipeline for function definitions without "
+                   "an annotation (default: fast in the REPL, O3 with -batch "
+                   "or -parallel-parse)"),
+    llvm::cl::values(
+        clEnumValN(OPT_O0, "O0", "no optimization"),
+        clEnumValN(OPT_Fast, "fast",
+                   "mem2reg, instcombine, reassociate, GVN and simplifycfg"),
+        clEnumValN(OPT_O3, "O3", "LLVM's standard -O3 pipeline")));
+
+static llvm::cl::opt<OptPipeline> ExpressionPipeline(
+    "expr-opt", llvm::cl::init(OPT_O0),
+    llvm::cl::desc("Optimization pipeline for top-level expressions"),
+    llvm::cl::values(
+        clEnumValN(OPT_O0, "O0", "no optimization"),
+        clEnumValN(OPT_Fast, "fast",
+                   "mem2reg, instcombine, reassociate, GVN and simplifycfg"),
+        clEnumValN(OPT_O3, "O3", "LLVM's standard -O3 pipeline")));
+
+static llvm::cl::opt<bool> PrintPassTimes(
+    "pass-times",
+    llvm::cl::desc("Print the time spent in each optimization pipeline and "
+                   "pass, on exit"));
+
+static llvm::cl::opt<std::string> ObjectCacheDir(
+    "object-cache", llvm::cl::value_desc("dir"),
+    llvm::cl::desc("Keep compiled objects in dir and load them in later "
+                   "sessions instead of compiling the same code again"));
+
+static llvm::cl::opt<unsigned> ObjectCacheMaxSize(
+    "object-cache-max-size", llvm::cl::init(256), llvm::cl::value_desc("MiB"),
+    llvm::cl::desc("On exit, evict the least recently used cached objects "
+                   "beyond this total size (0 = no limit)"));
+
+static llvm::cl::opt<unsigned> ObjectCacheMaxAge(
+    "object-cache-max-age", llvm::cl::init(7 * 24),
+    llvm::cl::value_desc("hours"),
+    llvm::cl::desc("On exit, evict cached objects unused for this long "
+                   "(0 = no limit)"));
+
+static llvm::cl::opt<bool>
+    JITStats("jit-stats",
+             llvm::cl::desc("Print how many definitions the REPL compiled and "
+                            "how long top-level expressions took, on exit"));
+
+static llvm::cl::opt<unsigned> ErrorLimit(
+    "error-limit", llvm::cl::init(20), llvm::cl::value_desc("N"),
+    llvm::cl::desc("With -batch or -parallel-parse, stop reporting errors "
+                   "after N per file (0 = no limit)"));
+
+static llvm::cl::opt<DiagFormat> DiagnosticsFormat(
+    "diagnostics-format", llvm::cl::init(DF_Text),
+    llvm::cl::desc("How diagnostics are printed"),
+    llvm::cl::values(clEnumValN(DF_Text, "text", "file:line:col: message"),
+                     clEnumValN(DF_JSON, "json", "one JSON object per line")));
+
+/// RegisterBinops - Add the operators given with -binop to DefaultBinops.
+/// Returns false after reporting a malformed one, or one the lexer never
+/// returns as a token of its own ('#' starts a comment, '.' a number).
+static bool RegisterBinops() {
+  for (llvm::StringRef Spec : UserBinops) {
+    llvm::StringRef Op, Prec, Assoc;
+    std::tie(Op, Prec) = Spec.split(':');
+    std::tie(Prec, Assoc) = Prec.split(':');
+    unsigned P;
+    bool Valid = Op.size() == 1 && isascii(Op[0]) && ispunct(Op[0]) &&
+                 !llvm::StringRef("(),;#.").contains(Op[0]) &&
+                 !Prec.getAsInteger(10, P) &&
+                 (Assoc.empty() || Assoc == "left" || Assoc == "right");
+    if (Valid && P == 0)
+      DefaultBinops.removeBinop(Op[0]);
+    else if (!Valid || !DefaultBinops.addBinop(Op[0], P, Assoc == "right")) {
+      fprintf(stderr, "Error: bad -binop '%s', expected op:prec[:right]\n",
+              Spec.str().c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/// ConfigureDiagnostics - Apply the diagnostic options to Diags.
+static void ConfigureDiagnostics(DiagnosticEngine &Diags) {
+  Diags.setErrorLimit(ErrorLimit);
+  Diags.setCollapseRepeats(true);
+  Diags.setFormat(DiagnosticsFormat);
+}
+
+/// GetJITOptions - The JIT options the command line asks for, reporting pass
+/// times to Times if asked and caching objects in Cache if not null.
+/// Unannotated definitions default to -O3 when a WholeProgram is compiled up
+/// front.
+static JITOptions GetJITOptions(bool WholeProgram, PassTimeReport &Times,
+                                ObjectFileCache *Cache) {
+  JITOptions Opts;
+  Opts.Definitions = DefinitionPipeline.getNumOccurrences() ? DefinitionPipeline
+                     : WholeProgram                          ? OPT_O3
+                                                             : OPT_Fast;
+  Opts.Expressions = ExpressionPipeline;
+  if (PrintPassTimes)
+    Opts.PassTimes = &Times;
+  Opts.Cache = Cache;
+  return Opts;
+}
+
+/// FinishCompilation - Print the pass times if asked, and prune the object
+/// cache, if any, and report on it.
+static void FinishCompilation(PassTimeReport &Times, ObjectFileCache *Cache) {
+  if (PrintPassTimes)
+    Times.print(stderr);
+  if (Cache) {
+    Cache->prune(std::chrono::hours(ObjectCacheMaxAge),
+                 uint64_t(ObjectCacheMaxSize) << 20);
+    Cache->printStats(stderr);
+  }
+}
+
+/// RunBatch - Compile each of Files in turn without any interactive output.
+/// Diagnostics are collected and written out in one go at the end, followed
+/// by a summary line, so that the time spent reflects compilation rather than
+/// terminal I/O. As the files are lexed whole before parsing, lexical errors
+/// are listed before syntax errors. The summary counts every error reported,
+/// lexical ones included. Returns the exit status.
+static int RunBatch(llvm::ArrayRef<std::string> Files, const JITOptions &Opts) {
+  auto Start = BenchClock::now();
+  unsigned Threads =
+      ParseThreads.getNumOccurrences()
+          ? (ParseThreads ? ParseThreads
+                          : llvm::hardware_concurrency().compute_thread_count())
+          : 1;
+  std::string DiagText;
+  size_t Bytes = 0, Counts[3] = {0, 0, 0}; // definitions, externs, exprs
+  unsigned Errors = 0, BadFiles = 0;
+  for (const std::string &File : Files) {
+    auto Source = File == "-" ? SourceBuffer::getSTDIN()
+                              : SourceBuffer::getFile(File);
+    if (!Source) {
+      ++BadFiles;
+      continue;
+    }
+    Bytes += Source->getBufferSize();
+
+    SymbolTable Symbols;
+    DiagnosticEngine Diags(*Source);
+    ConfigureDiagnostics(Diags);
+    TokenStream Toks(*Source, Symbols, Diags);
+    Toks.lexAll();
+    auto Chunks = ParseInParallel(Toks, Threads, IterativeParser);
+    GenerateInParallel(Chunks, Symbols, Threads);
+    for (auto &Chunk : Chunks) {
+      for (size_t I = 0; I != Chunk->Items.size(); ++I) {
+        const TopLevelItem &Item = Chunk->Items[I];
+        ReplayDiagnostics(*Chunk, I, Diags);
+        if (Item.IR)
+          ++Counts[Item.Kind == tok_def ? 0 : Item.Kind == tok_extern ? 1 : 2];
+      }
+      if (EmitLLVM)
+        Chunk->CG->getModule().print(llvm::outs(), nullptr);
+    }
+    if (auto JIT = KaleidoscopeJIT::create(Opts))
+      RunInJIT(Chunks, *JIT, Diags, /*Print=*/false);
+    else
+      ++BadFiles;
+    Diags.finish();
+    Errors += Diags.getNumErrors();
+    Diags.render(DiagText);
+  }
+
+  fwrite(DiagText.data(), 1, DiagText.size(), stderr);
+  fprintf(stderr,
+          "%zu files, %zu bytes: %zu definitions, %zu externs, %zu top-level "
+          "exprs, %u errors in %.3fs\n",
+          Files.size(), Bytes, Counts[0], Counts[1], Counts[2], Errors,
+          SecondsSince(Start));
+  return Errors || BadFiles ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+
+  DefaultScanKernels = SelectScanKernels(LexKernel);
+  if (!DefaultScanKernels) {
+    fprintf(stderr, "Error: lexer kernels '%s' are not available\n",
+            LexKernel.c_str());
+    return 1;
+  }
+  if (!RegisterBinops())
+    return 1;
+
+  if (InputFilenames.empty())
+    InputFilenames.push_back("-");
+  PassTimeReport PassTimes;
+  std::unique_ptr<ObjectFileCache> Cache;
+  if (!ObjectCacheDir.empty()) {
+    Cache = ObjectFileCache::create(ObjectCacheDir);
+    if (!Cache)
+      return 1;
+  }
+  if (Batch) {
+    int Status =
+        RunBatch(InputFilenames, GetJITOptions(true, PassTimes, Cache.get()));
+    FinishCompilation(PassTimes, Cache.get());
+    return Status;
+  }
+  if (InputFilenames.size() > 1) {
+    fprintf(stderr, "Error: more than one input file needs -batch\n");
+    return 1;
+  }
+
+  // Lex a file if one is given, otherwise standard input (a terminal is read
+  // lazily, which keeps the REPL interactive).
+  const std::string &InputFilename = InputFilenames.front();
+  auto Source = InputFilename == "-" ? SourceBuffer::getSTDIN()
+                                     : SourceBuffer::getFile(InputFilename);
+  if (!Source)
+    return 1;
+
+  if (BenchLex)
+    return RunLexerBenchmark(*Source, BenchLex);
+  if (BenchAST)
+    return RunASTBenchmark(*Source, BenchAST);
+  if (BenchParse)
+    return RunParserBenchmark(*Source, BenchParse);
+  if (BenchVM)
+    return RunVMBenchmark(*Source, BenchVM);
+  if (BenchParallel)
+    return RunParallelBenchmark(*Source, BenchParallel);
+
+  SymbolTable Symbols;
+  ASTContext Ctx;
+  DiagnosticEngine Diags(*Source);
+  ConfigureDiagnostics(Diags);
+  TokenStream Toks(*Source, Symbols, Diags);
+  if (ParseThreads.getNumOccurrences()) {
+    Toks.lexAll();
+    unsigned Threads = ParseThreads ? ParseThreads
+                                    : llvm::hardware_concurrency()
+                                          .compute_thread_count();
+    auto Chunks = ParseInParallel(Toks, Threads, IterativeParser);
+    GenerateInParallel(Chunks, Symbols, Threads);
+    ReportParsedChunks(Chunks, Symbols, Diags);
+    if (EmitLLVM)
+      for (auto &Chunk : Chunks)
+        Chunk->CG->getModule().print(llvm::outs(), nullptr);
+    auto JIT =
+        KaleidoscopeJIT::create(GetJITOptions(true, PassTimes, Cache.get()));
+    if (!JIT)
+      return 1;
+    RunInJIT(Chunks, *JIT, Diags, /*Print=*/true);
+    Diags.finish();
+    Diags.flush(stderr);
+    if (ASTStats)
+      for (auto &Chunk : Chunks)
+        Chunk->Ctx.printStats(stderr);
+    FinishCompilation(PassTimes, Cache.get());
+    return Diags.getNumErrors() ? 1 : 0;
+  }
+  // The error limit is for whole files; a REPL session shows every error.
+  Diags.setErrorLimit(0);
+  if (Pretokenize)
+    Toks.lexAll();
+  Parser P(Toks, Ctx, Diags);
+  P.setIterative(IterativeParser);
+  ExecutionMode Mode = BytecodeVMMode ? EM_Bytecode
+                       : Tiered       ? EM_Tiered
+                       : LazyJIT      ? EM_Lazy
+                                      : EM_Eager;
+  JITOptions Opts = GetJITOptions(false, PassTimes, Cache.get());
+  Opts.ConcurrentCompiles = Mode == EM_Tiered;
+  if (Reoptimize.getNumOccurrences()) {
+    if (Mode != EM_Eager) {
+      fprintf(stderr, "Error: -reoptimize can't be combined with -lazy, "
+                      "-tiered or -vm\n");
+      return 1;
+    }
+    Opts.ReoptimizeThreads =
+        Reoptimize ? Reoptimize
+                   : llvm::hardware_concurrency().compute_thread_count();
+  }
+  auto JIT = KaleidoscopeJIT::create(Opts);
+  if (!JIT)
+    return 1;
+  JITSession S(Symbols, Diags, *JIT, Mode,
+               std::max(1u, unsigned(TierThreshold)));
+
+  // Prime the first token.
+  fprintf(stderr, "ready> ");
+  P.GetNextToken();
+
+  // Run the main "interpreter loop" now.
+  MainLoop(P, Ctx, S);
+  Diags.finish();
+  Diags.flush(stderr);
+
+  if (ASTStats)
+    Ctx.printStats(stderr);
+  if (JITStats)
+    S.printStats(stderr);
+  JIT->waitForReoptimization();
+  FinishCompilation(PassTimes, Cache.get());
+
+  return Diags.getNumErrors() ? 1 : 0;
+}
\ No newline at end of file